@@ -0,0 +1,252 @@
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <climits>
+
+#include "BezierLib.h"
+
+//****************************************************
+// Synthetic scene generator
+//
+// BezierGen <out.bez|out.bezb> <patches> [options]
+//   -seed <n>          same seed and options give the same file on any platform
+//   -layout sheet      patches tile one C0 sheet sharing their edges (default)
+//   -layout scatter    independent unit patches at random positions and orientations
+//   -curvature <a>     control point displacement, relative to the patch size
+//   -heavy <f>         fraction of patches with ten times the curvature
+//   -degenerate <f>    fraction of patches with their first row collapsed to a point (scatter only)
+//   -duplicates <f>    fraction of patches that are rigid copies of earlier ones (scatter only)
+//****************************************************
+
+const double PI_GEN = 3.14159265;
+const float HEAVY_SCALE = 10;
+const int DUPLICATE_POOL = 256; // recent distinct patches that copies are drawn from
+
+// xorshift64*, so the sequence does not depend on the standard library
+class Random {
+public:
+    unsigned long long state;
+    Random(unsigned long long seed) {
+        state = seed * 0x9E3779B97F4A7C15ULL + 1;
+        if (state == 0) {
+            state = 1;
+        }
+    }
+    unsigned long long next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+    // uniform in [0, 1)
+    float uniform() {
+        return (float)(next() >> 40) / 16777216.0f;
+    }
+    float signedunit() {
+        return uniform() * 2 - 1;
+    }
+};
+
+// Stateless hash to [0, 1) for values that several patches must agree on
+float hashunit(unsigned long long seed, long long i, long long j, int salt) {
+    Random r(seed ^ ((unsigned long long)i * 0x632BE59BD9B4E019ULL) ^ ((unsigned long long)j * 0x85157AF5ULL) ^ salt);
+    r.next();
+    return r.uniform();
+}
+
+string layout = "sheet";
+unsigned long long seed = 1;
+float curvature = 0.2f;
+float heavyFraction;
+float degenerateFraction;
+float duplicateFraction;
+
+Point netpoint(const Surface& s, int k, int j) {
+    const Curve* rows[4] = { &s.a, &s.b, &s.c, &s.d };
+    const Point* net[4] = { &rows[k]->a, &rows[k]->b, &rows[k]->c, &rows[k]->d };
+    return *net[j];
+}
+
+Surface makesurface(Point p[4][4]) {
+    return Surface(Curve(p[0][0], p[0][1], p[0][2], p[0][3]), Curve(p[1][0], p[1][1], p[1][2], p[1][3]),
+        Curve(p[2][0], p[2][1], p[2][2], p[2][3]), Curve(p[3][0], p[3][1], p[3][2], p[3][3]));
+}
+
+// Control point (i, j) of the sheet's (3w + 1) x (3h + 1) grid; the height only
+// depends on (i, j), so neighbouring patches agree on their shared edges
+Point sheetpoint(long long i, long long j, int width) {
+    long long cu = min(i / 3, (long long)width - 1);
+    long long cv = j / 3;
+    float amplitude = curvature;
+    if (hashunit(seed, cu, cv, 1) < heavyFraction) {
+        amplitude *= HEAVY_SCALE;
+    }
+    float height = amplitude * (hashunit(seed, i, j, 2) * 2 - 1);
+    return Point(i / 3.0f, j / 3.0f, height);
+}
+
+Surface sheetpatch(int index, int width) {
+    long long cu = index % width, cv = index / width;
+    Point p[4][4];
+    for (int k = 0; k < 4; k++) {
+        for (int j = 0; j < 4; j++) {
+            p[k][j] = sheetpoint(3 * cu + k, 3 * cv + j, width);
+        }
+    }
+    return makesurface(p);
+}
+
+// Random orthonormal frame from a unit quaternion (Shoemake)
+void randomframe(Random& random, Vector axes[3]) {
+    float u1 = random.uniform(), u2 = random.uniform() * 2 * (float)PI_GEN, u3 = random.uniform() * 2 * (float)PI_GEN;
+    float a = sqrt(1 - u1), b = sqrt(u1);
+    float x = a * sin(u2), y = a * cos(u2), z = b * sin(u3), w = b * cos(u3);
+    axes[0] = Vector(1 - 2 * (y * y + z * z), 2 * (x * y + w * z), 2 * (x * z - w * y));
+    axes[1] = Vector(2 * (x * y - w * z), 1 - 2 * (x * x + z * z), 2 * (y * z + w * x));
+    axes[2] = Vector(2 * (x * z + w * y), 2 * (y * z - w * x), 1 - 2 * (x * x + y * y));
+}
+
+Surface scatterpatch(Random& random, float extent) {
+    Point center(random.uniform() * extent, random.uniform() * extent, random.uniform() * extent);
+    Vector axes[3];
+    randomframe(random, axes);
+    float amplitude = curvature * (random.uniform() < heavyFraction ? HEAVY_SCALE : 1);
+    Point p[4][4];
+    for (int k = 0; k < 4; k++) {
+        for (int j = 0; j < 4; j++) {
+            float s = j / 3.0f - 0.5f, t = k / 3.0f - 0.5f, h = amplitude * random.signedunit();
+            p[k][j] = Point(center.x + axes[0].x * s + axes[1].x * t + axes[2].x * h,
+                center.y + axes[0].y * s + axes[1].y * t + axes[2].y * h,
+                center.z + axes[0].z * s + axes[1].z * t + axes[2].z * h);
+        }
+    }
+    return makesurface(p);
+}
+
+// Rigid copy of `source`, turned by a random rotation about its first corner,
+// with that corner moved to `origin`
+Surface rigidcopy(Random& random, const Surface& source, Point origin) {
+    Vector axes[3];
+    randomframe(random, axes);
+    Point pivot = netpoint(source, 0, 0);
+    Point p[4][4];
+    for (int k = 0; k < 4; k++) {
+        for (int j = 0; j < 4; j++) {
+            Point q = netpoint(source, k, j);
+            float d[3] = { q.x - pivot.x, q.y - pivot.y, q.z - pivot.z };
+            p[k][j] = Point(origin.x + axes[0].x * d[0] + axes[1].x * d[1] + axes[2].x * d[2],
+                origin.y + axes[0].y * d[0] + axes[1].y * d[1] + axes[2].y * d[2],
+                origin.z + axes[0].z * d[0] + axes[1].z * d[1] + axes[2].z * d[2]);
+        }
+    }
+    return makesurface(p);
+}
+
+// First row collapsed onto its first point, like the pole of a revolved surface
+Surface collapse(const Surface& s) {
+    Point p[4][4];
+    for (int k = 0; k < 4; k++) {
+        for (int j = 0; j < 4; j++) {
+            p[k][j] = k == 0 ? netpoint(s, 0, 0) : netpoint(s, k, j);
+        }
+    }
+    return makesurface(p);
+}
+
+int usage() {
+    printf("Usage: BezierGen <out.bez|out.bezb> <patches> [-seed n] [-layout sheet|scatter] [-curvature a]"
+        " [-heavy f] [-degenerate f] [-duplicates f]\n");
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        return usage();
+    }
+    const char* output = argv[1];
+    char* end;
+    long parsed = strtol(argv[2], &end, 10);
+    if (end == argv[2] || *end != '\0' || parsed <= 0 || parsed > INT_MAX) {
+        printf("Patch count must be a positive integer, got %s\n", argv[2]);
+        return usage();
+    }
+    int count = (int)parsed;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        string ad(argv[i]);
+        if (ad == "-seed") {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if (ad == "-layout") {
+            layout = argv[i + 1];
+        }
+        else if (ad == "-curvature") {
+            curvature = (float)atof(argv[i + 1]);
+        }
+        else if (ad == "-heavy") {
+            heavyFraction = (float)atof(argv[i + 1]);
+        }
+        else if (ad == "-degenerate") {
+            degenerateFraction = (float)atof(argv[i + 1]);
+        }
+        else if (ad == "-duplicates") {
+            duplicateFraction = (float)atof(argv[i + 1]);
+        }
+        else {
+            printf("Unknown option %s\n", argv[i]);
+            return usage();
+        }
+    }
+    if (layout != "sheet" && layout != "scatter") {
+        printf("Unknown layout %s\n", layout.c_str());
+        return usage();
+    }
+    bool sheet = layout == "sheet";
+    // a replaced patch would no longer share its edges with its neighbours
+    if (sheet && (degenerateFraction > 0 || duplicateFraction > 0)) {
+        printf("-degenerate and -duplicates replace whole patches and would tear the shared edges of"
+            " -layout sheet; use -layout scatter\n");
+        return 1;
+    }
+    int width = max(1, (int)ceil(sqrt((double)count)));
+    float extent = 2 * (float)cbrt((double)count); // keeps scattered patches about two sizes apart
+
+    double start = currentTime();
+    PatchWriter writer;
+    if (!writer.open(output, count)) {
+        printf("Could not open %s\n", output);
+        return 1;
+    }
+    Random random(seed);
+    vector<Surface> pool;
+    int duplicates = 0, degenerate = 0;
+    for (int i = 0; i < count; i++) {
+        Surface patch = sheet ? sheetpatch(i, width) : scatterpatch(random, extent);
+        if (!pool.empty() && random.uniform() < duplicateFraction) {
+            const Surface& source = pool[random.next() % pool.size()];
+            patch = rigidcopy(random, source, netpoint(patch, 0, 0));
+            duplicates++;
+        }
+        else {
+            if (random.uniform() < degenerateFraction) {
+                patch = collapse(patch);
+                degenerate++;
+            }
+            if (pool.size() < DUPLICATE_POOL) {
+                pool.push_back(patch);
+            }
+            else {
+                pool[random.next() % DUPLICATE_POOL] = patch;
+            }
+        }
+        writer.write(patch);
+    }
+    if (!writer.close()) {
+        printf("Could not write %s\n", output);
+        return 1;
+    }
+    printf("Wrote %d patches (%s, %d duplicates, %d degenerate) to %s in %.1f ms\n", count, layout.c_str(),
+        duplicates, degenerate, output, (currentTime() - start) * 1e3);
+    return 0;
+}
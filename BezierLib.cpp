@@ -0,0 +1,3171 @@
+#include <fstream>
+#include <cstdio>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <cmath>
+#include <cfloat>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "BezierLib.h"
+
+Vector::Vector() {
+    x = 0.0f;
+    y = 0.0f;
+    z = 0.0f;
+}
+
+Vector::Vector(float a, float b, float c) {
+    x = a;
+    y = b;
+    z = c;
+}
+
+Vector::Vector(Point a, Point b) {
+    float scale = sqrt(pow((b.x - a.x), 2) + pow((b.y - a.y), 2) + pow((b.z - a.z), 2));
+    x = (b.x - a.x) / scale;
+    y = (b.y - a.y) / scale;
+    z = (b.z - a.z) / scale;
+}
+
+void Vector::normalize() {
+    float scale = sqrt(pow((x), 2) + pow((y), 2) + pow((z), 2));
+    x /= scale;
+    y /= scale;
+    z /= scale;
+}
+
+Vector Vector::scalarMult(float s) {
+    return Vector(x*s, y*s, z*s);
+}
+
+Point::Point() {
+    x = 0.0f;
+    y = 0.0f;
+    z = 0.0f;
+}
+
+Point::Point(float a, float b, float c) {
+    x = a;
+    y = b;
+    z = c;
+}
+
+Point Point::scalarMult(float s) const {
+    return Point(x*s, y*s, z*s);
+}
+
+Point Point::add(Point p) const {
+    return Point(x + p.x, y + p.y, z + p.z);
+}
+
+float Point::distance(Point p) const {
+    return sqrt(pow((x - p.x), 2) + pow((y - p.y), 2) + pow((z - p.z), 2));
+}
+
+Point Point::midpoint(Point p) const {
+    return Point((x + p.x) / 2, (y + p.y) / 2, (z + p.z) / 2);
+}
+
+Curve::Curve() {
+
+}
+
+Curve::Curve(Point a1, Point b1, Point c1, Point d1) {
+    a = a1;
+    b = b1;
+    c = c1;
+    d = d1;
+}
+
+Surface::Surface() {
+
+}
+
+Surface::Surface(Curve a1, Curve b1, Curve c1, Curve d1) {
+    a = a1;
+    b = b1;
+    c = c1;
+    d = d1;
+}
+
+// Bezier to power basis: coefficient of t^k is sum_j BEZIER_TO_POWER[k][j] * P_j
+const float BEZIER_TO_POWER[4][4] = {
+    { 1, 0, 0, 0 },
+    { -3, 3, 0, 0 },
+    { 3, -6, 3, 0 },
+    { -1, 3, -3, 1 }
+};
+
+// net[k][j]: row k along v, column j along u
+static void surfacenet(const Surface& patch, Point net[4][4]) {
+    const Curve* rows[4] = { &patch.a, &patch.b, &patch.c, &patch.d };
+    for (int i = 0; i < 4; i++) {
+        net[i][0] = rows[i]->a;
+        net[i][1] = rows[i]->b;
+        net[i][2] = rows[i]->c;
+        net[i][3] = rows[i]->d;
+    }
+}
+
+// PATCH_SHAPE_TOLERANCE scaled to the net's bounding box diagonal
+static float shapetolerance(const Point net[4][4]) {
+    float lo[3] = { net[0][0].x, net[0][0].y, net[0][0].z }, hi[3] = { lo[0], lo[1], lo[2] };
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            const Point& p = net[i][j];
+            lo[0] = min(lo[0], p.x);
+            lo[1] = min(lo[1], p.y);
+            lo[2] = min(lo[2], p.z);
+            hi[0] = max(hi[0], p.x);
+            hi[1] = max(hi[1], p.y);
+            hi[2] = max(hi[2], p.z);
+        }
+    }
+    float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+    return PATCH_SHAPE_TOLERANCE * sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+MonomialPatch::MonomialPatch() {
+    degreeU = 3;
+    degreeV = 3;
+}
+
+MonomialPatch::MonomialPatch(Surface patch) {
+    Point net[4][4];
+    surfacenet(patch, net);
+
+    // c = M * P * M^T, rows of the net run along v and columns along u
+    for (int k = 0; k < 4; k++) {
+        for (int l = 0; l < 4; l++) {
+            float x = 0, y = 0, z = 0;
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    float w = BEZIER_TO_POWER[k][i] * BEZIER_TO_POWER[l][j];
+                    x += w * net[i][j].x;
+                    y += w * net[i][j].y;
+                    z += w * net[i][j].z;
+                }
+            }
+            cx[k][l] = x;
+            cy[k][l] = y;
+            cz[k][l] = z;
+        }
+    }
+
+    // drop the highest powers while the coefficients dropped in each
+    // direction add up to less than the tolerance; since u, v <= 1 no point
+    // of the patch moves further than twice that
+    float tolerance = shapetolerance(net);
+    float dropped = 0;
+    for (degreeU = 3; degreeU > 0; degreeU--) {
+        for (int k = 0; k < 4; k++) {
+            dropped += sqrt(cx[k][degreeU] * cx[k][degreeU] + cy[k][degreeU] * cy[k][degreeU] + cz[k][degreeU] * cz[k][degreeU]);
+        }
+        if (dropped > tolerance) {
+            break;
+        }
+    }
+    dropped = 0;
+    for (degreeV = 3; degreeV > 0; degreeV--) {
+        for (int l = 0; l < 4; l++) {
+            dropped += sqrt(cx[degreeV][l] * cx[degreeV][l] + cy[degreeV][l] * cy[degreeV][l] + cz[degreeV][l] * cz[degreeV][l]);
+        }
+        if (dropped > tolerance) {
+            break;
+        }
+    }
+}
+
+SubPatch::SubPatch() {
+    level = 0;
+    iu = 0;
+    iv = 0;
+}
+
+SubPatch::SubPatch(Surface patch) {
+    Curve rows[4] = { patch.a, patch.b, patch.c, patch.d };
+    for (int k = 0; k < 4; k++) {
+        p[k][0] = rows[k].a;
+        p[k][1] = rows[k].b;
+        p[k][2] = rows[k].c;
+        p[k][3] = rows[k].d;
+    }
+    level = 0;
+    iu = 0;
+    iv = 0;
+}
+
+Triangle::Triangle() {
+
+}
+
+Triangle::Triangle(Point a1, Point b1, Point c1){
+    a = a1;
+    b = b1;
+    c = c1;
+}
+
+BezierContext::BezierContext(int divisions, float epsilon) {
+    this->divisions = max(1, divisions);
+    this->epsilon = epsilon;
+    requests = 0;
+    evaluations = 0;
+    fixedKernels = true;
+    bernsteintables(this->divisions, basis, dbasis);
+}
+
+//****************************************************
+// Evaluation and adaptive subdivision
+//****************************************************
+
+// Wall clock in seconds, used for the benchmark reports
+double currentTime() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+float dot(Vector a, Vector b) {
+    return a.x*b.x + a.y * b.y + a.z * b.z;
+}
+
+Vector cross(Vector a, Vector b) {
+    return Vector(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+Point bezcurveinterp(Curve curve, float u) {
+    Point a1 = curve.a.scalarMult(1.0 - u).add(curve.b.scalarMult(u));
+    Point b1 = curve.b.scalarMult(1.0 - u).add(curve.c.scalarMult(u));
+    Point c1 = curve.c.scalarMult(1.0 - u).add(curve.d.scalarMult(u));
+
+    Point d1 = a1.scalarMult(1.0 - u).add(b1.scalarMult(u));
+    Point e1 = b1.scalarMult(1.0 - u).add(c1.scalarMult(u));
+
+    Point p = d1.scalarMult(1.0 - u).add(e1.scalarMult(u));
+    Vector der(d1, e1); //TODO is this normalized??
+    //Vector der(e1.x - d1.x, e1.y - d1.y, e1.z - d1.z);
+    p.derivative = der.scalarMult(3);
+
+    return p;
+}
+
+Point bezpatchinterp(const Surface& patch, float u, float v) {
+    Point va = bezcurveinterp(patch.a, u);
+    Point vb = bezcurveinterp(patch.b, u);
+    Point vc = bezcurveinterp(patch.c, u);
+    Point vd = bezcurveinterp(patch.d, u);
+    Curve vcurve(va, vb, vc, vd);
+
+    Curve c1(patch.a.a, patch.b.a, patch.c.a, patch.d.a);
+    Curve c2(patch.a.b, patch.b.b, patch.c.b, patch.d.b);
+    Curve c3(patch.a.c, patch.b.c, patch.c.c, patch.d.c);
+    Curve c4(patch.a.d, patch.b.d, patch.c.d, patch.d.d);
+    Point ua = bezcurveinterp(c1, v);
+    Point ub = bezcurveinterp(c2, v);
+    Point uc = bezcurveinterp(c3, v);
+    Point ud = bezcurveinterp(c4, v);
+    Curve ucurve(ua, ub, uc, ud);
+
+    Point pv = bezcurveinterp(vcurve, v);
+    Point pu = bezcurveinterp(ucurve, u);
+
+    Point p = pu;
+    p.normal1 = cross(pu.derivative, pv.derivative);
+    p.normal1.normalize();
+    p.normal2 = cross(pv.derivative, pu.derivative);
+    p.normal2.normalize();
+    return p;
+}
+
+// Horner evaluation of one coordinate: value, d/du and d/dv.
+// Written as plain multiply-adds so the compiler contracts them into FMAs
+// when the target has them; fmaf() is a slow library call on x86 without FMA.
+static inline void hornereval(const float c[4][4], float u, float v, float& p, float& pu, float& pv) {
+    float r[4], dr[4];
+    for (int k = 0; k < 4; k++) {
+        r[k] = ((c[k][3] * u + c[k][2]) * u + c[k][1]) * u + c[k][0];
+        dr[k] = (3 * c[k][3] * u + 2 * c[k][2]) * u + c[k][1];
+    }
+    p = ((r[3] * v + r[2]) * v + r[1]) * v + r[0];
+    pu = ((dr[3] * v + dr[2]) * v + dr[1]) * v + dr[0];
+    pv = (3 * r[3] * v + 2 * r[2]) * v + r[1];
+}
+
+// Same for a patch of degree du in u and dv in v, skipping the vanished terms
+static inline void hornerreduced(const float c[4][4], int du, int dv, float u, float v, float& p, float& pu, float& pv) {
+    float r[4] = { 0 }, dr[4] = { 0 };
+    for (int k = 0; k <= dv; k++) {
+        float a = c[k][du], d = 0;
+        for (int l = du - 1; l >= 0; l--) {
+            d = d * u + a;
+            a = a * u + c[k][l];
+        }
+        r[k] = a;
+        dr[k] = d;
+    }
+    p = r[dv];
+    pu = dr[dv];
+    pv = 0;
+    for (int k = dv - 1; k >= 0; k--) {
+        pv = pv * v + p;
+        p = p * v + r[k];
+        pu = pu * v + dr[k];
+    }
+}
+
+Point monopatchinterp(const MonomialPatch& patch, float u, float v) {
+    Point p;
+    Vector du, dv;
+    if (patch.degreeU == 3 && patch.degreeV == 3) {
+        hornereval(patch.cx, u, v, p.x, du.x, dv.x);
+        hornereval(patch.cy, u, v, p.y, du.y, dv.y);
+        hornereval(patch.cz, u, v, p.z, du.z, dv.z);
+    }
+    else {
+        hornerreduced(patch.cx, patch.degreeU, patch.degreeV, u, v, p.x, du.x, dv.x);
+        hornerreduced(patch.cy, patch.degreeU, patch.degreeV, u, v, p.y, du.y, dv.y);
+        hornerreduced(patch.cz, patch.degreeU, patch.degreeV, u, v, p.z, du.z, dv.z);
+    }
+
+    p.derivative = du;
+    p.normal1 = cross(du, dv);
+    p.normal1.normalize();
+    p.normal2 = cross(dv, du);
+    p.normal2.normalize();
+    return p;
+}
+
+// Positions and normals stage by stage over blocks of points; each loop keeps
+// the coefficients fixed and runs across the block, so it vectorizes. The
+// arithmetic is monopatchinterp's, normalize's double-precision length included.
+void monopatchbatch(const MonomialPatch& patch, const float* us, const float* vs, int count, Point* out) {
+    if (patch.degreeU != 3 || patch.degreeV != 3) {
+        for (int s = 0; s < count; s++) {
+            out[s] = monopatchinterp(patch, us[s], vs[s]);
+        }
+        return;
+    }
+    const float (*c[3])[4] = { patch.cx, patch.cy, patch.cz };
+    float p[3][EVAL_BLOCK], pu[3][EVAL_BLOCK], pv[3][EVAL_BLOCK], normal[3][EVAL_BLOCK];
+    for (int first = 0; first < count; first += EVAL_BLOCK) {
+        int n = min(EVAL_BLOCK, count - first);
+        const float* u = us + first;
+        const float* v = vs + first;
+        for (int a = 0; a < 3; a++) {
+            for (int s = 0; s < n; s++) {
+                hornereval(c[a], u[s], v[s], p[a][s], pu[a][s], pv[a][s]);
+            }
+        }
+        for (int s = 0; s < n; s++) {
+            float nx = pu[1][s] * pv[2][s] - pu[2][s] * pv[1][s];
+            float ny = pu[2][s] * pv[0][s] - pu[0][s] * pv[2][s];
+            float nz = pu[0][s] * pv[1][s] - pu[1][s] * pv[0][s];
+            float scale = sqrt((double)nx * nx + (double)ny * ny + (double)nz * nz);
+            normal[0][s] = nx / scale;
+            normal[1][s] = ny / scale;
+            normal[2][s] = nz / scale;
+        }
+        for (int s = 0; s < n; s++) {
+            Point& q = out[first + s];
+            q.x = p[0][s];
+            q.y = p[1][s];
+            q.z = p[2][s];
+            q.derivative = Vector(pu[0][s], pu[1][s], pu[2][s]);
+            q.normal1 = Vector(normal[0][s], normal[1][s], normal[2][s]);
+            q.normal2 = Vector(-normal[0][s], -normal[1][s], -normal[2][s]);
+        }
+    }
+}
+
+// Evaluates through the power basis when the patch has been converted (-m)
+Point patchinterp(const Surface& patch, const MonomialPatch* mono, float u, float v) {
+    if (mono) {
+        return monopatchinterp(*mono, u, v);
+    }
+    return bezpatchinterp(patch, u, v);
+}
+
+//****************************************************
+// Patch shapes
+//****************************************************
+
+// Distance of p from the line through a with direction e (|e| = length > 0)
+static float linedistance(const Point& a, const Vector& e, float length, const Point& p) {
+    Vector w(p.x - a.x, p.y - a.y, p.z - a.z);
+    Vector c = cross(e, w);
+    return sqrt(dot(c, c)) / length;
+}
+
+PatchShape classifypatch(const Surface& patch) {
+    PatchShape shape;
+    MonomialPatch mono(patch);
+    shape.degreeU = mono.degreeU;
+    shape.degreeV = mono.degreeV;
+    shape.planar = false;
+    shape.flat = false;
+
+    Point net[4][4];
+    surfacenet(patch, net);
+    float tolerance = shapetolerance(net);
+    // corners in (u, v) order (0, 0), (1, 0), (1, 1), (0, 1), and the
+    // boundary curve leaving each one
+    Point corners[4] = { net[0][0], net[0][3], net[3][3], net[3][0] };
+    Point edges[4][4];
+    for (int j = 0; j < 4; j++) {
+        edges[0][j] = net[0][j];
+        edges[1][j] = net[j][3];
+        edges[2][j] = net[3][3 - j];
+        edges[3][j] = net[3 - j][0];
+    }
+
+    // Newell normal of the corner quad; the corner order makes it point
+    // along du x dv like the evaluated normals
+    Vector n(0, 0, 0);
+    Point center(0, 0, 0);
+    for (int i = 0; i < 4; i++) {
+        const Point& a = corners[i];
+        const Point& b = corners[(i + 1) % 4];
+        n.x += (a.y - b.y) * (a.z + b.z);
+        n.y += (a.z - b.z) * (a.x + b.x);
+        n.z += (a.x - b.x) * (a.y + b.y);
+        center = center.add(a.scalarMult(0.25f));
+    }
+    float area = sqrt(dot(n, n));
+    if (area <= tolerance * tolerance) {
+        return shape;
+    }
+    shape.normal = n.scalarMult(1 / area);
+
+    shape.planar = true;
+    for (int i = 0; i < 4 && shape.planar; i++) {
+        for (int j = 0; j < 4; j++) {
+            Vector w(net[i][j].x - center.x, net[i][j].y - center.y, net[i][j].z - center.z);
+            if (fabs(dot(w, shape.normal)) > tolerance) {
+                shape.planar = false;
+                break;
+            }
+        }
+    }
+    if (!shape.planar) {
+        return shape;
+    }
+
+    // straight boundary curves, and every control point on the inner side of
+    // each quad edge: the surface then stays inside the quad (convex hull)
+    // while its boundary runs along the quad's edges, so it covers the quad
+    shape.flat = true;
+    for (int e = 0; e < 4 && shape.flat; e++) {
+        const Point& a = corners[e];
+        const Point& b = corners[(e + 1) % 4];
+        Vector edge(b.x - a.x, b.y - a.y, b.z - a.z);
+        float length = sqrt(dot(edge, edge));
+        if (length <= tolerance) {
+            // collapsed edge, like the pole of a revolved surface
+            for (int j = 1; j < 3; j++) {
+                shape.flat = shape.flat && edges[e][j].distance(a) <= tolerance;
+            }
+            continue;
+        }
+        for (int j = 1; j < 3; j++) {
+            shape.flat = shape.flat && linedistance(a, edge, length, edges[e][j]) <= tolerance;
+        }
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                Vector w(net[i][j].x - a.x, net[i][j].y - a.y, net[i][j].z - a.z);
+                if (dot(cross(edge, w), shape.normal) < -tolerance * length) {
+                    shape.flat = false;
+                }
+            }
+        }
+    }
+    return shape;
+}
+
+void flattriangles(const Surface& patch, const PatchShape& shape, Triangle out[2]) {
+    Point ll = patch.a.a, ul = patch.a.d, ur = patch.d.d, lr = patch.d.a;
+    Point* corners[4] = { &ll, &ul, &ur, &lr };
+    Vector n = shape.normal;
+    for (int i = 0; i < 4; i++) {
+        corners[i]->normal1 = n;
+        corners[i]->normal2 = n.scalarMult(-1);
+    }
+    out[0] = maketriangle(ll, 0, 0, ul, 1, 0, ur, 1, 1);
+    out[1] = maketriangle(ll, 0, 0, ur, 1, 1, lr, 0, 1);
+}
+
+// Splits t against its surface midpoints mid[0..2] (edges ab, bc, ca) with
+// the 1/2/3/4-way rules; returns the number of children, 0 for a leaf
+int splitadaptive(const Triangle& t, const Point mid[3], float epsilon, Triangle children[4]) {
+    Point e1m = t.a.midpoint(t.b);
+    Point e2m = t.b.midpoint(t.c);
+    Point e3m = t.c.midpoint(t.a);
+
+    float abu = (t.au + t.bu) / 2;
+    float abv = (t.av + t.bv) / 2;
+    float bcu = (t.bu + t.cu) / 2;
+    float bcv = (t.bv + t.cv) / 2;
+    float cau = (t.cu + t.au) / 2;
+    float cav = (t.cv + t.av) / 2;
+
+    const Point& e1i = mid[0];
+    const Point& e2i = mid[1];
+    const Point& e3i = mid[2];
+
+    float e1d = e1m.distance(e1i);
+    float e2d = e2m.distance(e2i);
+    float e3d = e3m.distance(e3i);
+
+    bool e1 = e1d < epsilon;
+    bool e2 = e2d < epsilon;
+    bool e3 = e3d < epsilon;
+
+    int n = 0;
+    if (!e1 && !e2 && !e3) {
+        Triangle t1(t.a, e1i, e3i);
+        t1.au = t.au;
+        t1.av = t.av;
+        t1.bu = abu;
+        t1.bv = abv;
+        t1.cu = cau;
+        t1.cv = cav;
+        children[n++] = t1;
+
+        Triangle t2(e1i, t.b, e2i);
+        t2.au = abu;
+        t2.av = abv;
+        t2.bu = t.bu;
+        t2.bv = t.bv;
+        t2.cu = bcu;
+        t2.cv = bcv;
+        children[n++] = t2;
+
+        Triangle t3(e3i, e2i, t.c);
+        t3.au = cau;
+        t3.av = cav;
+        t3.bu = bcu;
+        t3.bv = bcv;
+        t3.cu = t.cu;
+        t3.cv = t.cv;
+        children[n++] = t3;
+
+        Triangle t4(e1i, e2i, e3i);
+        t4.au = abu;
+        t4.av = abv;
+        t4.bu = bcu;
+        t4.bv = bcv;
+        t4.cu = cau;
+        t4.cv = cav;
+        children[n++] = t4;
+    }
+    else if (!e1 && e2 && e3){
+        Triangle t1(t.a, e1i, t.c);
+        t1.au = t.au;
+        t1.av = t.av;
+        t1.bu = abu;
+        t1.bv = abv;
+        t1.cu = t.cu;
+        t1.cv = t.cv;
+        children[n++] = t1;
+
+        Triangle t2(e1i, t.b, t.c);
+        t2.au = abu;
+        t2.av = abv;
+        t2.bu = t.bu;
+        t2.bv = t.bv;
+        t2.cu = t.cu;
+        t2.cv = t.cv;
+        children[n++] = t2;
+    }
+    else if (e1 && !e2 && e3) {
+        Triangle t1(t.a, t.b, e2i);
+        t1.au = t.au;
+        t1.av = t.av;
+        t1.bu = t.bu;
+        t1.bv = t.bv;
+        t1.cu = bcu;
+        t1.cv = bcv;
+        children[n++] = t1;
+
+        Triangle t2(t.a, e2i, t.c);
+        t2.au = t.au;
+        t2.av = t.av;
+        t2.bu = bcu;
+        t2.bv = bcv;
+        t2.cu = t.cu;
+        t2.cv = t.cv;
+        children[n++] = t2;
+    }
+    else if (e1 && e2 && !e3) {
+        Triangle t1(t.a, t.b, e3i);
+        t1.au = t.au;
+        t1.av = t.av;
+        t1.bu = t.bu;
+        t1.bv = t.bv;
+        t1.cu = cau;
+        t1.cv = cav;
+        children[n++] = t1;
+
+        Triangle t2(e3i, t.b, t.c);
+        t2.au = cau;
+        t2.av = cav;
+        t2.bu = t.bu;
+        t2.bv = t.bv;
+        t2.cu = t.cu;
+        t2.cv = t.cv;
+        children[n++] = t2;
+    }
+    else if (!e1 && !e2 && e3) {
+        Triangle t1(t.a, e1i, e2i);
+        t1.au = t.au;
+        t1.av = t.av;
+        t1.bu = abu;
+        t1.bv = abv;
+        t1.cu = bcu;
+        t1.cv = bcv;
+        children[n++] = t1;
+
+        Triangle t2(e1i, t.b, e2i);
+        t2.au = abu;
+        t2.av = abv;
+        t2.bu = t.bu;
+        t2.bv = t.bv;
+        t2.cu = bcu;
+        t2.cv = bcv;
+        children[n++] = t2;
+
+        Triangle t3(t.a, e2i, t.c);
+        t3.au = t.au;
+        t3.av = t.av;
+        t3.bu = bcu;
+        t3.bv = bcv;
+        t3.cu = t.cu;
+        t3.cv = t.cv;
+        children[n++] = t3;
+    }
+    else if (e1 && !e2 && !e3) {
+        Triangle t1(t.a, t.b, e3i);
+        t1.au = t.au;
+        t1.av = t.av;
+        t1.bu = t.bu;
+        t1.bv = t.bv;
+        t1.cu = cau;
+        t1.cv = cav;
+        children[n++] = t1;
+
+        Triangle t2(e3i, t.b, e2i);
+        t2.au = cau;
+        t2.av = cav;
+        t2.bu = t.bu;
+        t2.bv = t.bv;
+        t2.cu = bcu;
+        t2.cv = bcv;
+        children[n++] = t2;
+
+        Triangle t3(e3i, e2i, t.c);
+        t3.au = cau;
+        t3.av = cav;
+        t3.bu = bcu;
+        t3.bv = bcv;
+        t3.cu = t.cu;
+        t3.cv = t.cv;
+        children[n++] = t3;
+    }
+    else if (!e1 && e2 && !e3) {
+        Triangle t1(t.a, e1i, e3i);
+        t1.au = t.au;
+        t1.av = t.av;
+        t1.bu = abu;
+        t1.bv = abv;
+        t1.cu = cau;
+        t1.cv = cav;
+        children[n++] = t1;
+
+        Triangle t2(e1i, t.c, e3i);
+        t2.au = abu;
+        t2.av = abv;
+        t2.bu = t.cu;
+        t2.bv = t.cv;
+        t2.cu = cau;
+        t2.cv = cav;
+        children[n++] = t2;
+
+        Triangle t3(e1i, t.b, t.c);
+        t3.au = abu;
+        t3.av = abv;
+        t3.bu = t.bu;
+        t3.bv = t.bv;
+        t3.cu = t.cu;
+        t3.cv = t.cv;
+        children[n++] = t3;
+    }
+    return n;
+}
+
+
+// (u, v) of the three edge midpoints of t, in the order splitadaptive expects
+void adaptivemidpoints(const Triangle& t, float u[3], float v[3]) {
+    u[0] = (t.au + t.bu) / 2;
+    v[0] = (t.av + t.bv) / 2;
+    u[1] = (t.bu + t.cu) / 2;
+    v[1] = (t.bv + t.cv) / 2;
+    u[2] = (t.cu + t.au) / 2;
+    v[2] = (t.cv + t.av) / 2;
+}
+
+void subdividepatchadaptive(Surface patch, float epsilon, Triangle t, float depth, vector<Triangle>& out, const MonomialPatch* mono) {
+    if (depth > ADAPTIVE_MAX_DEPTH) {
+        out.push_back(t);
+        return;
+    }
+    float u[3], v[3];
+    adaptivemidpoints(t, u, v);
+    Point mid[3];
+    for (int k = 0; k < 3; k++) {
+        mid[k] = patchinterp(patch, mono, u[k], v[k]);
+    }
+    Triangle children[4];
+    int n = splitadaptive(t, mid, epsilon, children);
+    if (n == 0) {
+        out.push_back(t);
+    }
+    for (int k = 0; k < n; k++) {
+        subdividepatchadaptive(patch, epsilon, children[k], depth + 1, out, mono);
+    }
+}
+
+// The two halves of the (u, v) square that adaptive subdivision starts from
+void adaptiveroots(const Surface& patch, Triangle roots[2]) {
+    roots[0] = Triangle(patch.a.a, patch.d.a, patch.d.d);
+    roots[0].au = 0;
+    roots[0].av = 0;
+    roots[0].bu = 0;
+    roots[0].bv = 1;
+    roots[0].cu = 1;
+    roots[0].cv = 1;
+
+    roots[1] = Triangle(patch.a.a, patch.d.d, patch.a.d);
+    roots[1].au = 0;
+    roots[1].av = 0;
+    roots[1].bu = 1;
+    roots[1].bv = 1;
+    roots[1].cu = 1;
+    roots[1].cv = 0;
+}
+
+void adaptivepatch(const Surface& patch, float epsilon, vector<Triangle>& out, const MonomialPatch* mono,
+    const PatchShape* shape) {
+    Triangle roots[2];
+    if (shape && shape->flat) {
+        flattriangles(patch, *shape, roots);
+        out.push_back(roots[0]);
+        out.push_back(roots[1]);
+        return;
+    }
+    adaptiveroots(patch, roots);
+    subdividepatchadaptive(patch, epsilon, roots[0], 1, out, mono);
+    subdividepatchadaptive(patch, epsilon, roots[1], 1, out, mono);
+}
+
+//****************************************************
+// Adaptive triangle generator
+//****************************************************
+
+AdaptiveTriangles::AdaptiveTriangles(const Surface* patches, int count, float epsilon, const MonomialPatch* mono,
+    const PatchShape* shapes) {
+    this->patches = patches;
+    this->shapes = shapes;
+    this->count = count;
+    this->epsilon = epsilon;
+    this->mono = mono;
+    patch = -1;
+    peakPending = 0;
+}
+
+// Explicit form of the subdividepatchadaptive recursion: children are pushed
+// in reverse so they pop in recursion order
+int AdaptiveTriangles::next(Triangle* out, int maxCount) {
+    int produced = 0;
+    while (produced < maxCount) {
+        if (stack.empty()) {
+            if (patch + 1 >= count) {
+                break;
+            }
+            patch++;
+            Triangle roots[2];
+            // a flat patch's triangles go on as leaves, past the depth limit
+            bool flat = shapes && shapes[patch].flat;
+            if (flat) {
+                flattriangles(patches[patch], shapes[patch], roots);
+            }
+            else {
+                adaptiveroots(patches[patch], roots);
+            }
+            for (int k = 1; k >= 0; k--) {
+                Pending p = { roots[k], flat ? ADAPTIVE_MAX_DEPTH + 1.0f : 1 };
+                stack.push_back(p);
+            }
+        }
+        Pending p = stack.back();
+        stack.pop_back();
+        if (p.depth > ADAPTIVE_MAX_DEPTH) {
+            out[produced++] = p.t;
+            continue;
+        }
+        float u[3], v[3];
+        adaptivemidpoints(p.t, u, v);
+        Point mid[3];
+        for (int k = 0; k < 3; k++) {
+            mid[k] = patchinterp(patches[patch], mono ? &mono[patch] : NULL, u[k], v[k]);
+        }
+        Triangle children[4];
+        int n = splitadaptive(p.t, mid, epsilon, children);
+        if (n == 0) {
+            out[produced++] = p.t;
+        }
+        for (int k = n - 1; k >= 0; k--) {
+            Pending child = { children[k], p.depth + 1 };
+            stack.push_back(child);
+        }
+        peakPending = max(peakPending, (int)stack.size());
+    }
+    return produced;
+}
+
+Triangle maketriangle(Point a, float au, float av, Point b, float bu, float bv, Point c, float cu, float cv) {
+    Triangle t(a, b, c);
+    t.au = au;
+    t.av = av;
+    t.bu = bu;
+    t.bv = bv;
+    t.cu = cu;
+    t.cv = cv;
+    return t;
+}
+
+//****************************************************
+// Uniform grids
+//****************************************************
+
+// Bernstein values and slopes at k / n, k = 0..n, four per station
+static void bernsteinrows(int n, float* b, float* db) {
+    for (int k = 0; k <= n; k++) {
+        float t = (float)k / n;
+        float s = 1 - t;
+        float values[4] = { s * s * s, 3 * t * s * s, 3 * t * t * s, t * t * t };
+        float slopes[4] = { -3 * s * s, 3 * s * s - 6 * t * s, 6 * t * s - 3 * t * t, 3 * t * t };
+        copy(values, values + 4, &b[4 * k]);
+        copy(slopes, slopes + 4, &db[4 * k]);
+    }
+}
+
+// Per-step tables of a fixed kernel: sized by N at compile time and filled
+// once at startup, before any thread can call the kernels
+template <int N>
+class FixedBasis {
+public:
+    float b[4 * (N + 1)], db[4 * (N + 1)];
+    FixedBasis() { bernsteinrows(N, b, db); }
+};
+
+static const FixedBasis<4> basis4;
+static const FixedBasis<8> basis8;
+static const FixedBasis<16> basis16;
+static const FixedBasis<32> basis32;
+
+// The one uniform grid kernel. N > 0 fixes the resolution at compile time, so
+// the loops over the grid unroll and the output block has a fixed size; N = 0
+// takes it from n.
+template <int N>
+static void gridkernelsized(const Surface& patch, int n, const float* b, const float* db, Vertex* out) {
+    const int size = N > 0 ? N : n;
+    const Curve* rows[4] = { &patch.a, &patch.b, &patch.c, &patch.d };
+    float px[4][4], py[4][4], pz[4][4];
+    for (int k = 0; k < 4; k++) {
+        const Point* net[4] = { &rows[k]->a, &rows[k]->b, &rows[k]->c, &rows[k]->d };
+        for (int j = 0; j < 4; j++) {
+            px[k][j] = net[j]->x;
+            py[k][j] = net[j]->y;
+            pz[k][j] = net[j]->z;
+        }
+    }
+    float inv = 1.0f / size;
+    for (int iu = 0; iu <= size; iu++) {
+        const float* bu = b + 4 * iu;
+        const float* dbu = db + 4 * iu;
+        float rx[4], ry[4], rz[4], drx[4], dry[4], drz[4];
+        for (int k = 0; k < 4; k++) {
+            rx[k] = bu[0] * px[k][0] + bu[1] * px[k][1] + bu[2] * px[k][2] + bu[3] * px[k][3];
+            ry[k] = bu[0] * py[k][0] + bu[1] * py[k][1] + bu[2] * py[k][2] + bu[3] * py[k][3];
+            rz[k] = bu[0] * pz[k][0] + bu[1] * pz[k][1] + bu[2] * pz[k][2] + bu[3] * pz[k][3];
+            drx[k] = dbu[0] * px[k][0] + dbu[1] * px[k][1] + dbu[2] * px[k][2] + dbu[3] * px[k][3];
+            dry[k] = dbu[0] * py[k][0] + dbu[1] * py[k][1] + dbu[2] * py[k][2] + dbu[3] * py[k][3];
+            drz[k] = dbu[0] * pz[k][0] + dbu[1] * pz[k][1] + dbu[2] * pz[k][2] + dbu[3] * pz[k][3];
+        }
+        for (int iv = 0; iv <= size; iv++) {
+            const float* bv = b + 4 * iv;
+            const float* dbv = db + 4 * iv;
+            Vertex& v = out[iu * (size + 1) + iv];
+            v.x = bv[0] * rx[0] + bv[1] * rx[1] + bv[2] * rx[2] + bv[3] * rx[3];
+            v.y = bv[0] * ry[0] + bv[1] * ry[1] + bv[2] * ry[2] + bv[3] * ry[3];
+            v.z = bv[0] * rz[0] + bv[1] * rz[1] + bv[2] * rz[2] + bv[3] * rz[3];
+            Vector du(bv[0] * drx[0] + bv[1] * drx[1] + bv[2] * drx[2] + bv[3] * drx[3],
+                bv[0] * dry[0] + bv[1] * dry[1] + bv[2] * dry[2] + bv[3] * dry[3],
+                bv[0] * drz[0] + bv[1] * drz[1] + bv[2] * drz[2] + bv[3] * drz[3]);
+            Vector dv(dbv[0] * rx[0] + dbv[1] * rx[1] + dbv[2] * rx[2] + dbv[3] * rx[3],
+                dbv[0] * ry[0] + dbv[1] * ry[1] + dbv[2] * ry[2] + dbv[3] * ry[3],
+                dbv[0] * rz[0] + dbv[1] * rz[1] + dbv[2] * rz[2] + dbv[3] * rz[3]);
+            Vector normal = cross(du, dv);
+            normal.normalize();
+            v.nx = normal.x;
+            v.ny = normal.y;
+            v.nz = normal.z;
+            v.u = iu * inv;
+            v.v = iv * inv;
+        }
+    }
+}
+
+// Dispatches the common steps (0.25, 0.125, 0.0625, 0.03125) to their
+// specialized instances, which read their own static tables
+void gridkernel(const Surface& patch, int n, const float* b, const float* db, Vertex* out) {
+    switch (n) {
+    case 4:
+        gridkernelsized<4>(patch, n, basis4.b, basis4.db, out);
+        return;
+    case 8:
+        gridkernelsized<8>(patch, n, basis8.b, basis8.db, out);
+        return;
+    case 16:
+        gridkernelsized<16>(patch, n, basis16.b, basis16.db, out);
+        return;
+    case 32:
+        gridkernelsized<32>(patch, n, basis32.b, basis32.db, out);
+        return;
+    }
+    gridkernelsized<0>(patch, n, b, db, out);
+}
+
+void gridkernelgeneric(const Surface& patch, int n, const float* b, const float* db, Vertex* out) {
+    gridkernelsized<0>(patch, n, b, db, out);
+}
+
+void bernsteintables(int n, vector<float>& b, vector<float>& db) {
+    b.resize(4 * (n + 1));
+    db.resize(4 * (n + 1));
+    bernsteinrows(n, &b[0], &db[0]);
+}
+
+const int SPACING_SAMPLES = 32;     // density samples along the spaced direction
+const int SPACING_CROSS_SAMPLES = 9; // samples across it, the largest one counts
+const float SPACING_FLOOR = 0.1f;    // share of the mean density every segment keeps
+
+// sqrt(max |P''| / 8) at SPACING_SAMPLES + 1 stations along u (alongU) or v
+static void spacingdensity(const MonomialPatch& patch, bool alongU, float density[SPACING_SAMPLES + 1]) {
+    const float (*c[3])[4] = { patch.cx, patch.cy, patch.cz };
+    for (int i = 0; i <= SPACING_SAMPLES; i++) {
+        float along = (float)i / SPACING_SAMPLES, largest = 0;
+        for (int j = 0; j < SPACING_CROSS_SAMPLES; j++) {
+            float across = (float)j / (SPACING_CROSS_SAMPLES - 1);
+            float u = alongU ? along : across, v = alongU ? across : along;
+            float pu[4] = { 1, u, u * u, u * u * u }, pv[4] = { 1, v, v * v, v * v * v };
+            float d2[3];
+            for (int a = 0; a < 3; a++) {
+                d2[a] = 0;
+                // c[k][l] multiplies v^k u^l
+                for (int k = 0; k < 4; k++) {
+                    for (int l = 0; l < 4; l++) {
+                        if (alongU && l >= 2) {
+                            d2[a] += c[a][k][l] * l * (l - 1) * pu[l - 2] * pv[k];
+                        }
+                        else if (!alongU && k >= 2) {
+                            d2[a] += c[a][k][l] * k * (k - 1) * pv[k - 2] * pu[l];
+                        }
+                    }
+                }
+            }
+            largest = max(largest, d2[0] * d2[0] + d2[1] * d2[1] + d2[2] * d2[2]);
+        }
+        density[i] = sqrt(sqrt(largest) / 8);
+    }
+}
+
+// Integral of the density, by the trapezoid rule
+static float spacingintegral(const float density[SPACING_SAMPLES + 1]) {
+    float total = 0;
+    for (int i = 0; i < SPACING_SAMPLES; i++) {
+        total += (density[i] + density[i + 1]) * 0.5f / SPACING_SAMPLES;
+    }
+    return total;
+}
+
+// Parameters of n equal steps of the cumulative density
+static void spacingfromdensity(const float density[SPACING_SAMPLES + 1], int n, vector<float>& out) {
+    float minimum = SPACING_FLOOR * spacingintegral(density) + 1e-6f;
+    float cumulative[SPACING_SAMPLES + 1] = { 0 };
+    for (int i = 0; i < SPACING_SAMPLES; i++) {
+        cumulative[i + 1] = cumulative[i] + (density[i] + density[i + 1] + 2 * minimum) * 0.5f / SPACING_SAMPLES;
+    }
+    // invert the piecewise linear cumulative density at n equal steps
+    out.resize(n + 1);
+    int segment = 0;
+    for (int k = 0; k <= n; k++) {
+        float target = cumulative[SPACING_SAMPLES] * k / n;
+        while (segment < SPACING_SAMPLES - 1 && cumulative[segment + 1] < target) {
+            segment++;
+        }
+        float width = cumulative[segment + 1] - cumulative[segment];
+        float f = width > 0 ? (target - cumulative[segment]) / width : 0;
+        out[k] = min(1.0f, max(0.0f, (segment + f) / SPACING_SAMPLES));
+    }
+    out[0] = 0;
+    out[n] = 1;
+}
+
+static void spacedirection(const MonomialPatch& patch, bool alongU, int n, vector<float>& out) {
+    float density[SPACING_SAMPLES + 1];
+    spacingdensity(patch, alongU, density);
+    spacingfromdensity(density, n, out);
+}
+
+// sqrt(|C''| / 8) along one boundary curve, from its control points alone
+static void curvedensity(const Point p[4], float density[SPACING_SAMPLES + 1]) {
+    Point a = p[0].add(p[1].scalarMult(-2)).add(p[2]);
+    Point b = p[1].add(p[2].scalarMult(-2)).add(p[3]);
+    for (int i = 0; i <= SPACING_SAMPLES; i++) {
+        float t = (float)i / SPACING_SAMPLES;
+        Point d = a.scalarMult(6 * (1 - t)).add(b.scalarMult(6 * t));
+        density[i] = sqrt(sqrt(d.x * d.x + d.y * d.y + d.z * d.z) / 8);
+    }
+}
+
+static bool pointbefore(const Point& a, const Point& b) {
+    if (a.x != b.x) {
+        return a.x < b.x;
+    }
+    if (a.y != b.y) {
+        return a.y < b.y;
+    }
+    return a.z < b.z;
+}
+
+// A boundary is spaced in the direction whose control points come first
+// lexicographically, so the patches on both sides of it get the same
+// parameters whichever way they run along it
+static void boundaryspacing(const Point p[4], int n, vector<float>& out) {
+    Point reversed[4] = { p[3], p[2], p[1], p[0] };
+    bool flip = lexicographical_compare(reversed, reversed + 4, p, p + 4, pointbefore);
+    float density[SPACING_SAMPLES + 1];
+    curvedensity(flip ? reversed : p, density);
+    spacingfromdensity(density, n, out);
+    if (flip) {
+        vector<float> mirrored(n + 1);
+        for (int k = 0; k <= n; k++) {
+            mirrored[k] = 1 - out[n - k];
+        }
+        out.swap(mirrored);
+    }
+}
+
+void curvaturespacing(const MonomialPatch& patch, int rows, int columns, vector<float>& us, vector<float>& vs) {
+    spacedirection(patch, true, rows, us);
+    spacedirection(patch, false, columns, vs);
+}
+
+const float SPACING_BLEND = 0.5f; // share of the grid over which a boundary's spacing fades out
+
+void curvaturegrid(const Surface& patch, const MonomialPatch& mono, int rows, int columns, vector<float>& us,
+    vector<float>& vs) {
+    vector<float> innerU, innerV, bottom, top, left, right;
+    curvaturespacing(mono, rows, columns, innerU, innerV);
+    SubPatch net(patch);
+    Point row0[4], row3[4], column0[4], column3[4];
+    for (int k = 0; k < 4; k++) {
+        row0[k] = net.p[0][k];
+        row3[k] = net.p[3][k];
+        column0[k] = net.p[k][0];
+        column3[k] = net.p[k][3];
+    }
+    boundaryspacing(row0, rows, bottom);   // v = 0, along u
+    boundaryspacing(row3, rows, top);      // v = 1
+    boundaryspacing(column0, columns, left);  // u = 0, along v
+    boundaryspacing(column3, columns, right); // u = 1
+
+    int w = columns + 1;
+    us.resize((rows + 1) * w);
+    vs.resize((rows + 1) * w);
+    for (int iu = 0; iu <= rows; iu++) {
+        float wl = max(0.0f, 1 - (float)iu / rows / SPACING_BLEND);
+        float wr = max(0.0f, 1 - (float)(rows - iu) / rows / SPACING_BLEND);
+        for (int iv = 0; iv <= columns; iv++) {
+            float wb = max(0.0f, 1 - (float)iv / columns / SPACING_BLEND);
+            float wt = max(0.0f, 1 - (float)(columns - iv) / columns / SPACING_BLEND);
+            // weights of exactly 1 and 0 on a boundary reproduce its spacing bit for bit
+            us[iu * w + iv] = (1 - wb - wt) * innerU[iu] + wb * bottom[iu] + wt * top[iu];
+            vs[iu * w + iv] = (1 - wl - wr) * innerV[iv] + wl * left[iv] + wr * right[iv];
+        }
+    }
+    for (int iv = 0; iv <= columns; iv++) {
+        us[iv] = 0;
+        us[rows * w + iv] = 1;
+    }
+    for (int iu = 0; iu <= rows; iu++) {
+        vs[iu * w] = 0;
+        vs[iu * w + columns] = 1;
+    }
+}
+
+void curvaturedivisions(const MonomialPatch& patch, float maxError, int& rows, int& columns) {
+    float density[SPACING_SAMPLES + 1];
+    float tolerance = sqrt(max(maxError, 1e-12f));
+    spacingdensity(patch, true, density);
+    rows = max(1, (int)ceil(spacingintegral(density) / tolerance));
+    spacingdensity(patch, false, density);
+    columns = max(1, (int)ceil(spacingintegral(density) / tolerance));
+}
+
+void appendtriangles(Mesh& mesh, const vector<Triangle>& tris) {
+    for (int i = 0; i < (int)tris.size(); i++) {
+        const Triangle& t = tris[i];
+        Point corners[3] = { t.a, t.b, t.c };
+        float us[3] = { t.au, t.bu, t.cu };
+        float vs[3] = { t.av, t.bv, t.cv };
+        for (int c = 0; c < 3; c++) {
+            Point& p = corners[c];
+            Vertex v = { p.x, p.y, p.z, p.normal1.x, p.normal1.y, p.normal1.z, us[c], vs[c] };
+            mesh.indices.push_back(mesh.vertices.size());
+            mesh.vertices.push_back(v);
+        }
+    }
+}
+
+//****************************************************
+// Scene files
+//****************************************************
+
+// Binary scenes: "BEZB", version, patch count, then 48 floats per patch
+// (rows a..d, points a..d, xyz)
+const char PATCH_MAGIC[4] = { 'B', 'E', 'Z', 'B' };
+const unsigned int PATCH_VERSION = 1;
+
+static void patchfloats(const Surface& patch, float f[48]) {
+    const Curve* rows[4] = { &patch.a, &patch.b, &patch.c, &patch.d };
+    for (int k = 0; k < 4; k++) {
+        const Point* net[4] = { &rows[k]->a, &rows[k]->b, &rows[k]->c, &rows[k]->d };
+        for (int j = 0; j < 4; j++) {
+            f[12 * k + 3 * j] = net[j]->x;
+            f[12 * k + 3 * j + 1] = net[j]->y;
+            f[12 * k + 3 * j + 2] = net[j]->z;
+        }
+    }
+}
+
+static Curve floatcurve(const float* f) {
+    return Curve(Point(f[0], f[1], f[2]), Point(f[3], f[4], f[5]), Point(f[6], f[7], f[8]), Point(f[9], f[10], f[11]));
+}
+
+static Surface floatsurface(const float f[48]) {
+    return Surface(floatcurve(f), floatcurve(f + 12), floatcurve(f + 24), floatcurve(f + 36));
+}
+
+// Bytes from the current position to the end; the position is kept
+static long long bytesleft(ifstream& fin) {
+    streampos here = fin.tellg();
+    fin.seekg(0, ios::end);
+    long long left = (long long)(fin.tellg() - here);
+    fin.seekg(here);
+    return left;
+}
+
+bool PatchReader::open(const char* filename) {
+    fin.open(filename, ios::binary);
+    if (!fin.good()) {
+        return false;
+    }
+    char magic[4] = {};
+    unsigned int header[2];
+    binary = fin.read(magic, 4) && equal(magic, magic + 4, PATCH_MAGIC);
+    if (binary) {
+        // a header promising more patches than the file holds is corrupt
+        if (!fin.read((char*)header, sizeof(header)) || header[0] != PATCH_VERSION ||
+            (long long)header[1] * 48 * (long long)sizeof(float) > bytesleft(fin)) {
+            return false;
+        }
+        remaining = header[1];
+        return true;
+    }
+    fin.clear();
+    fin.seekg(0);
+    return true;
+}
+
+// A line of twelve numbers is one curve, four curves make a patch; the patch
+// count line and blank lines are skipped
+bool PatchReader::read(Surface& patch) {
+    float f[48];
+    if (binary) {
+        if (remaining == 0 || !fin.read((char*)f, sizeof(f))) {
+            return false;
+        }
+        remaining--;
+        patch = floatsurface(f);
+        return true;
+    }
+    int curves = 0;
+    string line;
+    while (curves < 4 && getline(fin, line)) {
+        istringstream tokens(line);
+        int n = 0;
+        while (n < 12 && tokens >> f[12 * curves + n]) {
+            n++;
+        }
+        if (n == 12) {
+            curves++;
+        }
+    }
+    if (curves < 4) {
+        return false;
+    }
+    patch = floatsurface(f);
+    return true;
+}
+
+// Text, binary and chunked scenes are told apart by their magic
+bool loadpatches(const char* filename, vector<Surface>& patches) {
+    ChunkedScene chunked;
+    if (chunked.open(filename)) {
+        patches.reserve(patches.size() + chunked.patchCount);
+        for (int i = 0; i < (int)chunked.chunks.size(); i++) {
+            chunked.readchunk(i, patches);
+        }
+        return true;
+    }
+    PatchReader reader;
+    if (!reader.open(filename)) {
+        return false;
+    }
+    Surface patch;
+    while (reader.read(patch)) {
+        patches.push_back(patch);
+    }
+    return true;
+}
+
+PatchWriter::PatchWriter() {
+    file = NULL;
+    binary = false;
+}
+
+PatchWriter::~PatchWriter() {
+    close();
+}
+
+bool PatchWriter::open(const char* filename, unsigned int count) {
+    string name(filename);
+    binary = name.size() >= 5 && name.compare(name.size() - 5, 5, ".bezb") == 0;
+    file = fopen(filename, binary ? "wb" : "w");
+    if (!file) {
+        return false;
+    }
+    if (binary) {
+        unsigned int header[2] = { PATCH_VERSION, count };
+        fwrite(PATCH_MAGIC, 1, 4, file);
+        fwrite(header, sizeof(header), 1, file);
+    }
+    else {
+        fprintf(file, "%u\n", count);
+    }
+    return true;
+}
+
+void PatchWriter::write(const Surface& patch) {
+    float f[48];
+    patchfloats(patch, f);
+    if (binary) {
+        fwrite(f, sizeof(f), 1, file);
+        return;
+    }
+    for (int k = 0; k < 4; k++) {
+        const float* r = f + 12 * k;
+        // 9 significant digits round-trip a float, so text and binary agree
+        fprintf(file, "%.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %.9g %.9g  %.9g %.9g %.9g\n", r[0], r[1], r[2], r[3], r[4], r[5],
+            r[6], r[7], r[8], r[9], r[10], r[11]);
+    }
+    fprintf(file, "\n");
+}
+
+bool PatchWriter::close() {
+    if (!file) {
+        return true;
+    }
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    return ok;
+}
+
+//****************************************************
+// Chunked scenes
+//****************************************************
+
+// "BEZC", version, chunk count, one ChunkRecord per chunk, then the patches
+// of each chunk in order, 48 floats per patch
+const char CHUNK_MAGIC[4] = { 'B', 'E', 'Z', 'C' };
+const unsigned int CHUNK_VERSION = 1;
+const int CHUNK_WRITE_BUFFER = 32;  // patches gathered per chunk before a seek and write
+const int CHUNK_MAX_AXIS_CELLS = 1024;
+
+// 40 bytes with the same layout on every compiler we build with
+class ChunkRecord {
+public:
+    float low[3], high[3];
+    unsigned int count, reserved;
+    long long offset;
+};
+
+static bool seekfile(FILE* file, long long offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+static Point patchcenter(const Surface& patch) {
+    return Point((patch.a.a.x + patch.a.d.x + patch.d.a.x + patch.d.d.x) * 0.25f,
+        (patch.a.a.y + patch.a.d.y + patch.d.a.y + patch.d.d.y) * 0.25f,
+        (patch.a.a.z + patch.a.d.z + patch.d.a.z + patch.d.d.z) * 0.25f);
+}
+
+bool chunkpatches(const char* input, const char* output, int chunkPatches) {
+    // pass 1: bounds of the patch centers
+    PatchReader reader;
+    if (!reader.open(input)) {
+        return false;
+    }
+    Surface patch;
+    long long n = 0;
+    float low[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, high[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    while (reader.read(patch)) {
+        Point c = patchcenter(patch);
+        float p[3] = { c.x, c.y, c.z };
+        for (int k = 0; k < 3; k++) {
+            low[k] = min(low[k], p[k]);
+            high[k] = max(high[k], p[k]);
+        }
+        n++;
+    }
+
+    // about chunkPatches per cell on average; flat axes (a sheet) get one cell
+    float extent[3], largest = 0;
+    for (int k = 0; k < 3; k++) {
+        extent[k] = n > 0 ? high[k] - low[k] : 0;
+        largest = max(largest, extent[k]);
+    }
+    double cells = (double)max(1LL, (n + chunkPatches - 1) / max(1, chunkPatches));
+    double volume = 1;
+    int axes = 0;
+    for (int k = 0; k < 3; k++) {
+        if (extent[k] > largest * 1e-3f && extent[k] > 0) {
+            volume *= extent[k];
+            axes++;
+        }
+    }
+    double scale = axes > 0 ? pow(cells / volume, 1.0 / axes) : 0;
+    int dims[3];
+    for (int k = 0; k < 3; k++) {
+        dims[k] = extent[k] > largest * 1e-3f && extent[k] > 0 ?
+            max(1, min(CHUNK_MAX_AXIS_CELLS, (int)ceil(extent[k] * scale))) : 1;
+    }
+    auto cellof = [&](const Surface& s) {
+        Point c = patchcenter(s);
+        float p[3] = { c.x, c.y, c.z };
+        int index[3];
+        for (int k = 0; k < 3; k++) {
+            index[k] = extent[k] > 0 ? (int)((p[k] - low[k]) / extent[k] * dims[k]) : 0;
+            index[k] = max(0, min(dims[k] - 1, index[k]));
+        }
+        return (index[2] * dims[1] + index[1]) * dims[0] + index[0];
+    };
+
+    // pass 2: patch count and control point bounds per cell
+    int cellCount = dims[0] * dims[1] * dims[2];
+    vector<ChunkRecord> cellRecords(cellCount);
+    for (int i = 0; i < cellCount; i++) {
+        ChunkRecord& r = cellRecords[i];
+        r.count = 0;
+        r.reserved = 0;
+        for (int k = 0; k < 3; k++) {
+            r.low[k] = FLT_MAX;
+            r.high[k] = -FLT_MAX;
+        }
+    }
+    PatchReader counter;
+    counter.open(input);
+    float f[48];
+    while (counter.read(patch)) {
+        ChunkRecord& r = cellRecords[cellof(patch)];
+        r.count++;
+        patchfloats(patch, f);
+        for (int p = 0; p < 16; p++) {
+            for (int k = 0; k < 3; k++) {
+                r.low[k] = min(r.low[k], f[3 * p + k]);
+                r.high[k] = max(r.high[k], f[3 * p + k]);
+            }
+        }
+    }
+
+    // non-empty cells become chunks, laid out in cell order after the index
+    vector<int> chunkOf(cellCount, -1);
+    vector<ChunkRecord> records;
+    for (int i = 0; i < cellCount; i++) {
+        if (cellRecords[i].count > 0) {
+            chunkOf[i] = records.size();
+            records.push_back(cellRecords[i]);
+        }
+    }
+    long long offset = 12 + (long long)records.size() * sizeof(ChunkRecord);
+    for (int i = 0; i < (int)records.size(); i++) {
+        records[i].offset = offset;
+        offset += (long long)records[i].count * sizeof(f);
+    }
+    FILE* file = fopen(output, "wb");
+    if (!file) {
+        return false;
+    }
+    unsigned int header[2] = { CHUNK_VERSION, (unsigned int)records.size() };
+    fwrite(CHUNK_MAGIC, 1, 4, file);
+    fwrite(header, sizeof(header), 1, file);
+    if (!records.empty()) {
+        fwrite(&records[0], sizeof(ChunkRecord), records.size(), file);
+    }
+
+    // pass 3: each patch goes to its chunk's next slot through a small buffer
+    vector<vector<float> > buffers(records.size());
+    vector<long long> cursors(records.size());
+    for (int i = 0; i < (int)records.size(); i++) {
+        cursors[i] = records[i].offset;
+    }
+    bool ok = true;
+    auto flush = [&](int chunk) {
+        vector<float>& buffer = buffers[chunk];
+        if (buffer.empty()) {
+            return;
+        }
+        ok = seekfile(file, cursors[chunk]) && fwrite(&buffer[0], sizeof(float), buffer.size(), file) == buffer.size() && ok;
+        cursors[chunk] += buffer.size() * sizeof(float);
+        buffer.clear();
+    };
+    PatchReader writer;
+    writer.open(input);
+    while (writer.read(patch)) {
+        int chunk = chunkOf[cellof(patch)];
+        patchfloats(patch, f);
+        buffers[chunk].insert(buffers[chunk].end(), f, f + 48);
+        if (buffers[chunk].size() == 48 * CHUNK_WRITE_BUFFER) {
+            flush(chunk);
+        }
+    }
+    for (int i = 0; i < (int)records.size(); i++) {
+        flush(i);
+    }
+    ok = !ferror(file) && ok;
+    return fclose(file) == 0 && ok;
+}
+
+bool ChunkedScene::open(const char* filename) {
+    chunks.clear();
+    patchCount = 0;
+    ifstream fin(filename, ios::binary);
+    char magic[4] = {};
+    unsigned int header[2];
+    if (!fin.read(magic, 4) || !equal(magic, magic + 4, CHUNK_MAGIC) ||
+        !fin.read((char*)header, sizeof(header)) || header[0] != CHUNK_VERSION) {
+        return false;
+    }
+    // check the counts against the file size before allocating anything
+    long long size = bytesleft(fin) + 12;
+    if ((long long)header[1] * (long long)sizeof(ChunkRecord) > size - 12) {
+        return false;
+    }
+    vector<ChunkRecord> records(header[1]);
+    if (header[1] > 0 && !fin.read((char*)&records[0], records.size() * sizeof(ChunkRecord))) {
+        return false;
+    }
+    for (int i = 0; i < (int)records.size(); i++) {
+        if (records[i].offset < 0 || records[i].offset + (long long)records[i].count * 48 * (long long)sizeof(float) > size) {
+            chunks.clear();
+            patchCount = 0;
+            return false;
+        }
+        SceneChunk chunk;
+        chunk.low = Point(records[i].low[0], records[i].low[1], records[i].low[2]);
+        chunk.high = Point(records[i].high[0], records[i].high[1], records[i].high[2]);
+        chunk.count = records[i].count;
+        chunk.offset = records[i].offset;
+        chunks.push_back(chunk);
+        patchCount += chunk.count;
+    }
+    path = filename;
+    return true;
+}
+
+bool ChunkedScene::readchunk(int index, vector<Surface>& out) const {
+    const SceneChunk& chunk = chunks[index];
+    ifstream fin(path.c_str(), ios::binary);
+    vector<float> f(48 * chunk.count);
+    if (!fin.seekg(chunk.offset) || (chunk.count > 0 && !fin.read((char*)&f[0], f.size() * sizeof(float)))) {
+        return false;
+    }
+    out.reserve(out.size() + chunk.count);
+    for (unsigned int i = 0; i < chunk.count; i++) {
+        out.push_back(floatsurface(&f[48 * i]));
+    }
+    return true;
+}
+
+//****************************************************
+// Scene assembly
+//****************************************************
+
+ScenePart::ScenePart(const string& path) {
+    this->path = path;
+    transformed = false;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 4; c++) {
+            transform[r][c] = r == c ? 1.0f : 0.0f;
+        }
+    }
+}
+
+// Rotation by `degrees` about the axis (Rodrigues), times `scale`, then offset
+static void placementmatrix(float scale, float degrees, const float axis[3], const float offset[3], float m[3][4]) {
+    float length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    float x = 0, y = 0, z = 1;
+    if (length > 0) {
+        x = axis[0] / length;
+        y = axis[1] / length;
+        z = axis[2] / length;
+    }
+    float a = degrees * 3.14159265f / 180, c = cos(a), s = sin(a), t = 1 - c;
+    float r[3][3] = {
+        { t * x * x + c, t * x * y - s * z, t * x * z + s * y },
+        { t * x * y + s * z, t * y * y + c, t * y * z - s * x },
+        { t * x * z - s * y, t * y * z + s * x, t * z * z + c }
+    };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m[i][j] = r[i][j] * scale;
+        }
+        m[i][3] = offset[i];
+    }
+}
+
+bool loadmanifest(const char* filename, vector<ScenePart>& parts, int& line) {
+    ifstream in(filename);
+    line = 0;
+    if (!in.good()) {
+        return false;
+    }
+    string file(filename);
+    size_t slash = file.find_last_of("/\\");
+    string directory = slash == string::npos ? "" : file.substr(0, slash + 1);
+    string text;
+    while (getline(in, text)) {
+        line++;
+        size_t comment = text.find('#');
+        if (comment != string::npos) {
+            text.erase(comment);
+        }
+        istringstream words(text);
+        string path;
+        if (!(words >> path)) {
+            continue;
+        }
+        bool absolute = path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':');
+        ScenePart part(absolute ? path : directory + path);
+        float scale = 1, degrees = 0, axis[3] = { 0, 0, 1 }, offset[3] = { 0, 0, 0 };
+        string word;
+        while (words >> word) {
+            if (word == "scale") {
+                words >> scale;
+            }
+            else if (word == "rotate") {
+                words >> degrees >> axis[0] >> axis[1] >> axis[2];
+            }
+            else if (word == "translate") {
+                words >> offset[0] >> offset[1] >> offset[2];
+            }
+            else {
+                return false;
+            }
+            if (words.fail()) {
+                return false;
+            }
+            part.transformed = true;
+        }
+        if (part.transformed) {
+            placementmatrix(scale, degrees, axis, offset, part.transform);
+        }
+        parts.push_back(part);
+    }
+    return true;
+}
+
+static Point transformpoint(const float m[3][4], const Point& p) {
+    return Point(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+}
+
+static void transformpatch(const float m[3][4], Surface& patch) {
+    Curve* rows[4] = { &patch.a, &patch.b, &patch.c, &patch.d };
+    for (int k = 0; k < 4; k++) {
+        Point* net[4] = { &rows[k]->a, &rows[k]->b, &rows[k]->c, &rows[k]->d };
+        for (int j = 0; j < 4; j++) {
+            *net[j] = transformpoint(m, *net[j]);
+        }
+    }
+}
+
+// Runs body(i) for i in [0, n) on up to `threads` threads, each taking the next index
+static void parallelindices(int n, int threads, const function<void(int)>& body) {
+    atomic<int> next(0);
+    vector<thread> pool;
+    for (int t = 0; t < max(1, min(threads, n)); t++) {
+        pool.push_back(thread([&]() {
+            for (int i = next++; i < n; i = next++) {
+                body(i);
+            }
+        }));
+    }
+    for (int t = 0; t < (int)pool.size(); t++) {
+        pool[t].join();
+    }
+}
+
+bool loadparts(const vector<ScenePart>& parts, vector<Surface>& patches, vector<int>& counts,
+    vector<double>& seconds, int threads) {
+    int n = parts.size();
+    vector<vector<Surface> > loaded(n);
+    counts.assign(n, -1);
+    seconds.assign(n, 0);
+    parallelindices(n, threads, [&](int i) {
+        double start = currentTime();
+        if (loadpatches(parts[i].path.c_str(), loaded[i])) {
+            if (parts[i].transformed) {
+                for (int k = 0; k < (int)loaded[i].size(); k++) {
+                    transformpatch(parts[i].transform, loaded[i][k]);
+                }
+            }
+            counts[i] = loaded[i].size();
+        }
+        seconds[i] = currentTime() - start;
+    });
+
+    // one allocation for the combined list, then each part copied into its slot
+    bool ok = true;
+    vector<size_t> offsets(n);
+    size_t total = patches.size();
+    for (int i = 0; i < n; i++) {
+        offsets[i] = total;
+        total += loaded[i].size();
+        ok = ok && counts[i] >= 0;
+    }
+    patches.resize(total);
+    parallelindices(n, threads, [&](int i) {
+        copy(loaded[i].begin(), loaded[i].end(), patches.begin() + offsets[i]);
+        vector<Surface>().swap(loaded[i]);
+    });
+    return ok;
+}
+
+//****************************************************
+// Batch tessellation
+//****************************************************
+
+long long gridvertexcount(const BezierContext& ctx, int count) {
+    return (long long)count * (ctx.divisions + 1) * (ctx.divisions + 1);
+}
+
+long long gridindexcount(const BezierContext& ctx, int count) {
+    return (long long)count * ctx.divisions * ctx.divisions * 6;
+}
+
+void tessellategrids(BezierContext& ctx, const Surface* patches, int count, Vertex* vertices,
+    unsigned int* indices, unsigned int baseVertex) {
+    int n = ctx.divisions;
+    int w = n + 1;
+    for (int i = 0; i < count; i++) {
+        gridkernel(patches[i], n, &ctx.basis[0], &ctx.dbasis[0], vertices + i * w * w);
+        if (!indices) {
+            continue;
+        }
+        for (int iu = 0; iu < n; iu++) {
+            for (int iv = 0; iv < n; iv++) {
+                unsigned int ll = baseVertex + i * w * w + iu * w + iv;
+                unsigned int ul = ll + w;
+                *indices++ = ll;
+                *indices++ = ul;
+                *indices++ = ul + 1;
+                *indices++ = ll;
+                *indices++ = ul + 1;
+                *indices++ = ll + 1;
+            }
+        }
+    }
+}
+
+void tessellateadaptive(BezierContext& ctx, const Surface* patches, int count, Mesh& mesh,
+    const MonomialPatch* mono) {
+    for (int i = 0; i < count; i++) {
+        ctx.scratch.clear();
+        adaptivepatch(patches[i], ctx.epsilon, ctx.scratch, mono ? &mono[i] : NULL);
+        appendtriangles(mesh, ctx.scratch);
+    }
+}
+
+// Midpoint (u, v) are dyadic with at most ADAPTIVE_MAX_DEPTH + 1 bits, so
+// they index an exact integer grid
+const int ADAPTIVE_GRID = 1 << (ADAPTIVE_MAX_DEPTH + 1);
+
+void tessellatebreadthfirst(BezierContext& ctx, const Surface* patches, int count, vector<Triangle>& out,
+    const MonomialPatch* mono, const PatchShape* shapes) {
+    ctx.level.clear();
+    ctx.owners.clear();
+    ctx.monomials.resize(mono ? 0 : count);
+    for (int i = 0; i < count; i++) {
+        Triangle roots[2];
+        if (shapes && shapes[i].flat) {
+            flattriangles(patches[i], shapes[i], roots);
+            out.insert(out.end(), roots, roots + 2);
+            continue;
+        }
+        if (!mono) {
+            ctx.monomials[i] = MonomialPatch(patches[i]);
+        }
+        adaptiveroots(patches[i], roots);
+        ctx.level.insert(ctx.level.end(), roots, roots + 2);
+        ctx.owners.push_back(i);
+        ctx.owners.push_back(i);
+    }
+    ctx.requests = 0;
+    ctx.evaluations = 0;
+    for (int depth = 1; !ctx.level.empty(); depth++) {
+        if (depth > ADAPTIVE_MAX_DEPTH) {
+            out.insert(out.end(), ctx.level.begin(), ctx.level.end());
+            break;
+        }
+
+        // gather the level's midpoints, each distinct (patch, u, v) once; owners
+        // are sorted, so one (u, v) table stamped per patch finds the shared ones
+        int n = ctx.level.size();
+        ctx.midpoints.resize(3 * n);
+        ctx.sampleOwners.clear();
+        ctx.sampleU.clear();
+        ctx.sampleV.clear();
+        ctx.gridStamp.assign((ADAPTIVE_GRID + 1) * (ADAPTIVE_GRID + 1), -1);
+        ctx.gridSample.resize(ctx.gridStamp.size());
+        for (int t = 0; t < n; t++) {
+            int owner = ctx.owners[t];
+            float u[3], v[3];
+            adaptivemidpoints(ctx.level[t], u, v);
+            for (int k = 0; k < 3; k++) {
+                int cell = (int)(u[k] * ADAPTIVE_GRID) * (ADAPTIVE_GRID + 1) + (int)(v[k] * ADAPTIVE_GRID);
+                if (ctx.gridStamp[cell] != owner) {
+                    ctx.gridStamp[cell] = owner;
+                    ctx.gridSample[cell] = ctx.sampleU.size();
+                    ctx.sampleOwners.push_back(owner);
+                    ctx.sampleU.push_back(u[k]);
+                    ctx.sampleV.push_back(v[k]);
+                }
+                ctx.midpoints[3 * t + k] = ctx.gridSample[cell];
+            }
+        }
+
+        // owners stay sorted from level to level, so each patch's samples are
+        // one run of the arrays and are evaluated in one batch
+        int m = ctx.sampleU.size();
+        ctx.samples.resize(m);
+        for (int s = 0; s < m;) {
+            int i = ctx.sampleOwners[s];
+            int e = s + 1;
+            while (e < m && ctx.sampleOwners[e] == i) {
+                e++;
+            }
+            monopatchbatch(mono ? mono[i] : ctx.monomials[i], &ctx.sampleU[s], &ctx.sampleV[s], e - s,
+                &ctx.samples[s]);
+            s = e;
+        }
+        ctx.requests += 3 * n;
+        ctx.evaluations += m;
+
+        ctx.nextLevel.clear();
+        ctx.nextLevel.reserve(4 * n);
+        ctx.nextOwners.clear();
+        for (int t = 0; t < n; t++) {
+            Point mid[3] = { ctx.samples[ctx.midpoints[3 * t]], ctx.samples[ctx.midpoints[3 * t + 1]],
+                ctx.samples[ctx.midpoints[3 * t + 2]] };
+            Triangle children[4];
+            int split = splitadaptive(ctx.level[t], mid, ctx.epsilon, children);
+            if (split == 0) {
+                out.push_back(ctx.level[t]);
+            }
+            for (int k = 0; k < split; k++) {
+                ctx.nextLevel.push_back(children[k]);
+                ctx.nextOwners.push_back(ctx.owners[t]);
+            }
+        }
+        ctx.level.swap(ctx.nextLevel);
+        ctx.owners.swap(ctx.nextOwners);
+    }
+}
+
+//****************************************************
+// Control-net flatness subdivision
+//****************************************************
+
+const int FLAT_GRID = 1 << FLAT_MAX_DEPTH;
+
+// de Casteljau split at t = 0.5, out[0..3] is the left half and out[3..6] the right
+static void splitcurve(Point a, Point b, Point c, Point d, Point out[7]) {
+    Point ab = a.midpoint(b);
+    Point bc = b.midpoint(c);
+    Point cd = c.midpoint(d);
+    Point abc = ab.midpoint(bc);
+    Point bcd = bc.midpoint(cd);
+    out[0] = a;
+    out[1] = ab;
+    out[2] = abc;
+    out[3] = abc.midpoint(bcd);
+    out[4] = bcd;
+    out[5] = cd;
+    out[6] = d;
+}
+
+// Splits a net into its four quadrants: out[a + 2 * b] is the a-th half in u, b-th in v
+static void splitnet(const SubPatch& n, SubPatch out[4]) {
+    Point rows[4][7];
+    for (int k = 0; k < 4; k++) {
+        splitcurve(n.p[k][0], n.p[k][1], n.p[k][2], n.p[k][3], rows[k]);
+    }
+    Point grid[7][7];
+    for (int j = 0; j < 7; j++) {
+        Point col[7];
+        splitcurve(rows[0][j], rows[1][j], rows[2][j], rows[3][j], col);
+        for (int k = 0; k < 7; k++) {
+            grid[k][j] = col[k];
+        }
+    }
+    for (int b = 0; b < 2; b++) {
+        for (int a = 0; a < 2; a++) {
+            SubPatch& child = out[a + 2 * b];
+            for (int k = 0; k < 4; k++) {
+                for (int j = 0; j < 4; j++) {
+                    child.p[k][j] = grid[3 * b + k][3 * a + j];
+                }
+            }
+            child.level = n.level + 1;
+            child.iu = 2 * n.iu + a;
+            child.iv = 2 * n.iv + b;
+        }
+    }
+}
+
+// Distance of the control net from the bilinear patch through its corners,
+// plus the bilinear's own deviation from the two triangles that will draw it.
+// By the convex hull property this bounds the surface error of the leaf.
+static float netflatness(const SubPatch& n) {
+    Point c00 = n.p[0][0];
+    Point c10 = n.p[0][3];
+    Point c01 = n.p[3][0];
+    Point c11 = n.p[3][3];
+    float dev = 0;
+    for (int k = 0; k < 4; k++) {
+        float t = k / 3.0f;
+        for (int j = 0; j < 4; j++) {
+            float s = j / 3.0f;
+            Point b = c00.scalarMult((1 - s) * (1 - t)).add(c10.scalarMult(s * (1 - t)))
+                .add(c01.scalarMult((1 - s) * t)).add(c11.scalarMult(s * t));
+            dev = fmax(dev, b.distance(n.p[k][j]));
+        }
+    }
+    Point twist = c00.add(c11).add(c10.scalarMult(-1)).add(c01.scalarMult(-1));
+    return dev + twist.distance(Point()) / 4;
+}
+
+// Surface normal at corner (j, k) of a net, j and k are 0 or 3. Walks further
+// into the net when the nearest control points coincide (collapsed edges).
+static Vector netcornernormal(const SubPatch& n, int j, int k) {
+    int dj = j == 0 ? 1 : -1;
+    int dk = k == 0 ? 1 : -1;
+    Vector du, dv;
+    for (int r = 0; r < 4; r++) {
+        int kk = k + dk * (r / 2);
+        int s = 1 + r % 2;
+        Point a = n.p[kk][j];
+        Point b = n.p[kk][j + dj * s];
+        du = Vector((b.x - a.x) * dj, (b.y - a.y) * dj, (b.z - a.z) * dj);
+        if (dot(du, du) > 1e-12) {
+            break;
+        }
+    }
+    for (int r = 0; r < 4; r++) {
+        int jj = j + dj * (r / 2);
+        int s = 1 + r % 2;
+        Point a = n.p[k][jj];
+        Point b = n.p[k + dk * s][jj];
+        dv = Vector((b.x - a.x) * dk, (b.y - a.y) * dk, (b.z - a.z) * dk);
+        if (dot(dv, dv) > 1e-12) {
+            break;
+        }
+    }
+    Vector normal = cross(du, dv);
+    normal.normalize();
+    return normal;
+}
+
+static void flattenpatch(const SubPatch& n, float epsilon, vector<SubPatch>& leaves) {
+    if (n.level >= FLAT_MAX_DEPTH || netflatness(n) < epsilon) {
+        leaves.push_back(n);
+        return;
+    }
+    SubPatch children[4];
+    splitnet(n, children);
+    for (int i = 0; i < 4; i++) {
+        flattenpatch(children[i], epsilon, leaves);
+    }
+}
+
+static inline long long gridkey(int major, int minor) {
+    return (long long)major * (FLAT_GRID + 1) + minor;
+}
+
+// Appends the vertices strictly between minor0 and minor1 on grid line `major`,
+// in the direction of travel
+static void collectedge(map<long long, Point>& line, int major, int minor0, int minor1, bool alongU,
+    vector<Point>& ring, vector<int>& ringu, vector<int>& ringv) {
+    int first = ring.size();
+    map<long long, Point>::iterator it = line.upper_bound(gridkey(major, min(minor0, minor1)));
+    map<long long, Point>::iterator end = line.lower_bound(gridkey(major, max(minor0, minor1)));
+    for (; it != end; ++it) {
+        int minor = (int)(it->first % (FLAT_GRID + 1));
+        ring.push_back(it->second);
+        ringu.push_back(alongU ? minor : major);
+        ringv.push_back(alongU ? major : minor);
+    }
+    if (minor0 > minor1) {
+        reverse(ring.begin() + first, ring.end());
+        reverse(ringu.begin() + first, ringu.end());
+        reverse(ringv.begin() + first, ringv.end());
+    }
+}
+
+// Appends the leaves of one patch to out. A leaf next to finer leaves picks
+// up their edge vertices and is drawn as a fan, so there are no T-junction cracks.
+static void emitflatleaves(const vector<SubPatch>& leaves, vector<Triangle>& out) {
+    map<long long, Point> rows; // keyed by (v, u)
+    map<long long, Point> cols; // keyed by (u, v)
+    for (int i = 0; i < (int)leaves.size(); i++) {
+        const SubPatch& n = leaves[i];
+        int size = 1 << (FLAT_MAX_DEPTH - n.level);
+        for (int c = 0; c < 4; c++) {
+            int j = (c & 1) * 3;
+            int k = (c >> 1) * 3;
+            int gu = n.iu * size + (j ? size : 0);
+            int gv = n.iv * size + (k ? size : 0);
+            if (rows.count(gridkey(gv, gu))) {
+                continue;
+            }
+            Point p = n.p[k][j];
+            p.normal1 = netcornernormal(n, j, k);
+            p.normal2 = p.normal1.scalarMult(-1);
+            rows[gridkey(gv, gu)] = p;
+            cols[gridkey(gu, gv)] = p;
+        }
+    }
+
+    float scale = 1.0f / FLAT_GRID;
+    vector<Point> ring;
+    vector<int> ringu, ringv;
+    for (int i = 0; i < (int)leaves.size(); i++) {
+        const SubPatch& n = leaves[i];
+        int size = 1 << (FLAT_MAX_DEPTH - n.level);
+        int u0 = n.iu * size, u1 = u0 + size;
+        int v0 = n.iv * size, v1 = v0 + size;
+
+        // walk the boundary counter-clockwise in (u, v)
+        ring.clear();
+        ringu.clear();
+        ringv.clear();
+        ring.push_back(rows[gridkey(v0, u0)]);
+        ringu.push_back(u0);
+        ringv.push_back(v0);
+        collectedge(rows, v0, u0, u1, true, ring, ringu, ringv);
+        ring.push_back(rows[gridkey(v0, u1)]);
+        ringu.push_back(u1);
+        ringv.push_back(v0);
+        collectedge(cols, u1, v0, v1, false, ring, ringu, ringv);
+        ring.push_back(rows[gridkey(v1, u1)]);
+        ringu.push_back(u1);
+        ringv.push_back(v1);
+        collectedge(rows, v1, u1, u0, true, ring, ringu, ringv);
+        ring.push_back(rows[gridkey(v1, u0)]);
+        ringu.push_back(u0);
+        ringv.push_back(v1);
+        collectedge(cols, u0, v1, v0, false, ring, ringu, ringv);
+
+        if (ring.size() == 4) {
+            out.push_back(maketriangle(ring[0], u0 * scale, v0 * scale,
+                ring[1], u1 * scale, v0 * scale, ring[2], u1 * scale, v1 * scale));
+            out.push_back(maketriangle(ring[0], u0 * scale, v0 * scale,
+                ring[2], u1 * scale, v1 * scale, ring[3], u0 * scale, v1 * scale));
+            continue;
+        }
+
+        // fan around the center of the sub-patch, B(1/2) = (1, 3, 3, 1) / 8
+        const float w[4] = { 0.125f, 0.375f, 0.375f, 0.125f };
+        Point center;
+        for (int k = 0; k < 4; k++) {
+            for (int j = 0; j < 4; j++) {
+                center = center.add(n.p[k][j].scalarMult(w[k] * w[j]));
+            }
+        }
+        Vector normal;
+        for (int c = 0; c < (int)ring.size(); c++) {
+            normal = Vector(normal.x + ring[c].normal1.x, normal.y + ring[c].normal1.y, normal.z + ring[c].normal1.z);
+        }
+        normal.normalize();
+        center.normal1 = normal;
+        center.normal2 = normal.scalarMult(-1);
+        float cu = (u0 + u1) * 0.5f * scale;
+        float cv = (v0 + v1) * 0.5f * scale;
+        for (int c = 0; c < (int)ring.size(); c++) {
+            int d = (c + 1) % ring.size();
+            out.push_back(maketriangle(center, cu, cv, ring[c], ringu[c] * scale, ringv[c] * scale,
+                ring[d], ringu[d] * scale, ringv[d] * scale));
+        }
+    }
+}
+
+void tessellateflat(BezierContext& ctx, const Surface* patches, int count, vector<Triangle>& out) {
+    vector<SubPatch> leaves;
+    for (int i = 0; i < count; i++) {
+        leaves.clear();
+        flattenpatch(SubPatch(patches[i]), ctx.epsilon, leaves);
+        emitflatleaves(leaves, out);
+    }
+}
+
+//****************************************************
+// Error-budgeted tessellation: one max-heap of
+// sub-patches across all patches, worst error first
+//****************************************************
+class BudgetEntry {
+public:
+    float error;
+    int node;
+    bool operator<(const BudgetEntry& other) const { return error < other.error; }
+};
+
+// Refines the worst sub-patch of the whole scene until its error is below
+// `target` or the leaves would exceed `maxLeaves`. Returns the remaining worst
+// error, including sub-patches that stopped at FLAT_MAX_DEPTH.
+static float refinebudget(const Surface* patches, int count, float target, int maxLeaves,
+    vector<vector<SubPatch> >& leaves) {
+    vector<SubPatch> nodes;
+    vector<int> owner;
+    priority_queue<BudgetEntry> heap;
+    leaves.assign(count, vector<SubPatch>());
+    for (int i = 0; i < count; i++) {
+        BudgetEntry e = { netflatness(SubPatch(patches[i])), (int)nodes.size() };
+        nodes.push_back(SubPatch(patches[i]));
+        owner.push_back(i);
+        heap.push(e);
+    }
+
+    int leafCount = heap.size();
+    float capped = 0; // worst error of the leaves taken off the heap at the depth limit
+    while (!heap.empty()) {
+        BudgetEntry worst = heap.top();
+        if (worst.error < target || leafCount + 3 > maxLeaves) {
+            break;
+        }
+        heap.pop();
+        SubPatch n = nodes[worst.node];
+        if (n.level >= FLAT_MAX_DEPTH) {
+            leaves[owner[worst.node]].push_back(n);
+            capped = max(capped, worst.error);
+            continue;
+        }
+        SubPatch children[4];
+        splitnet(n, children);
+        for (int c = 0; c < 4; c++) {
+            BudgetEntry e = { netflatness(children[c]), c == 0 ? worst.node : (int)nodes.size() };
+            if (c == 0) {
+                nodes[worst.node] = children[c];
+            }
+            else {
+                nodes.push_back(children[c]);
+                owner.push_back(owner[worst.node]);
+            }
+            heap.push(e);
+        }
+        leafCount += 3;
+    }
+
+    float remaining = max(capped, heap.empty() ? 0.0f : heap.top().error);
+    while (!heap.empty()) {
+        int node = heap.top().node;
+        leaves[owner[node]].push_back(nodes[node]);
+        heap.pop();
+    }
+    return remaining;
+}
+
+// Leaves are drawn as two triangles, or as fans where they meet finer
+// neighbours, so the leaf allowance is tightened until the real count fits.
+float tessellatebudget(BezierContext& ctx, const Surface* patches, int count, int maxTriangles,
+    vector<Triangle>& out, vector<int>* firsts) {
+    size_t first = out.size();
+    int maxLeaves = maxTriangles / 2;
+    float remaining = 0;
+    while (true) {
+        vector<vector<SubPatch> > leaves;
+        remaining = refinebudget(patches, count, ctx.epsilon, maxLeaves, leaves);
+        out.resize(first);
+        if (firsts) {
+            firsts->resize(count + 1);
+        }
+        for (int i = 0; i < (int)leaves.size(); i++) {
+            if (firsts) {
+                (*firsts)[i] = (int)out.size();
+            }
+            emitflatleaves(leaves[i], out);
+        }
+        if (firsts) {
+            (*firsts)[count] = (int)out.size();
+        }
+        int triangles = (int)(out.size() - first);
+        if (triangles <= maxTriangles || maxLeaves <= count) {
+            break;
+        }
+        maxLeaves = (int)((double)maxLeaves * maxTriangles / triangles);
+    }
+    return remaining;
+}
+
+//****************************************************
+// Per-patch grids
+//****************************************************
+
+// Uniform parameters of every point of a rows x columns grid
+static void uniformgrid(int rows, int columns, PatchGrid& out) {
+    out.rows = rows;
+    out.columns = columns;
+    out.us.resize((rows + 1) * (columns + 1));
+    out.vs.resize(out.us.size());
+    for (int iu = 0; iu <= rows; iu++) {
+        for (int iv = 0; iv <= columns; iv++) {
+            out.us[out.index(iu, iv)] = (float)iu / rows;
+            out.vs[out.index(iu, iv)] = (float)iv / columns;
+        }
+    }
+}
+
+// Rows x columns parameters, spaced by curvature or uniform
+static void gridparameters(const Surface& patch, const MonomialPatch& mono, int rows, int columns, bool spaced,
+    PatchGrid& out) {
+    if (spaced) {
+        out.rows = rows;
+        out.columns = columns;
+        curvaturegrid(patch, mono, rows, columns, out.us, out.vs);
+    }
+    else {
+        uniformgrid(rows, columns, out);
+    }
+}
+
+bool hasfixedkernel(int n) {
+    return n == 4 || n == 8 || n == 16 || n == 32;
+}
+
+// A flat patch as a 1 x 1 grid of its corners with the plane normal
+static void flatgrid(const Surface& patch, const PatchShape& shape, PatchGrid& out) {
+    uniformgrid(1, 1, out);
+    Triangle tris[2];
+    flattriangles(patch, shape, tris);
+    out.points.resize(4);
+    out.points[0] = tris[0].a;
+    out.points[1] = tris[1].c;
+    out.points[2] = tris[0].b;
+    out.points[3] = tris[0].c;
+}
+
+void patchgrid(BezierContext& ctx, const Surface& patch, int rows, int columns, bool spaced, PatchGrid& out,
+    const MonomialPatch* mono, const PatchShape* shape) {
+    if (shape && shape->flat) {
+        flatgrid(patch, *shape, out);
+        return;
+    }
+    if (spaced) {
+        gridparameters(patch, mono ? *mono : MonomialPatch(patch), rows, columns, true, out);
+    }
+    else {
+        uniformgrid(rows, columns, out);
+    }
+    out.points.resize((rows + 1) * (columns + 1));
+
+    if (!spaced && rows == columns && ctx.fixedKernels && hasfixedkernel(rows)) {
+        ctx.gridVertices.resize(out.points.size());
+        gridkernel(patch, rows, NULL, NULL, &ctx.gridVertices[0]);
+        for (int i = 0; i < (int)out.points.size(); i++) {
+            const Vertex& v = ctx.gridVertices[i];
+            Point& p = out.points[i];
+            p = Point(v.x, v.y, v.z);
+            p.normal1 = Vector(v.nx, v.ny, v.nz);
+            p.normal2 = p.normal1.scalarMult(-1);
+        }
+        return;
+    }
+
+    for (int i = 0; i < (int)out.points.size(); i++) {
+        out.points[i] = patchinterp(patch, mono, out.us[i], out.vs[i]);
+    }
+}
+
+void gridtriangles(const PatchGrid& grid, vector<Triangle>& out) {
+    for (int iu = 0; iu < grid.rows; iu++) {
+        for (int iv = 0; iv < grid.columns; iv++) {
+            int ll = grid.index(iu, iv), ul = grid.index(iu + 1, iv);
+            int ur = ul + 1, lr = ll + 1;
+            const vector<Point>& p = grid.points;
+            const vector<float>& u = grid.us;
+            const vector<float>& v = grid.vs;
+            out.push_back(maketriangle(p[ll], u[ll], v[ll], p[ul], u[ul], v[ul], p[ur], u[ur], v[ur]));
+            out.push_back(maketriangle(p[ll], u[ll], v[ll], p[ur], u[ur], v[ur], p[lr], u[lr], v[lr]));
+        }
+    }
+}
+
+//****************************************************
+// Tessellation accuracy
+//****************************************************
+
+void accumulatedeviation(const MonomialPatch& patch, const Triangle* tris, int count, Deviation& d) {
+    for (int t = 0; t < count; t++) {
+        const Triangle& tri = tris[t];
+        for (int i = 0; i <= DEVIATION_SAMPLES; i++) {
+            for (int j = 0; i + j <= DEVIATION_SAMPLES; j++) {
+                float wa = (float)i / DEVIATION_SAMPLES;
+                float wb = (float)j / DEVIATION_SAMPLES;
+                float wc = 1 - wa - wb;
+                Point m = tri.a.scalarMult(wa).add(tri.b.scalarMult(wb)).add(tri.c.scalarMult(wc));
+                Point q = monopatchinterp(patch, tri.au * wa + tri.bu * wb + tri.cu * wc,
+                    tri.av * wa + tri.bv * wb + tri.cv * wc);
+                float e = m.distance(q);
+                d.maxError = fmax(d.maxError, e);
+                d.sumError += e;
+                d.samples++;
+            }
+        }
+    }
+}
+
+void accumulateplanedeviation(const PatchShape& shape, const Point& origin, const Triangle* tris, int count,
+    Deviation& d) {
+    for (int t = 0; t < count; t++) {
+        const Triangle& tri = tris[t];
+        for (int i = 0; i <= DEVIATION_SAMPLES; i++) {
+            for (int j = 0; i + j <= DEVIATION_SAMPLES; j++) {
+                float wa = (float)i / DEVIATION_SAMPLES;
+                float wb = (float)j / DEVIATION_SAMPLES;
+                float wc = 1 - wa - wb;
+                Point m = tri.a.scalarMult(wa).add(tri.b.scalarMult(wb)).add(tri.c.scalarMult(wc));
+                Vector w(m.x - origin.x, m.y - origin.y, m.z - origin.z);
+                float e = fabs(dot(w, shape.normal));
+                d.maxError = fmax(d.maxError, e);
+                d.sumError += e;
+                d.samples++;
+            }
+        }
+    }
+}
+
+float griddeviation(const Surface& patch, const MonomialPatch& mono, int rows, int columns, bool spaced) {
+    PatchGrid grid;
+    gridparameters(patch, mono, rows, columns, spaced, grid);
+    grid.points.resize(grid.us.size());
+    for (int i = 0; i < (int)grid.points.size(); i++) {
+        grid.points[i] = monopatchinterp(mono, grid.us[i], grid.vs[i]);
+    }
+    vector<Triangle> tris;
+    gridtriangles(grid, tris);
+    Deviation d;
+    accumulatedeviation(mono, &tris[0], tris.size(), d);
+    return d.maxError;
+}
+
+int uniformdivisions(const Surface& patch, const MonomialPatch& mono, float maxError) {
+    // grow geometrically first so fine grids are only built when needed
+    int lo = 1, hi = 1;
+    while (hi < MAX_DIVISIONS && griddeviation(patch, mono, hi, hi, false) > maxError) {
+        lo = hi + 1;
+        hi = min(2 * hi, MAX_DIVISIONS);
+    }
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (griddeviation(patch, mono, mid, mid, false) <= maxError) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// The estimate from curvaturedivisions is asymptotic, so it is checked
+// against the measured deviation: grown while above maxError, shrunk while
+// there is room.
+void spaceddivisions(const Surface& patch, const MonomialPatch& mono, float maxError, int& rows, int& columns) {
+    curvaturedivisions(mono, maxError, rows, columns);
+    rows = min(rows, MAX_DIVISIONS);
+    columns = min(columns, MAX_DIVISIONS);
+    while ((rows < MAX_DIVISIONS || columns < MAX_DIVISIONS) && griddeviation(patch, mono, rows, columns, true) > maxError) {
+        rows = min(MAX_DIVISIONS, rows + max(1, rows / 8));
+        columns = min(MAX_DIVISIONS, columns + max(1, columns / 8));
+    }
+    for (;;) {
+        int r = max(1, rows - max(1, rows / 8)), c = max(1, columns - max(1, columns / 8));
+        if ((r == rows && c == columns) || griddeviation(patch, mono, r, c, true) > maxError) {
+            break;
+        }
+        rows = r;
+        columns = c;
+    }
+}
+
+//****************************************************
+// LOD chains
+//****************************************************
+
+LodChain::LodChain() {
+    finest = 0;
+    levels = 0;
+}
+
+int LodChain::divisions(int level) const {
+    return 2 << level;
+}
+
+int LodChain::patchvertices() const {
+    return (finest + 1) * (finest + 1);
+}
+
+void LodChain::build(const Surface* patches, int count, int finestDivisions) {
+    levels = 1;
+    while (divisions(levels - 1) < finestDivisions) {
+        levels++;
+    }
+    finest = divisions(levels - 1);
+    int w = finest + 1;
+
+    // shared per-level index buffers and the level that introduces each vertex
+    introduced.assign(w * w, -1);
+    for (int l = levels - 1; l >= 0; l--) {
+        int stride = finest / divisions(l);
+        for (int i = 0; i < w; i += stride) {
+            for (int j = 0; j < w; j += stride) {
+                if (i % (2 * stride) != 0 || j % (2 * stride) != 0) {
+                    introduced[i * w + j] = l;
+                }
+            }
+        }
+    }
+    strided.assign(levels, vector<unsigned int>());
+    compact.assign(levels, vector<unsigned int>());
+    members.assign(levels, vector<unsigned int>());
+    sources.assign(levels, vector<unsigned int>());
+    for (int l = 0; l < levels; l++) {
+        int n = divisions(l), stride = finest / n;
+        for (int iu = 0; iu <= n; iu++) {
+            for (int iv = 0; iv <= n; iv++) {
+                int i = iu * stride, j = iv * stride;
+                members[l].push_back(i * w + j);
+                // on a coarse row, a coarse column, or the diagonal of a coarse quad
+                int du = iu % 2 ? stride : 0, dv = iv % 2 ? stride : 0;
+                sources[l].push_back((i - du) * w + (j - dv));
+                sources[l].push_back((i + du) * w + (j + dv));
+            }
+        }
+        // same winding and diagonal as tessellategrids
+        for (int iu = 0; iu < n; iu++) {
+            for (int iv = 0; iv < n; iv++) {
+                unsigned int quad[2][4] = {
+                    { (unsigned int)(iu * stride * w + iv * stride), (unsigned int)((iu + 1) * stride * w + iv * stride),
+                      (unsigned int)((iu + 1) * stride * w + (iv + 1) * stride), (unsigned int)(iu * stride * w + (iv + 1) * stride) },
+                    { (unsigned int)(iu * (n + 1) + iv), (unsigned int)((iu + 1) * (n + 1) + iv),
+                      (unsigned int)((iu + 1) * (n + 1) + iv + 1), (unsigned int)(iu * (n + 1) + iv + 1) } };
+                vector<unsigned int>* out[2] = { &strided[l], &compact[l] };
+                for (int k = 0; k < 2; k++) {
+                    unsigned int* q = quad[k];
+                    unsigned int tri[6] = { q[0], q[1], q[2], q[0], q[2], q[3] };
+                    out[k]->insert(out[k]->end(), tri, tri + 6);
+                }
+            }
+        }
+    }
+
+    BezierContext ctx(finest);
+    vertices.resize((size_t)count * w * w);
+    tessellategrids(ctx, patches, count, &vertices[0], NULL);
+    findneighbours(patches, count);
+}
+
+// Patch edges whose boundary curves have the same control points, in either
+// direction, are paired. Collapsed edges and third patches on a curve stay unpaired.
+void LodChain::findneighbours(const Surface* patches, int count) {
+    neighbours.assign(4 * count, -1);
+    map<vector<float>, int> open;
+    for (int i = 0; i < count; i++) {
+        SubPatch net(patches[i]);
+        for (int e = 0; e < 4; e++) {
+            Point p[4];
+            for (int k = 0; k < 4; k++) {
+                p[k] = e == 0 ? net.p[0][k] : e == 1 ? net.p[3][k] : e == 2 ? net.p[k][0] : net.p[k][3];
+            }
+            if (p[0].distance(p[3]) == 0 && p[0].distance(p[1]) == 0 && p[0].distance(p[2]) == 0) {
+                continue;
+            }
+            Point reversed[4] = { p[3], p[2], p[1], p[0] };
+            const Point* first = lexicographical_compare(reversed, reversed + 4, p, p + 4, pointbefore) ? reversed : p;
+            vector<float> key;
+            for (int k = 0; k < 4; k++) {
+                key.push_back(first[k].x);
+                key.push_back(first[k].y);
+                key.push_back(first[k].z);
+            }
+            map<vector<float>, int>::iterator it = open.find(key);
+            if (it == open.end()) {
+                open[key] = 4 * i + e;
+            }
+            else if (it->second >= 0) {
+                neighbours[4 * i + e] = it->second;
+                neighbours[it->second] = 4 * i + e;
+                it->second = -1;
+            }
+        }
+    }
+}
+
+int LodChain::edgeindex(int edge, int j) const {
+    int w = finest + 1;
+    switch (edge) {
+    case 0:
+        return j * w;
+    case 1:
+        return j * w + finest;
+    case 2:
+        return j;
+    }
+    return finest * w + j;
+}
+
+// Vertex j of an edge as `level` draws it, morphing by t where that level adds it
+Vertex LodChain::edgepoint(const Vertex* grid, int edge, int j, int level, float t) const {
+    int index = edgeindex(edge, j);
+    Vertex v = grid[index];
+    if (introduced[index] == level && t < 1) {
+        int stride = finest / divisions(level);
+        const Vertex& a = grid[edgeindex(edge, j - stride)];
+        const Vertex& b = grid[edgeindex(edge, j + stride)];
+        float s = (1 - t) * 0.5f;
+        v.x = v.x * t + (a.x + b.x) * s;
+        v.y = v.y * t + (a.y + b.y) * s;
+        v.z = v.z * t + (a.z + b.z) * s;
+        v.nx = v.nx * t + (a.nx + b.nx) * s;
+        v.ny = v.ny * t + (a.ny + b.ny) * s;
+        v.nz = v.nz * t + (a.nz + b.nz) * s;
+    }
+    return v;
+}
+
+// Vertex j of an edge drawn at a coarser level: between that level's
+// vertices it lies on their segment
+Vertex LodChain::edgevertex(const Vertex* grid, int edge, int j, int level, float t) const {
+    int stride = finest / divisions(level);
+    int j0 = j - j % stride;
+    if (j0 == j) {
+        return edgepoint(grid, edge, j, level, t);
+    }
+    Vertex a = edgepoint(grid, edge, j0, level, t);
+    Vertex b = edgepoint(grid, edge, j0 + stride, level, t);
+    float f = (float)(j - j0) / stride;
+    Vertex v;
+    v.x = a.x + (b.x - a.x) * f;
+    v.y = a.y + (b.y - a.y) * f;
+    v.z = a.z + (b.z - a.z) * f;
+    v.nx = a.nx + (b.nx - a.nx) * f;
+    v.ny = a.ny + (b.ny - a.ny) * f;
+    v.nz = a.nz + (b.nz - a.nz) * f;
+    v.u = a.u + (b.u - a.u) * f;
+    v.v = a.v + (b.v - a.v) * f;
+    return v;
+}
+
+void LodChain::morph(int patch, int level, float t, Vertex* out, const int* edgeLevels, const float* edgeTs) const {
+    const Vertex* grid = &vertices[(size_t)patch * patchvertices()];
+    const vector<unsigned int>& m = members[level];
+    const unsigned int* from = &sources[level][0];
+    float s = (1 - t) * 0.5f;
+    for (int k = 0; k < (int)m.size(); k++) {
+        const Vertex& v = grid[m[k]];
+        out[k] = v;
+        if (introduced[m[k]] == level && t < 1) {
+            const Vertex& a = grid[from[2 * k]];
+            const Vertex& b = grid[from[2 * k + 1]];
+            out[k].x = v.x * t + (a.x + b.x) * s;
+            out[k].y = v.y * t + (a.y + b.y) * s;
+            out[k].z = v.z * t + (a.z + b.z) * s;
+            out[k].nx = v.nx * t + (a.nx + b.nx) * s;
+            out[k].ny = v.ny * t + (a.ny + b.ny) * s;
+            out[k].nz = v.nz * t + (a.nz + b.nz) * s;
+        }
+    }
+    if (!edgeLevels) {
+        return;
+    }
+    int n = divisions(level), stride = finest / n;
+    for (int e = 0; e < 4; e++) {
+        if (edgeLevels[e] == level && edgeTs[e] == t) {
+            continue;
+        }
+        for (int k = 0; k <= n; k++) {
+            int iu = e < 2 ? k : (e == 2 ? 0 : n);
+            int iv = e < 2 ? (e == 0 ? 0 : n) : k;
+            out[iu * (n + 1) + iv] = edgevertex(grid, e, k * stride, edgeLevels[e], edgeTs[e]);
+        }
+    }
+}
+
+//****************************************************
+// Closest-point queries
+//****************************************************
+const int QUERY_SEEDS = 8;          // seed grid resolution per patch
+const int QUERY_LEAF_PATCHES = 2;
+const int NEWTON_ITERATIONS = 10;
+
+// Value and first and second derivatives of one power-basis coordinate:
+// out = p, pu, pv, puu, puv, pvv
+static void monoderivatives(const float c[4][4], float u, float v, float out[6]) {
+    float pu[4] = { 1, u, u * u, u * u * u };
+    float du[4] = { 0, 1, 2 * u, 3 * u * u };
+    float ddu[4] = { 0, 0, 2, 6 * u };
+    float pv[4] = { 1, v, v * v, v * v * v };
+    float dv[4] = { 0, 1, 2 * v, 3 * v * v };
+    float ddv[4] = { 0, 0, 2, 6 * v };
+    for (int i = 0; i < 6; i++) {
+        out[i] = 0;
+    }
+    for (int k = 0; k < 4; k++) {
+        for (int l = 0; l < 4; l++) {
+            float w = c[k][l];
+            out[0] += w * pv[k] * pu[l];
+            out[1] += w * pv[k] * du[l];
+            out[2] += w * dv[k] * pu[l];
+            out[3] += w * pv[k] * ddu[l];
+            out[4] += w * dv[k] * du[l];
+            out[5] += w * ddv[k] * pu[l];
+        }
+    }
+}
+
+static inline float sqr3(float x, float y, float z) {
+    return x * x + y * y + z * z;
+}
+
+static float boxdistance2(const float* lo, const float* hi, const Point& q) {
+    float p[3] = { q.x, q.y, q.z };
+    float d2 = 0;
+    for (int a = 0; a < 3; a++) {
+        float d = max(max(lo[a] - p[a], p[a] - hi[a]), 0.0f);
+        d2 += d * d;
+    }
+    return d2;
+}
+
+SurfaceQuery::SurfaceQuery(const Surface* patches, int count) {
+    int w = QUERY_SEEDS + 1;
+    bounds.resize(6 * count);
+    seeds.resize(3 * w * w * count);
+    for (int i = 0; i < count; i++) {
+        mono.push_back(MonomialPatch(patches[i]));
+        // the patch lies inside the convex hull of its control points
+        SubPatch net(patches[i]);
+        float* b = &bounds[6 * i];
+        b[0] = b[1] = b[2] = FLT_MAX;
+        b[3] = b[4] = b[5] = -FLT_MAX;
+        for (int k = 0; k < 4; k++) {
+            for (int j = 0; j < 4; j++) {
+                float p[3] = { net.p[k][j].x, net.p[k][j].y, net.p[k][j].z };
+                for (int a = 0; a < 3; a++) {
+                    b[a] = min(b[a], p[a]);
+                    b[3 + a] = max(b[3 + a], p[a]);
+                }
+            }
+        }
+        for (int iu = 0; iu < w; iu++) {
+            for (int iv = 0; iv < w; iv++) {
+                Point p = monopatchinterp(mono[i], (float)iu / QUERY_SEEDS, (float)iv / QUERY_SEEDS);
+                float* seed = &seeds[3 * ((i * w + iu) * w + iv)];
+                seed[0] = p.x;
+                seed[1] = p.y;
+                seed[2] = p.z;
+            }
+        }
+        order.push_back(i);
+    }
+    if (count > 0) {
+        build(0, count);
+    }
+}
+
+// Median split of order[first, last) along the longest axis of the bounds
+int SurfaceQuery::build(int first, int last) {
+    Node node;
+    for (int a = 0; a < 3; a++) {
+        node.lo[a] = FLT_MAX;
+        node.hi[a] = -FLT_MAX;
+    }
+    for (int i = first; i < last; i++) {
+        const float* b = &bounds[6 * order[i]];
+        for (int a = 0; a < 3; a++) {
+            node.lo[a] = min(node.lo[a], b[a]);
+            node.hi[a] = max(node.hi[a], b[3 + a]);
+        }
+    }
+    node.left = node.right = -1;
+    node.first = first;
+    node.last = last;
+    int index = nodes.size();
+    nodes.push_back(node);
+    if (last - first <= QUERY_LEAF_PATCHES) {
+        return index;
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (node.hi[a] - node.lo[a] > node.hi[axis] - node.lo[axis]) {
+            axis = a;
+        }
+    }
+    const vector<float>& b = bounds;
+    int mid = (first + last) / 2;
+    nth_element(order.begin() + first, order.begin() + mid, order.begin() + last, [&](int x, int y) {
+        return b[6 * x + axis] + b[6 * x + 3 + axis] < b[6 * y + axis] + b[6 * y + 3 + axis];
+    });
+    int left = build(first, mid);
+    int right = build(mid, last);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    return index;
+}
+
+// Newton on f(u, v) = |P(u, v) - q|^2 / 2 from (u, v), clamped to the unit
+// square; falls back to Gauss-Newton where the Hessian is indefinite. Returns
+// the squared distance at the final (u, v).
+static float newtonclosest(const MonomialPatch& m, const Point& q, float& u, float& v, Point& point) {
+    float x[6], y[6], z[6];
+    monoderivatives(m.cx, u, v, x);
+    monoderivatives(m.cy, u, v, y);
+    monoderivatives(m.cz, u, v, z);
+    float d2 = sqr3(x[0] - q.x, y[0] - q.y, z[0] - q.z);
+    for (int it = 0; it < NEWTON_ITERATIONS; it++) {
+        float r[3] = { x[0] - q.x, y[0] - q.y, z[0] - q.z };
+        float gu = x[1] * r[0] + y[1] * r[1] + z[1] * r[2];
+        float gv = x[2] * r[0] + y[2] * r[1] + z[2] * r[2];
+        float huu = x[1] * x[1] + y[1] * y[1] + z[1] * z[1];
+        float huv = x[1] * x[2] + y[1] * y[2] + z[1] * z[2];
+        float hvv = x[2] * x[2] + y[2] * y[2] + z[2] * z[2];
+        float fuu = huu + x[3] * r[0] + y[3] * r[1] + z[3] * r[2];
+        float fuv = huv + x[4] * r[0] + y[4] * r[1] + z[4] * r[2];
+        float fvv = hvv + x[5] * r[0] + y[5] * r[1] + z[5] * r[2];
+        if (fuu <= 0 || fvv <= 0 || fuu * fvv - fuv * fuv <= 0) {
+            fuu = huu;
+            fuv = huv;
+            fvv = hvv;
+        }
+        // a parameter on the border whose gradient points outward stays put
+        // and the other one moves alone
+        bool fixU = (u <= 0 && gu > 0) || (u >= 1 && gu < 0);
+        bool fixV = (v <= 0 && gv > 0) || (v >= 1 && gv < 0);
+        float tiny = 1e-12f * (huu + hvv) + 1e-30f;
+        float det = fuu * fvv - fuv * fuv;
+        float du = 0, dv = 0;
+        if (!fixU && !fixV && det > tiny * (huu + hvv)) {
+            du = -(fvv * gu - fuv * gv) / det;
+            dv = -(fuu * gv - fuv * gu) / det;
+        }
+        else {
+            if (!fixU && fuu > tiny) {
+                du = -gu / fuu;
+            }
+            if (!fixV && fvv > tiny) {
+                dv = -gv / fvv;
+            }
+        }
+        if (du == 0 && dv == 0) {
+            break;
+        }
+        // halve the step until it does not move away from q
+        bool improved = false;
+        for (int halving = 0; halving < 8 && !improved; halving++) {
+            float nu = min(max(u + du, 0.0f), 1.0f);
+            float nv = min(max(v + dv, 0.0f), 1.0f);
+            float nx[6], ny[6], nz[6];
+            monoderivatives(m.cx, nu, nv, nx);
+            monoderivatives(m.cy, nu, nv, ny);
+            monoderivatives(m.cz, nu, nv, nz);
+            float n2 = sqr3(nx[0] - q.x, ny[0] - q.y, nz[0] - q.z);
+            if (n2 <= d2) {
+                improved = fabs(nu - u) + fabs(nv - v) > 1e-7f;
+                u = nu;
+                v = nv;
+                d2 = n2;
+                copy(nx, nx + 6, x);
+                copy(ny, ny + 6, y);
+                copy(nz, nz + 6, z);
+                if (!improved) {
+                    break;
+                }
+            }
+            else {
+                du *= 0.5f;
+                dv *= 0.5f;
+            }
+        }
+        if (!improved) {
+            break;
+        }
+    }
+    point = Point(x[0], y[0], z[0]);
+    return d2;
+}
+
+// Refines from the nearest seed. Patches with collapsed edges have zero
+// derivatives along their border, where Newton can stall, so a result on the
+// border is retried from the centers of the cells around the seed.
+void SurfaceQuery::refine(int patch, const Point& q, ClosestPoint& best) const {
+    int w = QUERY_SEEDS + 1;
+    const float* seed = &seeds[3 * patch * w * w];
+    int nearest = 0;
+    float nearest2 = FLT_MAX;
+    for (int s = 0; s < w * w; s++) {
+        float dx = seed[3 * s] - q.x, dy = seed[3 * s + 1] - q.y, dz = seed[3 * s + 2] - q.z;
+        float d2 = dx * dx + dy * dy + dz * dz;
+        if (d2 < nearest2) {
+            nearest2 = d2;
+            nearest = s;
+        }
+    }
+    int su = nearest / w, sv = nearest % w;
+    float u = (float)su / QUERY_SEEDS;
+    float v = (float)sv / QUERY_SEEDS;
+    Point point;
+    float d2 = newtonclosest(mono[patch], q, u, v, point);
+    if (u <= 0 || u >= 1 || v <= 0 || v >= 1) {
+        for (int c = 0; c < 4; c++) {
+            float cu = su + ((c & 1) ? 0.5f : -0.5f);
+            float cv = sv + ((c & 2) ? 0.5f : -0.5f);
+            if (cu < 0 || cu > QUERY_SEEDS || cv < 0 || cv > QUERY_SEEDS) {
+                continue;
+            }
+            float ru = cu / QUERY_SEEDS, rv = cv / QUERY_SEEDS;
+            Point retry;
+            float r2 = newtonclosest(mono[patch], q, ru, rv, retry);
+            if (r2 < d2) {
+                d2 = r2;
+                u = ru;
+                v = rv;
+                point = retry;
+            }
+        }
+    }
+    float distance = sqrt(d2);
+    if (distance < best.distance) {
+        best.patch = patch;
+        best.u = u;
+        best.v = v;
+        best.point = point;
+        best.distance = distance;
+    }
+}
+
+ClosestPoint SurfaceQuery::closest(const Point& q) const {
+    ClosestPoint best;
+    best.patch = -1;
+    best.u = best.v = 0;
+    best.distance = FLT_MAX;
+    if (nodes.empty()) {
+        return best;
+    }
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node& node = nodes[stack[--top]];
+        if (boxdistance2(node.lo, node.hi, q) >= best.distance * best.distance) {
+            continue;
+        }
+        if (node.left < 0) {
+            for (int i = node.first; i < node.last; i++) {
+                int patch = order[i];
+                if (boxdistance2(&bounds[6 * patch], &bounds[6 * patch + 3], q) < best.distance * best.distance) {
+                    refine(patch, q, best);
+                }
+            }
+            continue;
+        }
+        // visit the nearer child first so the farther one is more likely pruned
+        float dl = boxdistance2(nodes[node.left].lo, nodes[node.left].hi, q);
+        float dr = boxdistance2(nodes[node.right].lo, nodes[node.right].hi, q);
+        if (dl < dr) {
+            stack[top++] = node.right;
+            stack[top++] = node.left;
+        }
+        else {
+            stack[top++] = node.left;
+            stack[top++] = node.right;
+        }
+    }
+    return best;
+}
+
+void closestpoints(const SurfaceQuery& query, const Point* queries, int count, ClosestPoint* results, int threads) {
+    threads = max(1, min(threads, count));
+    vector<thread> pool;
+    for (int t = 0; t < threads; t++) {
+        int first = (int)((long long)count * t / threads);
+        int last = (int)((long long)count * (t + 1) / threads);
+        pool.push_back(thread([=, &query]() {
+            for (int i = first; i < last; i++) {
+                results[i] = query.closest(queries[i]);
+            }
+        }));
+    }
+    for (int t = 0; t < threads; t++) {
+        pool[t].join();
+    }
+}
+
+//****************************************************
+// Surface sampling
+//****************************************************
+const float SAMPLER_ROUNDING = 1.001f;  // covers float rounding in the bound and in areaelement
+const int SAMPLER_MAX_TRIES = 1024;     // rejection rounds before a point is kept anyway, counted
+const int POISSON_AXIS_BITS = 21;       // grid cell coordinate bits per axis in a cell key
+
+// splitmix64: counter-based, so sample i can start its own stream
+static unsigned long long splitmix(unsigned long long& state) {
+    unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// uniform in [0, 1)
+static float unitrandom(unsigned long long& state) {
+    return (float)(splitmix(state) >> 40) / 16777216.0f;
+}
+
+// |Pu x Pv|, the area element of the patch at (u, v)
+static float areaelement(const MonomialPatch& patch, float u, float v) {
+    float p;
+    Vector du, dv;
+    hornereval(patch.cx, u, v, p, du.x, dv.x);
+    hornereval(patch.cy, u, v, p, du.y, dv.y);
+    hornereval(patch.cz, u, v, p, du.z, dv.z);
+    Vector n = cross(du, dv);
+    return sqrt(dot(n, n));
+}
+
+// Range of the u (alongU) or v derivative of one coordinate over the cell
+// (uc, vc) +- (hu, hv): the derivative is re-expanded around the cell center,
+// and every term but the constant one is bounded by its coefficient's size
+static void derivativerange(const float c[4][4], bool alongU, double uc, double vc, double hu, double hv,
+    double& low, double& high) {
+    static const double binomial[4][4] = { { 1 }, { 1, 1 }, { 1, 2, 1 }, { 1, 3, 3, 1 } };
+    double d[4][4] = { { 0 } };
+    for (int k = 0; k < 4; k++) {
+        for (int l = 0; l < 4; l++) {
+            if (alongU && l > 0) {
+                d[k][l - 1] = l * (double)c[k][l];
+            }
+            else if (!alongU && k > 0) {
+                d[k - 1][l] = k * (double)c[k][l];
+            }
+        }
+    }
+    double pu[4] = { 1, uc, uc * uc, uc * uc * uc }, pv[4] = { 1, vc, vc * vc, vc * vc * vc };
+    double ru[4] = { 1, hu, hu * hu, hu * hu * hu }, rv[4] = { 1, hv, hv * hv, hv * hv * hv };
+    double middle = 0, radius = 0;
+    for (int k = 0; k < 4; k++) {
+        for (int l = 0; l < 4; l++) {
+            double a = 0;
+            for (int K = k; K < 4; K++) {
+                for (int L = l; L < 4; L++) {
+                    a += d[K][L] * binomial[K][k] * binomial[L][l] * pv[K - k] * pu[L - l];
+                }
+            }
+            if (k == 0 && l == 0) {
+                middle = a;
+            }
+            else {
+                radius += fabs(a) * rv[k] * ru[l];
+            }
+        }
+    }
+    low = middle - radius;
+    high = middle + radius;
+}
+
+// Interval product and difference for the cross product bound
+static void intervalproduct(double a0, double a1, double b0, double b1, double& low, double& high) {
+    double p[4] = { a0 * b0, a0 * b1, a1 * b0, a1 * b1 };
+    low = *min_element(p, p + 4);
+    high = *max_element(p, p + 4);
+}
+
+static double crossbound(const double du[3][2], const double dv[3][2]) {
+    double sum = 0;
+    for (int a = 0; a < 3; a++) {
+        int b = (a + 1) % 3, c = (a + 2) % 3;
+        double l0, h0, l1, h1;
+        intervalproduct(du[b][0], du[b][1], dv[c][0], dv[c][1], l0, h0);
+        intervalproduct(du[c][0], du[c][1], dv[b][0], dv[b][1], l1, h1);
+        double largest = max(fabs(l0 - h1), fabs(h0 - l1));
+        sum += largest * largest;
+    }
+    return sqrt(sum);
+}
+
+SurfaceSampler::SurfaceSampler(const Surface* patches, int count, int threads) {
+    const int cells = SAMPLER_GRID * SAMPLER_GRID;
+    const int side = 2 * SAMPLER_GRID + 1;
+    mono.resize(count);
+    cellCdf.resize(count * cells);
+    cellBound.resize(count * cells);
+    vector<double> patchArea(count), patchEnvelope(count);
+    parallelindices(count, threads, [&](int p) {
+        mono[p] = MonomialPatch(patches[p]);
+        const float* coefficients[3] = { &mono[p].cx[0][0], &mono[p].cy[0][0], &mono[p].cz[0][0] };
+        // corners, edge midpoints and centers of the cells, for Simpson's rule
+        vector<float> j(side * side);
+        for (int a = 0; a < side; a++) {
+            for (int b = 0; b < side; b++) {
+                j[a * side + b] = areaelement(mono[p], (float)a / (side - 1), (float)b / (side - 1));
+            }
+        }
+        const float weights[3] = { 1, 4, 1 };
+        const double half = 0.5 / SAMPLER_GRID;
+        double total = 0, envelope = 0;
+        for (int cu = 0; cu < SAMPLER_GRID; cu++) {
+            for (int cv = 0; cv < SAMPLER_GRID; cv++) {
+                float sum = 0;
+                for (int a = 0; a < 3; a++) {
+                    for (int b = 0; b < 3; b++) {
+                        sum += weights[a] * weights[b] * j[(2 * cu + a) * side + 2 * cv + b];
+                    }
+                }
+                total += sum / 36 / cells;
+                double du[3][2], dv[3][2];
+                double uc = (cu + 0.5) / SAMPLER_GRID, vc = (cv + 0.5) / SAMPLER_GRID;
+                for (int axis = 0; axis < 3; axis++) {
+                    const float (*c)[4] = (const float (*)[4])coefficients[axis];
+                    derivativerange(c, true, uc, vc, half, half, du[axis][0], du[axis][1]);
+                    derivativerange(c, false, uc, vc, half, half, dv[axis][0], dv[axis][1]);
+                }
+                int cell = p * cells + cu * SAMPLER_GRID + cv;
+                cellBound[cell] = (float)(crossbound(du, dv) * SAMPLER_ROUNDING);
+                envelope += (double)cellBound[cell] / cells;
+                cellCdf[cell] = (float)envelope;
+            }
+        }
+        for (int c = 0; c < cells; c++) {
+            cellCdf[p * cells + c] = envelope > 0 ? (float)(cellCdf[p * cells + c] / envelope) : (float)(c + 1) / cells;
+        }
+        patchArea[p] = total;
+        patchEnvelope[p] = envelope;
+    });
+    patchCdf.resize(count);
+    area = 0;
+    envelope = 0;
+    for (int p = 0; p < count; p++) {
+        area += patchArea[p];
+        envelope += patchEnvelope[p];
+        patchCdf[p] = envelope;
+    }
+}
+
+bool SurfaceSampler::sample(unsigned long long seed, long long index, SurfaceSample& out) const {
+    const int cells = SAMPLER_GRID * SAMPLER_GRID;
+    unsigned long long state = seed * 0xD1B54A32D192ED03ULL ^ (unsigned long long)index;
+    splitmix(state);
+    int p, cell;
+    float u, v;
+    bool accepted = false;
+    for (int attempt = 0; attempt < SAMPLER_MAX_TRIES && !accepted; attempt++) {
+        double target = (double)(splitmix(state) >> 11) / 9007199254740992.0 * envelope;
+        p = min((int)(upper_bound(patchCdf.begin(), patchCdf.end(), target) - patchCdf.begin()), (int)mono.size() - 1);
+        const float* cdf = &cellCdf[p * cells];
+        cell = min((int)(upper_bound(cdf, cdf + cells, unitrandom(state)) - cdf), cells - 1);
+        u = (cell / SAMPLER_GRID + unitrandom(state)) / SAMPLER_GRID;
+        v = (cell % SAMPLER_GRID + unitrandom(state)) / SAMPLER_GRID;
+        accepted = unitrandom(state) * cellBound[p * cells + cell] <= areaelement(mono[p], u, v);
+    }
+    Point q = monopatchinterp(mono[p], u, v);
+    Vertex vertex = { q.x, q.y, q.z, q.normal1.x, q.normal1.y, q.normal1.z, u, v };
+    out.patch = p;
+    out.vertex = vertex;
+    return accepted;
+}
+
+long long SurfaceSampler::uniformsamples(unsigned long long seed, long long count, int threads,
+    vector<SurfaceSample>& out) const {
+    out.resize(mono.empty() || area <= 0 ? 0 : count);
+    int spans = max(1, threads) * 16;
+    long long n = out.size();
+    vector<long long> forced(spans);
+    parallelindices(spans, threads, [&](int s) {
+        long long first = n * s / spans, last = n * (s + 1) / spans;
+        for (long long i = first; i < last; i++) {
+            if (!sample(seed, i, out[i])) {
+                forced[s]++;
+            }
+        }
+    });
+    long long total = 0;
+    for (int s = 0; s < spans; s++) {
+        total += forced[s];
+    }
+    return total;
+}
+
+long long SurfaceSampler::poissonsamples(unsigned long long seed, float radius, long long candidates, int threads,
+    vector<SurfaceSample>& out) const {
+    vector<SurfaceSample> pool;
+    long long forced = uniformsamples(seed, candidates, threads, pool);
+    out.clear();
+    if (pool.empty() || !(radius > 0)) {
+        out.swap(pool);
+        return forced;
+    }
+
+    // cell keys, POISSON_AXIS_BITS per axis around the grid origin
+    const long long bias = 1LL << (POISSON_AXIS_BITS - 1), mask = (1LL << POISSON_AXIS_BITS) - 1;
+    int n = pool.size();
+    vector<long long> keys(n);
+    vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+        const Vertex& v = pool[i].vertex;
+        long long c[3] = { (long long)floor(v.x / radius), (long long)floor(v.y / radius), (long long)floor(v.z / radius) };
+        keys[i] = 0;
+        for (int a = 0; a < 3; a++) {
+            keys[i] = (keys[i] << POISSON_AXIS_BITS) | ((c[a] + bias) & mask);
+        }
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) {
+        return keys[a] != keys[b] ? keys[a] < keys[b] : a < b;
+    });
+
+    // runs of equal keys are the occupied cells; their neighbours are found once
+    vector<int> cellStart;
+    unordered_map<long long, int> cellOf;
+    for (int k = 0; k < n; k++) {
+        if (k == 0 || keys[order[k]] != keys[order[k - 1]]) {
+            cellOf[keys[order[k]]] = cellStart.size();
+            cellStart.push_back(k);
+        }
+    }
+    int cells = cellStart.size();
+    cellStart.push_back(n);
+    vector<int> neighbors(cells * 27);
+    vector<vector<int> > phases(27);
+    for (int c = 0; c < cells; c++) {
+        long long key = keys[order[cellStart[c]]];
+        long long axis[3] = { (key >> (2 * POISSON_AXIS_BITS)) & mask, (key >> POISSON_AXIS_BITS) & mask, key & mask };
+        phases[(axis[0] % 3) * 9 + (axis[1] % 3) * 3 + axis[2] % 3].push_back(c);
+        int k = 0;
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dz = -1; dz <= 1; dz++) {
+                    long long neighbor = (((axis[0] + dx) & mask) << (2 * POISSON_AXIS_BITS))
+                        | (((axis[1] + dy) & mask) << POISSON_AXIS_BITS) | ((axis[2] + dz) & mask);
+                    unordered_map<long long, int>::const_iterator found = cellOf.find(neighbor);
+                    neighbors[c * 27 + k++] = found == cellOf.end() ? -1 : found->second;
+                }
+            }
+        }
+    }
+
+    // a cell only reads the kept points of its neighbours and writes its own,
+    // and cells of one phase are never neighbours
+    vector<vector<int> > kept(cells);
+    float radius2 = radius * radius;
+    for (int phase = 0; phase < 27; phase++) {
+        const vector<int>& list = phases[phase];
+        parallelindices(list.size(), threads, [&](int l) {
+            int c = list[l];
+            for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                const Vertex& a = pool[order[k]].vertex;
+                bool isolated = true;
+                for (int m = 0; m < 27 && isolated; m++) {
+                    int other = neighbors[c * 27 + m];
+                    if (other < 0) {
+                        continue;
+                    }
+                    for (int q = 0; q < (int)kept[other].size(); q++) {
+                        const Vertex& b = pool[kept[other][q]].vertex;
+                        float dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+                        if (dx * dx + dy * dy + dz * dz < radius2) {
+                            isolated = false;
+                            break;
+                        }
+                    }
+                }
+                if (isolated) {
+                    kept[c].push_back(order[k]);
+                }
+            }
+        });
+    }
+
+    vector<int> all;
+    for (int c = 0; c < cells; c++) {
+        all.insert(all.end(), kept[c].begin(), kept[c].end());
+    }
+    sort(all.begin(), all.end());
+    out.resize(all.size());
+    for (int i = 0; i < (int)all.size(); i++) {
+        out[i] = pool[all[i]];
+    }
+    return forced;
+}
@@ -0,0 +1,520 @@
+#ifndef BEZIERLIB_H
+#define BEZIERLIB_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+
+// Bezier patch parsing, evaluation and tessellation, independent of GLUT.
+// Nothing here touches global state: every call works on its arguments or
+// on a BezierContext owned by the caller, so threads holding different
+// contexts can tessellate different scenes at the same time without locks.
+
+using namespace std;
+
+class Point;
+
+class Vector {
+public:
+    float x, y, z;
+    Vector();
+    Vector(float a, float b, float c);
+    Vector(Point a, Point b);
+    void normalize();
+    Vector scalarMult(float s);
+
+
+    /*Vector add(Vector);
+    Vector sub(Vector);
+    Vector mul(float);
+    Vector div(float);
+    Vector normalize();*/
+};
+
+class Point {
+public:
+    float x, y, z;
+    Vector derivative, normal1, normal2;
+    Point();
+    Point(float a, float b, float c);
+    Point scalarMult(float s) const;
+    Point add(Point p) const;
+    Point midpoint(Point p) const;
+    float distance(Point p) const;
+    //Point sub(Vector);
+};
+
+class Curve {
+public:
+    Point a, b, c, d;
+    Curve();
+    Curve(Point a1, Point b1, Point c1, Point d1);
+};
+
+class Surface {
+public:
+    Curve a, b, c, d;
+    //vector<vector<Point>> points;
+    Surface();
+    Surface(Curve a1, Curve b1, Curve c1, Curve d1);
+};
+
+// Tolerance of the shape tests below, relative to the diagonal of the
+// control net's bounding box
+const float PATCH_SHAPE_TOLERANCE = 1e-4f;
+
+// Power-basis form of a bicubic patch: P(u,v) = sum c[i][j] * v^i * u^j.
+// Built once at load so arbitrary (u,v) can be evaluated with Horner's rule.
+class MonomialPatch {
+public:
+    float cx[4][4], cy[4][4], cz[4][4];
+    // degrees left after dropping leading terms within the shape tolerance;
+    // lower degrees are evaluated with a shorter Horner scheme
+    int degreeU, degreeV;
+    MonomialPatch();
+    MonomialPatch(Surface patch);
+};
+
+// Sub-patch control net from de Casteljau splitting, p[k][j] with j along u
+// and k along v. (iu, iv) is the quadtree cell of the sub-patch at `level`.
+class SubPatch {
+public:
+    Point p[4][4];
+    int level, iu, iv;
+    SubPatch();
+    SubPatch(Surface patch);
+};
+
+class Triangle {
+public:
+    Point a, b, c;
+    float au, av, bu, bv, cu, cv;
+    Triangle();
+    Triangle(Point a1, Point b1, Point c1);
+    
+};
+
+// Flattened tessellation output: interleaved vertices plus triangle indices
+class Vertex {
+public:
+    float x, y, z;
+    float nx, ny, nz;
+    float u, v;
+};
+
+class Mesh {
+public:
+    vector<Vertex> vertices;
+    vector<unsigned int> indices;
+    vector<unsigned int> patchStarts; // first index of each patch, empty once reordered
+    bool strip; // indices form one triangle strip joined by degenerate triangles
+    Mesh() : strip(false) {}
+};
+
+// Per-caller tessellation settings and scratch space
+class BezierContext {
+public:
+    int divisions;  // uniform grid resolution per patch
+    float epsilon;  // adaptive tolerance, 0 selects the uniform grid
+    bool fixedKernels;  // patchgrid takes gridkernel's specialized sizes, on by default
+    vector<float> basis, dbasis;  // Bernstein tables for `divisions`
+    vector<Triangle> scratch;
+    long long requests, evaluations; // midpoints needed and evaluated by tessellatebreadthfirst
+    // breadth-first level state, kept to reuse the allocations
+    vector<Triangle> level, nextLevel;
+    vector<int> owners, nextOwners, midpoints;
+    vector<int> sampleOwners;
+    vector<float> sampleU, sampleV;
+    vector<Point> samples;
+    vector<MonomialPatch> monomials; // power basis of the patches when the caller has none
+    vector<int> gridStamp, gridSample; // midpoint lookup for the current patch
+    vector<Vertex> gridVertices;
+    BezierContext(int divisions, float epsilon = 0);
+};
+
+double currentTime();
+float dot(Vector a, Vector b);
+Vector cross(Vector a, Vector b);
+
+// Reads a .bez file (text or binary) and appends its patches; false if it
+// cannot be opened
+bool loadpatches(const char* filename, vector<Surface>& patches);
+
+// Streams patches to a text .bez file, or to the binary form when the name
+// ends in .bezb, without holding the scene in memory
+class PatchWriter {
+public:
+    PatchWriter();
+    ~PatchWriter();
+    bool open(const char* filename, unsigned int count);
+    void write(const Surface& patch);
+    bool close();
+private:
+    FILE* file;
+    bool binary;
+};
+
+// Streams patches back from a text or binary .bez file, one at a time
+class PatchReader {
+public:
+    bool open(const char* filename);
+    bool read(Surface& patch);  // false at the end of the file
+private:
+    ifstream fin;
+    bool binary;
+    unsigned int remaining;  // binary only
+};
+
+// Chunked scenes (.bezc) for data sets that do not fit in memory: patches
+// are grouped by a uniform grid over their centers, and a small index of
+// chunk bounds comes first, so a viewer can read only the chunks it needs
+class SceneChunk {
+public:
+    Point low, high;  // bounds of the control points, which contain the surface
+    unsigned int count;
+    long long offset;  // file position of the first patch (48 floats each)
+};
+
+// Converts any scene loadpatches reads; three streaming passes over the
+// input, so only the grid cells and small write buffers are kept in memory
+bool chunkpatches(const char* input, const char* output, int chunkPatches);
+
+class ChunkedScene {
+public:
+    vector<SceneChunk> chunks;
+    long long patchCount;
+    bool open(const char* filename);
+    // Opens its own stream, so several threads can read chunks at once
+    bool readchunk(int index, vector<Surface>& out) const;
+private:
+    string path;
+};
+
+// Scene assembly: many part files, each placed by its own transform, loaded
+// concurrently into one patch list
+class ScenePart {
+public:
+    string path;
+    bool transformed;
+    float transform[3][4];  // rows of a 3x4 matrix, point = transform * [p 1]
+    ScenePart(const string& path);
+};
+
+// Manifest: one part per line, "<file> [scale s] [rotate degrees x y z]
+// [translate x y z]" applied in that order, # starts a comment and relative
+// paths are relative to the manifest. False if it cannot be opened or a line
+// is malformed (line is set to its number, 1-based).
+bool loadmanifest(const char* filename, vector<ScenePart>& parts, int& line);
+
+// Loads parts on `threads` threads into one list, in part order, appending
+// to patches. counts and seconds get each part's patch count (-1 if it could
+// not be opened) and load time; false if any part failed.
+bool loadparts(const vector<ScenePart>& parts, vector<Surface>& patches, vector<int>& counts,
+    vector<double>& seconds, int threads);
+
+Point bezcurveinterp(Curve curve, float u);
+Point bezpatchinterp(const Surface& patch, float u, float v);
+Point monopatchinterp(const MonomialPatch& patch, float u, float v);
+Point patchinterp(const Surface& patch, const MonomialPatch* mono, float u, float v);
+// monopatchinterp of count (us[s], vs[s]) pairs of one patch at once
+const int EVAL_BLOCK = 64;
+void monopatchbatch(const MonomialPatch& patch, const float* us, const float* vs, int count, Point* out);
+Triangle maketriangle(Point a, float au, float av, Point b, float bu, float bv, Point c, float cu, float cv);
+
+// Shape of a patch's control net, found once at load. A flat patch (planar,
+// straight edges, every control point inside the corner quad) covers exactly
+// that quad, so two triangles tessellate it with no error. Bilinear patches
+// have degree 1 in both directions; degreeU or degreeV below 3 mean the
+// patch is exactly of lower degree in that direction.
+class PatchShape {
+public:
+    bool planar, flat;
+    int degreeU, degreeV;
+    Vector normal;  // unit plane normal along du x dv when planar
+};
+
+PatchShape classifypatch(const Surface& patch);
+// The two triangles of a flat patch, split like the uniform grids
+void flattriangles(const Surface& patch, const PatchShape& shape, Triangle out[2]);
+
+// Triangles deeper than this are emitted without testing their edges
+const int ADAPTIVE_MAX_DEPTH = 5;
+
+// Adaptive triangulation of one patch; the recursive form refines a single
+// triangle, adaptivepatch starts from the two halves of the (u, v) square
+void subdividepatchadaptive(Surface patch, float epsilon, Triangle t, float depth, vector<Triangle>& out,
+    const MonomialPatch* mono = NULL);
+// Flat patches (shape given and flat) are emitted as their two triangles
+void adaptivepatch(const Surface& patch, float epsilon, vector<Triangle>& out, const MonomialPatch* mono = NULL,
+    const PatchShape* shape = NULL);
+void adaptiveroots(const Surface& patch, Triangle roots[2]);
+void adaptivemidpoints(const Triangle& t, float u[3], float v[3]);
+int splitadaptive(const Triangle& t, const Point mid[3], float epsilon, Triangle children[4]);
+
+// Pull-based adaptive triangulation of patches[0, count): next() fills up to
+// maxCount triangles in the order subdividepatchadaptive emits them and
+// returns 0 once done. Only the pending subdivision stack is kept, so memory
+// follows the recursion depth instead of the output size.
+class AdaptiveTriangles {
+public:
+    int peakPending; // largest stack seen, for reports
+    AdaptiveTriangles(const Surface* patches, int count, float epsilon, const MonomialPatch* mono = NULL,
+        const PatchShape* shapes = NULL);
+    int next(Triangle* out, int maxCount);
+private:
+    struct Pending {
+        Triangle t;
+        float depth;
+    };
+    const Surface* patches;
+    const MonomialPatch* mono;
+    const PatchShape* shapes;
+    int count, patch;
+    float epsilon;
+    vector<Pending> stack;
+};
+
+// Uniform grid of (n + 1)^2 vertices, v fastest, from Bernstein tables built
+// by bernsteintables. The sizes in hasfixedkernel use compile-time sized
+// static tables instead, and b and db may be NULL for them.
+void bernsteintables(int n, vector<float>& b, vector<float>& db);
+void gridkernel(const Surface& patch, int n, const float* b, const float* db, Vertex* out);
+// The runtime-sized instance of the same kernel for any n, to measure what
+// the fixed sizes gain
+void gridkernelgeneric(const Surface& patch, int n, const float* b, const float* db, Vertex* out);
+
+// Curvature-spaced grids keep the rows x columns topology but place the
+// isoparameters so each direction equidistributes sqrt(|second derivative|):
+// a segment of parameter length h misses the surface by about h^2 |P''| / 8.
+// us and vs get rows + 1 and columns + 1 values from 0 to 1.
+void curvaturespacing(const MonomialPatch& patch, int rows, int columns, vector<float>& us, vector<float>& vs);
+// Parameters of every point of a rows x columns grid, point iu * (columns + 1) + iv
+// at (us, vs). Boundary rows and columns are spaced along their own boundary
+// curve only, so two patches sharing a boundary place the same vertices on
+// it, and the spacing fades into curvaturespacing's towards the interior.
+void curvaturegrid(const Surface& patch, const MonomialPatch& mono, int rows, int columns, vector<float>& us,
+    vector<float>& vs);
+// Rows and columns that estimate keeps within maxError, at least 1 each
+void curvaturedivisions(const MonomialPatch& patch, float maxError, int& rows, int& columns);
+
+// Unindexed triangles to mesh vertices, three per triangle
+void appendtriangles(Mesh& mesh, const vector<Triangle>& tris);
+
+// Output sizes of tessellategrids for `count` patches, 64 bit so callers can check them before allocating
+long long gridvertexcount(const BezierContext& ctx, int count);
+long long gridindexcount(const BezierContext& ctx, int count);
+
+// Uniform grids of patches[0, count) written into caller buffers sized with
+// the functions above; indices start at baseVertex
+void tessellategrids(BezierContext& ctx, const Surface* patches, int count, Vertex* vertices,
+    unsigned int* indices, unsigned int baseVertex = 0);
+
+// Adaptive output size depends on the surface, so triangles are appended to mesh
+void tessellateadaptive(BezierContext& ctx, const Surface* patches, int count, Mesh& mesh,
+    const MonomialPatch* mono = NULL);
+
+// Same triangles as tessellateadaptive (in a different order), produced one
+// level at a time across all patches: the edge midpoints of a level are
+// collected, shared ones merged, and evaluated in one monopatchbatch per
+// patch. Without mono the patches are converted to the power basis first, so
+// points agree with de Casteljau's to rounding (about 1e-6 of the patch size).
+void tessellatebreadthfirst(BezierContext& ctx, const Surface* patches, int count, vector<Triangle>& out,
+    const MonomialPatch* mono = NULL, const PatchShape* shapes = NULL);
+
+//****************************************************
+// Control-net flatness and budget tessellation
+//****************************************************
+
+const int FLAT_MAX_DEPTH = 8; // guards degenerate nets, not a quality knob
+
+// Splits each control net until it is within ctx.epsilon of the two
+// triangles drawing it, or FLAT_MAX_DEPTH, and appends the leaves to out
+void tessellateflat(BezierContext& ctx, const Surface* patches, int count, vector<Triangle>& out);
+
+// Splits the worst sub-patch of all patches first, until every one is within
+// ctx.epsilon or about maxTriangles are used. Appends the triangles to out
+// and returns the remaining worst error, depth-capped sub-patches included.
+// firsts, when given, gets count + 1 offsets into out: patch i's triangles
+// are [firsts[i], firsts[i + 1]).
+float tessellatebudget(BezierContext& ctx, const Surface* patches, int count, int maxTriangles,
+    vector<Triangle>& out, vector<int>* firsts = NULL);
+
+//****************************************************
+// Per-patch grids
+//****************************************************
+
+// rows x columns grid cells of one patch; points[i] sits at (us[i], vs[i])
+class PatchGrid {
+public:
+    int rows, columns;
+    vector<float> us, vs;
+    vector<Point> points;
+    PatchGrid() : rows(0), columns(0) {}
+    int index(int iu, int iv) const { return iu * (columns + 1) + iv; }
+    const Point& at(int iu, int iv) const { return points[index(iu, iv)]; }
+};
+
+// Sizes gridkernel has compile-time instances for
+bool hasfixedkernel(int n);
+// Uniform or curvature spaced (spaced, see curvaturegrid) grid of one patch.
+// Flat patches (shape given and flat) become a 1 x 1 grid of their corners.
+void patchgrid(BezierContext& ctx, const Surface& patch, int rows, int columns, bool spaced, PatchGrid& out,
+    const MonomialPatch* mono = NULL, const PatchShape* shape = NULL);
+// Two triangles per cell carrying their (u, v), split like tessellategrids
+void gridtriangles(const PatchGrid& grid, vector<Triangle>& out);
+
+//****************************************************
+// Tessellation accuracy
+//****************************************************
+
+const int DEVIATION_SAMPLES = 6; // barycentric subdivisions per triangle edge
+const int MAX_DIVISIONS = 256;   // finest grid the step selection tries
+
+class Deviation {
+public:
+    float maxError;
+    double sumError;
+    int samples;
+    Deviation() : maxError(0), sumError(0), samples(0) {}
+};
+
+// Distance between each triangle and the surface at the same (u, v), sampled
+// on a barycentric grid. Only reads its arguments, so patches can run in parallel.
+void accumulatedeviation(const MonomialPatch& patch, const Triangle* tris, int count, Deviation& d);
+// A flat patch's two triangles cover the patch with a different (u, v)
+// mapping, so they are measured against its plane through origin instead
+void accumulateplanedeviation(const PatchShape& shape, const Point& origin, const Triangle* tris, int count,
+    Deviation& d);
+// Max deviation of the patch as a rows x columns grid, uniform or curvature spaced
+float griddeviation(const Surface& patch, const MonomialPatch& mono, int rows, int columns, bool spaced);
+// Coarsest uniform n x n grid within maxError
+int uniformdivisions(const Surface& patch, const MonomialPatch& mono, float maxError);
+// Curvature-spaced rows x columns within maxError
+void spaceddivisions(const Surface& patch, const MonomialPatch& mono, float maxError, int& rows, int& columns);
+
+//****************************************************
+// LOD chains
+//****************************************************
+
+// Per-patch pyramid of uniform grids, 2, 4, ... finest divisions. Only each
+// patch's finest grid is stored: level l uses every finest / (2 << l)-th row
+// and column of it, and a vertex that level l adds morphs from the midpoint
+// of the two coarser-level vertices whose edge (or quad diagonal) it splits.
+// Index buffers are shared by all patches. Edges are numbered v = 0, v = 1,
+// u = 0, u = 1; an edge drawn at a coarser level than its patch (the level
+// of a coarser neighbour) has its extra vertices moved onto that level's
+// segments, so the two sides meet without cracks.
+class LodChain {
+public:
+    int finest, levels;
+    vector<Vertex> vertices;  // (finest + 1)^2 per patch, laid out like tessellategrids
+    vector<vector<unsigned int> > strided;  // per level: triangles over one patch's finest grid
+    vector<vector<unsigned int> > compact;  // per level: the same triangles over a packed grid
+    vector<vector<unsigned int> > members;  // per level: finest-grid vertex of each packed vertex
+    vector<vector<unsigned int> > sources;  // per level: two finest-grid vertices per packed vertex
+    vector<signed char> introduced;  // per finest-grid vertex: level that adds it, -1 for the corners
+    vector<int> neighbours;  // per patch edge (4 per patch): 4 * patch + edge across it, -1 if none
+
+    LodChain();
+    void build(const Surface* patches, int count, int finestDivisions);
+    int divisions(int level) const;
+    int patchvertices() const;
+    // Packed vertices of `level` with the ones it introduces moved
+    // (1 - t) of the way back to where the coarser level has them. Edges
+    // given in edgeLevels and edgeTs are drawn as that level and factor.
+    void morph(int patch, int level, float t, Vertex* out, const int* edgeLevels = NULL,
+        const float* edgeTs = NULL) const;
+private:
+    void findneighbours(const Surface* patches, int count);
+    int edgeindex(int edge, int j) const;
+    Vertex edgepoint(const Vertex* grid, int edge, int j, int level, float t) const;
+    Vertex edgevertex(const Vertex* grid, int edge, int j, int level, float t) const;
+};
+
+//****************************************************
+// Closest-point queries
+//****************************************************
+
+// Nearest surface point for one query
+class ClosestPoint {
+public:
+    int patch;
+    float u, v;
+    Point point;
+    float distance;
+};
+
+// Closest-point engine over a patch set: a BVH over the control-hull bounds
+// of the patches, a coarse grid of seeds per patch and Newton refinement of
+// (u, v). Built once; closest() only reads, so any number of threads can query
+// one engine at the same time.
+class SurfaceQuery {
+public:
+    SurfaceQuery(const Surface* patches, int count);
+    ClosestPoint closest(const Point& q) const;
+private:
+    struct Node {
+        float lo[3], hi[3];
+        int left, right;   // children, -1 for a leaf
+        int first, last;   // leaf patches are order[first, last)
+    };
+    vector<MonomialPatch> mono;
+    vector<float> bounds;  // lo xyz, hi xyz per patch
+    vector<float> seeds;   // xyz of the (QUERY_SEEDS + 1)^2 grid per patch
+    vector<int> order;
+    vector<Node> nodes;
+    int build(int first, int last);
+    void refine(int patch, const Point& q, ClosestPoint& best) const;
+};
+
+// results[i] is the nearest point to queries[i]; the batch is split over `threads`
+void closestpoints(const SurfaceQuery& query, const Point* queries, int count, ClosestPoint* results, int threads);
+
+//****************************************************
+// Surface sampling
+//****************************************************
+
+const int SAMPLER_GRID = 8;  // area cells per patch along u and v
+
+class SurfaceSample {
+public:
+    int patch;
+    Vertex vertex;  // position, unit normal and (u, v) on the patch
+};
+
+// Area-uniform point sampling of a patch set. Each cell of a SAMPLER_GRID^2
+// grid per patch gets a conservative bound on |Pu x Pv|: the derivatives are
+// expanded around the cell center and bounded term by term, then combined
+// with interval arithmetic. A sample picks a patch and a cell in proportion
+// to bound times cell size, a (u, v) in the cell, and keeps it with
+// probability |Pu x Pv| / bound, otherwise it starts over. Since the bound
+// holds everywhere, the kept points are exactly uniform in area. Sample i
+// only depends on the seed and i, so the output is the same for any number
+// of threads.
+class SurfaceSampler {
+public:
+    double area;      // Simpson's rule estimate of the surface area
+    double envelope;  // integral of the bounds; area / envelope is the acceptance rate
+    SurfaceSampler(const Surface* patches, int count, int threads);
+    // False if the point was kept after SAMPLER_MAX_TRIES rejections, which
+    // only happens on cells whose bound is far above their area
+    bool sample(unsigned long long seed, long long index, SurfaceSample& out) const;
+    // Samples [0, count) of the sequence for seed; returns the forced accepts
+    long long uniformsamples(unsigned long long seed, long long count, int threads, vector<SurfaceSample>& out) const;
+    // Poisson-disk samples: `candidates` uniform samples thinned so that no
+    // two kept points are closer than radius. Candidates are bucketed in a
+    // grid of radius-sized cells, and cells are processed in 27 phases of
+    // cells three apart, which never conflict, so phases run in parallel and
+    // the result is still independent of the thread count. Returns the
+    // forced accepts among the candidates.
+    long long poissonsamples(unsigned long long seed, float radius, long long candidates, int threads,
+        vector<SurfaceSample>& out) const;
+private:
+    vector<MonomialPatch> mono;
+    vector<double> patchCdf;  // envelope up to and including each patch
+    vector<float> cellCdf;    // per patch, cumulative share of each cell's envelope
+    vector<float> cellBound;  // per cell, bound on |Pu x Pv|
+};
+
+#endif
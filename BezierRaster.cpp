@@ -0,0 +1,439 @@
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include "BezierRaster.h"
+
+//****************************************************
+// Frame setup and thread pool
+//****************************************************
+
+const int PASS_TRANSFORM = 0;
+const int PASS_BIN = 1;
+const int PASS_SHADE = 2;
+
+const float RASTER_PI = 3.14159265f;
+const float SUBPIXEL = 256;  // vertices snap to 1/256 pixel so shared edges give exact ties
+
+// GL_LIGHT0 and the material set up in initScene and myDisplay
+const float LIGHT_DIRECTION[3] = { 1.0f, -1.0f, -0.5f };
+const float AMBIENT = 0.2f + 0.2f;  // light model ambient plus the light's own
+const float MATERIAL[3] = { 0.0f, 0.8f, 0.8f };
+
+RenderView::RenderView(int width, int height) {
+    this->width = width;
+    this->height = height;
+    xTranslate = 0;
+    yTranslate = 0;
+    xRotate = 0;
+    yRotate = 0;
+    zoom = 1;
+    flat = true;
+    filled = true;
+}
+
+// myDisplay: translate, rotate about x, rotate about y, scale
+void viewmatrix(const RenderView& view, float matrix[3][4]) {
+    float a = view.xRotate * RASTER_PI / 180, b = view.yRotate * RASTER_PI / 180;
+    float ca = cos(a), sa = sin(a), cb = cos(b), sb = sin(b);
+    float rotation[3][3] = { { cb, 0, sb }, { sa * sb, ca, -sa * cb }, { -ca * sb, sa, ca * cb } };
+    float translation[3] = { view.xTranslate, view.yTranslate, 0 };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            matrix[i][j] = rotation[i][j] * view.zoom;
+        }
+        matrix[i][3] = translation[i];
+    }
+}
+
+Rasterizer::Rasterizer(int threads) {
+    threadCount = threads > 0 ? threads : max(1, (int)thread::hardware_concurrency());
+    tileCount = 0;
+    binnedTriangles = 0;
+    pass = PASS_TRANSFORM;
+    generation = 0;
+    finished = 0;
+    stopping = false;
+    bins.resize(threadCount);
+    for (int t = 0; t < threadCount; t++) {
+        workers.push_back(thread([this, t]() { work(t); }));
+    }
+}
+
+Rasterizer::~Rasterizer() {
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (int t = 0; t < (int)workers.size(); t++) {
+        workers[t].join();
+    }
+}
+
+void Rasterizer::work(int worker) {
+    int seen = 0;
+    while (true) {
+        int current;
+        {
+            unique_lock<mutex> guard(lock);
+            while (generation == seen && !stopping) {
+                wake.wait(guard);
+            }
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            current = pass;
+        }
+        if (current == PASS_TRANSFORM) {
+            transformvertices(worker);
+        }
+        else if (current == PASS_BIN) {
+            bintriangles(worker);
+        }
+        else {
+            for (int tile = nextTile++; tile < tileCount; tile = nextTile++) {
+                shadetile(tile);
+            }
+        }
+        unique_lock<mutex> guard(lock);
+        if (++finished == threadCount) {
+            done.notify_one();
+        }
+    }
+}
+
+// Runs one pass on every worker and waits for all of them
+void Rasterizer::runpass(int step) {
+    unique_lock<mutex> guard(lock);
+    pass = step;
+    finished = 0;
+    nextTile = 0;
+    generation++;
+    wake.notify_all();
+    while (finished < threadCount) {
+        done.wait(guard);
+    }
+}
+
+void Rasterizer::render(const Vertex* vertices, int vertexCount, const unsigned int* indices, int indexCount,
+    const RenderView& view, Framebuffer& out) {
+    this->vertices = vertices;
+    this->vertexCount = vertexCount;
+    this->indices = indices;
+    triangleCount = indexCount / 3;
+    this->view = &view;
+    target = &out;
+
+    viewmatrix(view, matrix);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            // inverse transpose; GL_NORMALIZE is off, so like GL the normals keep the 1 / zoom length
+            normalMatrix[i][j] = matrix[i][j] / (view.zoom * view.zoom);
+        }
+    }
+
+    out.width = view.width;
+    out.height = view.height;
+    out.color.resize(3 * view.width * view.height);
+    out.depth.resize(view.width * view.height);
+    tilesX = (view.width + RASTER_TILE - 1) / RASTER_TILE;
+    tilesY = (view.height + RASTER_TILE - 1) / RASTER_TILE;
+    tileCount = tilesX * tilesY;
+    screen.resize(vertexCount);
+    for (int t = 0; t < threadCount; t++) {
+        bins[t].resize(tileCount);
+        for (int i = 0; i < tileCount; i++) {
+            bins[t][i].clear();
+        }
+    }
+
+    runpass(PASS_TRANSFORM);
+    runpass(PASS_BIN);
+    runpass(PASS_SHADE);
+
+    binnedTriangles = 0;
+    for (int t = 0; t < threadCount; t++) {
+        for (int i = 0; i < tileCount; i++) {
+            binnedTriangles += bins[t][i].size();
+        }
+    }
+}
+
+//****************************************************
+// Vertex transform, lighting and binning
+//****************************************************
+
+void Rasterizer::transformvertices(int worker) {
+    int first = (int)((long long)vertexCount * worker / threadCount);
+    int last = (int)((long long)vertexCount * (worker + 1) / threadCount);
+    float length = sqrt(LIGHT_DIRECTION[0] * LIGHT_DIRECTION[0] + LIGHT_DIRECTION[1] * LIGHT_DIRECTION[1] +
+        LIGHT_DIRECTION[2] * LIGHT_DIRECTION[2]);
+    float light[3] = { LIGHT_DIRECTION[0] / length, LIGHT_DIRECTION[1] / length, LIGHT_DIRECTION[2] / length };
+    float halfWidth = view->width * 0.5f, halfHeight = view->height * 0.5f;
+    for (int i = first; i < last; i++) {
+        const Vertex& v = vertices[i];
+        float eye[3], normal[3];
+        for (int k = 0; k < 3; k++) {
+            eye[k] = matrix[k][0] * v.x + matrix[k][1] * v.y + matrix[k][2] * v.z + matrix[k][3];
+            normal[k] = normalMatrix[k][0] * v.nx + normalMatrix[k][1] * v.ny + normalMatrix[k][2] * v.nz;
+        }
+        // glOrtho(-3, 3, -3, 3, 3, -3) maps eye x, y and z to NDC by dividing by 3
+        ScreenVertex& s = screen[i];
+        s.x = floor((eye[0] / 3 + 1) * halfWidth * SUBPIXEL + 0.5f) / SUBPIXEL;
+        s.y = floor((1 - eye[1] / 3) * halfHeight * SUBPIXEL + 0.5f) / SUBPIXEL;
+        s.z = (eye[2] / 3 + 1) * 0.5f;
+        float diffuse = max(0.0f, normal[0] * light[0] + normal[1] * light[1] + normal[2] * light[2]);
+        s.r = min(1.0f, MATERIAL[0] * (AMBIENT + diffuse));
+        s.g = min(1.0f, MATERIAL[1] * (AMBIENT + diffuse));
+        s.b = min(1.0f, MATERIAL[2] * (AMBIENT + diffuse));
+    }
+}
+
+// Each worker bins a contiguous range of triangles, so walking the workers'
+// bins in order keeps submission order within every tile
+void Rasterizer::bintriangles(int worker) {
+    int first = (int)((long long)triangleCount * worker / threadCount);
+    int last = (int)((long long)triangleCount * (worker + 1) / threadCount);
+    vector<vector<int> >& out = bins[worker];
+    for (int t = first; t < last; t++) {
+        const ScreenVertex& a = screen[indices[3 * t]];
+        const ScreenVertex& b = screen[indices[3 * t + 1]];
+        const ScreenVertex& c = screen[indices[3 * t + 2]];
+        if ((a.z < 0 && b.z < 0 && c.z < 0) || (a.z > 1 && b.z > 1 && c.z > 1)) {
+            continue;
+        }
+        int x0 = max(0, (int)floor(min(a.x, min(b.x, c.x))));
+        int y0 = max(0, (int)floor(min(a.y, min(b.y, c.y))));
+        int x1 = min(view->width - 1, (int)floor(max(a.x, max(b.x, c.x))));
+        int y1 = min(view->height - 1, (int)floor(max(a.y, max(b.y, c.y))));
+        if (x0 > x1 || y0 > y1) {
+            continue;
+        }
+        for (int ty = y0 / RASTER_TILE; ty <= y1 / RASTER_TILE; ty++) {
+            for (int tx = x0 / RASTER_TILE; tx <= x1 / RASTER_TILE; tx++) {
+                out[ty * tilesX + tx].push_back(t);
+            }
+        }
+    }
+}
+
+//****************************************************
+// Tile shading
+//****************************************************
+
+inline unsigned char colorbyte(float c) {
+    return (unsigned char)(c * 255 + 0.5f);
+}
+
+void Rasterizer::shadetile(int tile) {
+    int x0 = (tile % tilesX) * RASTER_TILE, y0 = (tile / tilesX) * RASTER_TILE;
+    int x1 = min(x0 + RASTER_TILE, view->width), y1 = min(y0 + RASTER_TILE, view->height);
+    int width = view->width;
+    for (int y = y0; y < y1; y++) {
+        memset(&target->color[3 * (y * width + x0)], 0, 3 * (x1 - x0));
+        for (int x = x0; x < x1; x++) {
+            target->depth[y * width + x] = 1.0f;
+        }
+    }
+    for (int w = 0; w < threadCount; w++) {
+        const vector<int>& bin = bins[w][tile];
+        for (int i = 0; i < (int)bin.size(); i++) {
+            int t = bin[i];
+            const ScreenVertex& a = screen[indices[3 * t]];
+            const ScreenVertex& b = screen[indices[3 * t + 1]];
+            const ScreenVertex& c = screen[indices[3 * t + 2]];
+            // GL_FLAT takes the color of the last vertex of each triangle
+            const ScreenVertex* flat = view->flat ? &c : NULL;
+            if (view->filled) {
+                filltriangle(a, b, c, flat, x0, y0, x1, y1);
+            }
+            else {
+                drawline(a, b, flat, x0, y0, x1, y1);
+                drawline(b, c, flat, x0, y0, x1, y1);
+                drawline(c, a, flat, x0, y0, x1, y1);
+            }
+        }
+    }
+}
+
+// Edge function: positive on the inside of a -> b when the triangle winds that way
+inline float edge(float ax, float ay, float bx, float by, float px, float py) {
+    return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+}
+
+// Top-left fill rule (y down): pixels centered exactly on a shared edge go to one triangle only
+inline bool topleft(float ax, float ay, float bx, float by) {
+    return (ay == by && bx > ax) || by < ay;
+}
+
+void Rasterizer::filltriangle(const ScreenVertex& a, const ScreenVertex& b0, const ScreenVertex& c0,
+    const ScreenVertex* flat, int x0, int y0, int x1, int y1) {
+    float area = edge(a.x, a.y, b0.x, b0.y, c0.x, c0.y);
+    if (area == 0) {
+        return;
+    }
+    const ScreenVertex& b = area > 0 ? b0 : c0;
+    const ScreenVertex& c = area > 0 ? c0 : b0;
+    area = fabs(area);
+    x0 = max(x0, (int)floor(min(a.x, min(b.x, c.x))));
+    y0 = max(y0, (int)floor(min(a.y, min(b.y, c.y))));
+    x1 = min(x1, (int)floor(max(a.x, max(b.x, c.x))) + 1);
+    y1 = min(y1, (int)floor(max(a.y, max(b.y, c.y))) + 1);
+    bool topBC = topleft(b.x, b.y, c.x, c.y), topCA = topleft(c.x, c.y, a.x, a.y), topAB = topleft(a.x, a.y, b.x, b.y);
+    float inverse = 1 / area;
+    int width = view->width;
+    for (int y = y0; y < y1; y++) {
+        float py = y + 0.5f, px = x0 + 0.5f;
+        // weights of a, b and c at the first pixel of the row, stepped along x
+        float wa = edge(b.x, b.y, c.x, c.y, px, py), wb = edge(c.x, c.y, a.x, a.y, px, py);
+        float wc = edge(a.x, a.y, b.x, b.y, px, py);
+        float da = -(c.y - b.y), db = -(a.y - c.y), dc = -(b.y - a.y);
+        for (int x = x0; x < x1; x++, wa += da, wb += db, wc += dc) {
+            if (wa < 0 || wb < 0 || wc < 0 || (wa == 0 && !topBC) || (wb == 0 && !topCA) || (wc == 0 && !topAB)) {
+                continue;
+            }
+            float la = wa * inverse, lb = wb * inverse, lc = wc * inverse;
+            float z = la * a.z + lb * b.z + lc * c.z;
+            float& depth = target->depth[y * width + x];
+            if (z < 0 || z > 1 || z >= depth) {
+                continue;
+            }
+            depth = z;
+            unsigned char* pixel = &target->color[3 * (y * width + x)];
+            if (flat) {
+                pixel[0] = colorbyte(flat->r);
+                pixel[1] = colorbyte(flat->g);
+                pixel[2] = colorbyte(flat->b);
+            }
+            else {
+                pixel[0] = colorbyte(la * a.r + lb * b.r + lc * c.r);
+                pixel[1] = colorbyte(la * a.g + lb * b.g + lc * c.g);
+                pixel[2] = colorbyte(la * a.b + lb * b.b + lc * c.b);
+            }
+        }
+    }
+}
+
+// One pixel wide DDA along the major axis, like GL_LINE polygons without smoothing
+void Rasterizer::drawline(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex* flat,
+    int x0, int y0, int x1, int y1) {
+    float dx = b.x - a.x, dy = b.y - a.y;
+    int steps = max(1, (int)ceil(max(fabs(dx), fabs(dy))));
+    int width = view->width;
+    for (int i = 0; i <= steps; i++) {
+        float t = (float)i / steps;
+        int x = (int)floor(a.x + dx * t), y = (int)floor(a.y + dy * t);
+        if (x < x0 || x >= x1 || y < y0 || y >= y1) {
+            continue;
+        }
+        float z = a.z + (b.z - a.z) * t;
+        float& depth = target->depth[y * width + x];
+        if (z < 0 || z > 1 || z >= depth) {
+            continue;
+        }
+        depth = z;
+        unsigned char* pixel = &target->color[3 * (y * width + x)];
+        if (flat) {
+            pixel[0] = colorbyte(flat->r);
+            pixel[1] = colorbyte(flat->g);
+            pixel[2] = colorbyte(flat->b);
+        }
+        else {
+            pixel[0] = colorbyte(a.r + (b.r - a.r) * t);
+            pixel[1] = colorbyte(a.g + (b.g - a.g) * t);
+            pixel[2] = colorbyte(a.b + (b.b - a.b) * t);
+        }
+    }
+}
+
+//****************************************************
+// Image files
+//****************************************************
+
+void putbig32(vector<unsigned char>& out, unsigned int x) {
+    out.push_back((unsigned char)(x >> 24));
+    out.push_back((unsigned char)(x >> 16));
+    out.push_back((unsigned char)(x >> 8));
+    out.push_back((unsigned char)x);
+}
+
+void pngchunk(FILE* file, const char* type, const vector<unsigned char>& data) {
+    unsigned int table[256];
+    for (unsigned int n = 0; n < 256; n++) {
+        unsigned int c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+    }
+    vector<unsigned char> chunk;
+    putbig32(chunk, data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    unsigned int crc = 0xFFFFFFFFu;
+    for (int i = 4; i < (int)chunk.size(); i++) {
+        crc = table[(crc ^ chunk[i]) & 0xFF] ^ (crc >> 8);
+    }
+    putbig32(chunk, crc ^ 0xFFFFFFFFu);
+    fwrite(&chunk[0], 1, chunk.size(), file);
+}
+
+// zlib stream of stored (uncompressed) deflate blocks, so no zlib dependency
+void writepng(FILE* file, const Framebuffer& image) {
+    const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    fwrite(signature, 1, 8, file);
+    vector<unsigned char> header;
+    putbig32(header, image.width);
+    putbig32(header, image.height);
+    unsigned char format[5] = { 8, 2, 0, 0, 0 };  // 8-bit RGB, no interlace
+    header.insert(header.end(), format, format + 5);
+    pngchunk(file, "IHDR", header);
+
+    int row = 3 * image.width;
+    vector<unsigned char> raw;
+    raw.reserve((row + 1) * image.height);
+    for (int y = 0; y < image.height; y++) {
+        raw.push_back(0);  // no filter
+        raw.insert(raw.end(), image.color.begin() + y * row, image.color.begin() + (y + 1) * row);
+    }
+    vector<unsigned char> data;
+    data.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    data.push_back(0x78);
+    data.push_back(0x01);
+    for (size_t first = 0; first < raw.size() || first == 0; first += 65535) {
+        size_t length = min(raw.size() - first, (size_t)65535);
+        data.push_back(first + length == raw.size() ? 1 : 0);
+        data.push_back((unsigned char)length);
+        data.push_back((unsigned char)(length >> 8));
+        data.push_back((unsigned char)~length);
+        data.push_back((unsigned char)(~length >> 8));
+        data.insert(data.end(), raw.begin() + first, raw.begin() + first + length);
+    }
+    unsigned int s1 = 1, s2 = 0;
+    for (size_t i = 0; i < raw.size(); i++) {
+        s1 = (s1 + raw[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    putbig32(data, (s2 << 16) | s1);
+    pngchunk(file, "IDAT", data);
+    pngchunk(file, "IEND", vector<unsigned char>());
+}
+
+bool writeimage(const char* path, const Framebuffer& image) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    string name(path);
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".png") == 0) {
+        writepng(file, image);
+    }
+    else {
+        fprintf(file, "P6\n%d %d\n255\n", image.width, image.height);
+        fwrite(&image.color[0], 1, image.color.size(), file);
+    }
+    return fclose(file) == 0;
+}
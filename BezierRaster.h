@@ -0,0 +1,92 @@
+#ifndef BEZIERRASTER_H
+#define BEZIERRASTER_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "BezierLib.h"
+
+// Headless software rasterizer. Draws an indexed triangle list the way
+// myDisplay does: glOrtho(-3, 3, -3, 3, 3, -3) stretched to the image, the
+// viewer's translate/rotate/zoom, GL_LESS depth test, GL_LIGHT0 with the cyan
+// material, flat (last vertex) or smooth shading and filled or wireframe
+// polygons. The image is cut into tiles; triangles are binned per tile and a
+// pool of worker threads shades whole tiles, so no two threads share a pixel.
+
+const int RASTER_TILE = 64;
+
+class RenderView {
+public:
+    int width, height;
+    float xTranslate, yTranslate;
+    float xRotate, yRotate;  // degrees, applied like glRotatef in myDisplay
+    float zoom;
+    bool flat, filled;
+    RenderView(int width, int height);
+};
+
+// Modelview of the view as rows of a 3x4 matrix (eye = matrix * [p 1])
+void viewmatrix(const RenderView& view, float matrix[3][4]);
+
+// Top row first, 8-bit RGB
+class Framebuffer {
+public:
+    int width, height;
+    vector<unsigned char> color;
+    vector<float> depth;
+};
+
+class Rasterizer {
+public:
+    Rasterizer(int threads = 0);  // 0: one per hardware thread
+    ~Rasterizer();
+    void render(const Vertex* vertices, int vertexCount, const unsigned int* indices, int indexCount,
+        const RenderView& view, Framebuffer& out);
+
+    int threadCount;
+    int tileCount;
+    long long binnedTriangles;  // triangle-tile pairs of the last frame
+
+private:
+    class ScreenVertex {
+    public:
+        float x, y, z;  // window coordinates, y down, z in [0, 1] inside the view volume
+        float r, g, b;
+    };
+
+    void work(int worker);
+    void runpass(int step);
+    void transformvertices(int worker);
+    void bintriangles(int worker);
+    void shadetile(int tile);
+    void filltriangle(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex& c, const ScreenVertex* flat,
+        int x0, int y0, int x1, int y1);
+    void drawline(const ScreenVertex& a, const ScreenVertex& b, const ScreenVertex* flat, int x0, int y0, int x1, int y1);
+
+    // current frame
+    const Vertex* vertices;
+    const unsigned int* indices;
+    int vertexCount, triangleCount;
+    const RenderView* view;
+    Framebuffer* target;
+    float matrix[3][4];
+    float normalMatrix[3][3];
+    int tilesX, tilesY;
+    vector<ScreenVertex> screen;
+    vector<vector<vector<int> > > bins;  // [worker][tile], each worker bins a contiguous triangle range
+
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake, done;
+    int pass, generation, finished;
+    atomic<int> nextTile;
+    bool stopping;
+};
+
+// .png writes an uncompressed PNG, anything else binary PPM
+bool writeimage(const char* path, const Framebuffer& image);
+
+#endif
@@ -0,0 +1,439 @@
+#include <map>
+#include <string>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "BezierService.h"
+
+#ifdef _WIN32
+
+int servetessellation(const char* socketPath, long long cacheBytes) {
+    printf("The tessellation service needs Unix domain sockets and POSIX shared memory\n");
+    return 1;
+}
+
+bool requesttessellation(const char* socketPath, const char* file, float step, int mode, ServiceResult& out) {
+    printf("The tessellation service needs Unix domain sockets and POSIX shared memory\n");
+    return false;
+}
+
+void releasetessellation(ServiceResult& result) {
+}
+
+#else
+
+//****************************************************
+// Daemon
+//****************************************************
+
+class ServiceScene {
+public:
+    time_t modified;
+    vector<Surface> patches;
+};
+
+// A finished tessellation living in a shared-memory segment
+class ServiceEntry {
+public:
+    string segment;
+    unsigned int vertexCount, indexCount;
+    size_t bytes;
+    long long lastUse;
+};
+
+// A connection and the part of its request read so far; sockets are
+// non-blocking, so a slow client never holds up the others
+class ServiceClient {
+public:
+    int fd;
+    ServiceRequest request;
+    int filled;       // bytes of request received
+    double started;   // when the first byte of the pending request arrived
+    double received;  // when the request was complete
+};
+
+const double SERVICE_READ_TIMEOUT = 5;  // seconds a partial request may take
+
+static map<string, ServiceScene> service_scenes;
+static map<string, ServiceEntry> service_entries;
+static long long service_bytes;
+static long long service_clock;
+static int service_segments;
+
+static string servicekey(const ServiceRequest& r, time_t modified) {
+    char key[640];
+    snprintf(key, sizeof(key), "%s|%ld|%.8g|%d", r.file, (long)modified, r.step, r.mode);
+    return key;
+}
+
+// Parsed patches for a file, reloaded when it changes on disk
+static ServiceScene* loadscene(const char* file) {
+    struct stat st;
+    if (stat(file, &st) != 0) {
+        return NULL;
+    }
+    ServiceScene& scene = service_scenes[file];
+    if (scene.patches.empty() || scene.modified != st.st_mtime) {
+        scene.patches.clear();
+        scene.modified = st.st_mtime;
+        loadpatches(file, scene.patches);
+    }
+    return scene.patches.empty() ? NULL : &scene;
+}
+
+// Tessellates straight into a new segment named entry.segment; grids are written in place, the
+// adaptive triangles are built first because their count is not known ahead
+static bool tessellatesegment(const ServiceRequest& r, const ServiceScene& scene, ServiceEntry& entry) {
+    int n = scene.patches.size();
+    BezierContext context(r.mode == SERVICE_ADAPTIVE ? 1 : min(MAX_DIVISIONS, max(1, (int)(1 / r.step))),
+        r.mode == SERVICE_ADAPTIVE ? max(r.step, SERVICE_MIN_TOLERANCE) : 0);
+    Mesh adaptive;
+    long long vertexCount, indexCount;
+    if (r.mode == SERVICE_ADAPTIVE) {
+        tessellateadaptive(context, &scene.patches[0], n, adaptive);
+        vertexCount = adaptive.vertices.size();
+        indexCount = adaptive.indices.size();
+    }
+    else {
+        vertexCount = gridvertexcount(context, n);
+        indexCount = gridindexcount(context, n);
+    }
+    long long bytes = vertexCount * (long long)sizeof(Vertex) + indexCount * (long long)sizeof(unsigned int);
+    if (bytes > SERVICE_MAX_BYTES) {
+        printf("  %s step %g: refused, %.1f MB is over the %lld MB limit\n", r.file, r.step,
+            bytes / 1048576.0, SERVICE_MAX_BYTES >> 20);
+        return false;
+    }
+    entry.vertexCount = (unsigned int)vertexCount;
+    entry.indexCount = (unsigned int)indexCount;
+    entry.bytes = (size_t)bytes;
+
+    const char* name = entry.segment.c_str();
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, max(entry.bytes, (size_t)1)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void* data = mmap(NULL, max(entry.bytes, (size_t)1), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        shm_unlink(name);
+        return false;
+    }
+    Vertex* vertices = (Vertex*)data;
+    unsigned int* indices = (unsigned int*)(vertices + entry.vertexCount);
+    if (r.mode == SERVICE_ADAPTIVE) {
+        if (entry.vertexCount) {
+            memcpy(vertices, &adaptive.vertices[0], entry.vertexCount * sizeof(Vertex));
+            memcpy(indices, &adaptive.indices[0], entry.indexCount * sizeof(unsigned int));
+        }
+    }
+    else {
+        tessellategrids(context, &scene.patches[0], n, vertices, indices);
+    }
+    munmap(data, max(entry.bytes, (size_t)1));
+    return true;
+}
+
+// Unlinked segments stay valid for clients that already mapped them; a
+// client that maps a reply late may find its segment evicted and must retry
+static void evictentries(long long cacheBytes, const map<string, bool>& pinned) {
+    while (service_bytes > cacheBytes) {
+        map<string, ServiceEntry>::iterator oldest = service_entries.end();
+        for (map<string, ServiceEntry>::iterator it = service_entries.begin(); it != service_entries.end(); ++it) {
+            if (!pinned.count(it->first) && (oldest == service_entries.end() || it->second.lastUse < oldest->second.lastUse)) {
+                oldest = it;
+            }
+        }
+        if (oldest == service_entries.end()) {
+            return;
+        }
+        shm_unlink(oldest->second.segment.c_str());
+        service_bytes -= oldest->second.bytes;
+        service_entries.erase(oldest);
+    }
+}
+
+// One batch: every request that arrived since the last poll. Identical
+// requests are tessellated once, distinct ones on their own threads.
+static void servebatch(vector<ServiceClient>& batch, long long cacheBytes) {
+    double start = currentTime();
+    vector<string> keys(batch.size());
+    vector<int> sources(batch.size(), SERVICE_CACHED);
+    map<string, bool> pinned;
+    vector<string> missing;
+    vector<ServiceScene*> missingScenes;
+    for (int i = 0; i < (int)batch.size(); i++) {
+        ServiceScene* scene = loadscene(batch[i].request.file);
+        if (!scene || !isfinite(batch[i].request.step) || batch[i].request.step <= 0) {
+            continue;
+        }
+        keys[i] = servicekey(batch[i].request, scene->modified);
+        if (pinned.count(keys[i])) {
+            if (!service_entries.count(keys[i])) {
+                sources[i] = SERVICE_COALESCED;
+            }
+            continue;
+        }
+        pinned[keys[i]] = true;
+        if (!service_entries.count(keys[i])) {
+            sources[i] = SERVICE_TESSELLATED;
+            missing.push_back(keys[i]);
+            missingScenes.push_back(scene);
+        }
+    }
+
+    // index of the request that tessellates each missing key
+    vector<int> owners;
+    for (int m = 0; m < (int)missing.size(); m++) {
+        for (int i = 0; i < (int)batch.size(); i++) {
+            if (keys[i] == missing[m] && sources[i] == SERVICE_TESSELLATED) {
+                owners.push_back(i);
+                break;
+            }
+        }
+    }
+    vector<ServiceEntry> built(missing.size());
+    vector<char> success(missing.size());
+    vector<thread> workers;
+    for (int m = 0; m < (int)missing.size(); m++) {
+        char name[64];
+        snprintf(name, sizeof(name), "/bezier-%d-%d", (int)getpid(), service_segments++);
+        built[m].segment = name;
+        workers.push_back(thread([&, m]() {
+            success[m] = tessellatesegment(batch[owners[m]].request, *missingScenes[m], built[m]);
+        }));
+    }
+    for (int m = 0; m < (int)workers.size(); m++) {
+        workers[m].join();
+    }
+    double tessellated = currentTime() - start;
+    for (int m = 0; m < (int)missing.size(); m++) {
+        if (success[m]) {
+            service_entries[missing[m]] = built[m];
+            service_bytes += built[m].bytes;
+        }
+    }
+    // before replying, so no segment named in this batch's replies is unlinked
+    evictentries(cacheBytes, pinned);
+
+    size_t bytes = 0;
+    for (int i = 0; i < (int)batch.size(); i++) {
+        ServiceResponse response;
+        memset(&response, 0, sizeof(response));
+        response.source = sources[i];
+        map<string, ServiceEntry>::iterator it = keys[i].empty() ? service_entries.end() : service_entries.find(keys[i]);
+        if (it != service_entries.end()) {
+            ServiceEntry& entry = it->second;
+            entry.lastUse = service_clock++;
+            response.ok = 1;
+            snprintf(response.segment, sizeof(response.segment), "%s", entry.segment.c_str());
+            response.vertexCount = entry.vertexCount;
+            response.indexCount = entry.indexCount;
+            bytes += entry.bytes;
+        }
+        double now = currentTime();
+        response.serverLatency = now - batch[i].received;
+        send(batch[i].fd, &response, sizeof(response), MSG_NOSIGNAL);
+        const char* how[] = { "tessellated", "coalesced", "cached" };
+        printf("  %s step %g %s: %s, waited %.2f ms, total %.2f ms, %u vertices\n", batch[i].request.file,
+            batch[i].request.step, batch[i].request.mode == SERVICE_ADAPTIVE ? "adaptive" : "uniform",
+            response.ok ? how[sources[i]] : "failed", (start - batch[i].received) * 1e3,
+            response.serverLatency * 1e3, response.vertexCount);
+    }
+    double elapsed = currentTime() - start;
+    printf("batch: %d requests, %d tessellated in %.2f ms, %.1f requests/s, %.1f MB/s served, cache %.1f MB\n",
+        (int)batch.size(), (int)missing.size(), tessellated * 1e3, batch.size() / fmax(elapsed, 1e-9),
+        bytes / 1048576.0 / fmax(elapsed, 1e-9), service_bytes / 1048576.0);
+    fflush(stdout);
+}
+
+int servetessellation(const char* socketPath, long long cacheBytes) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    unlink(socketPath);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        printf("Could not listen on %s\n", socketPath);
+        return 1;
+    }
+    printf("Serving tessellations on %s\n", socketPath);
+    fflush(stdout);
+
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    vector<ServiceClient> clients;
+    bool running = true;
+    while (running) {
+        pollfd wait = { listener, POLLIN, 0 };
+        vector<pollfd> fds(1, wait);
+        bool partial = false;
+        for (int c = 0; c < (int)clients.size(); c++) {
+            pollfd client = { clients[c].fd, POLLIN, 0 };
+            fds.push_back(client);
+            partial = partial || clients[c].filled > 0;
+        }
+        // wake up now and then while a request is half read, to time it out
+        if (poll(&fds[0], fds.size(), partial ? 1000 : -1) < 0) {
+            continue;
+        }
+        // take every waiting connection, then every request that is already
+        // readable, so concurrent clients land in one batch
+        for (int fd = accept(listener, NULL, NULL); fd >= 0; fd = accept(listener, NULL, NULL)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            ServiceClient client;
+            memset(&client, 0, sizeof(client));
+            client.fd = fd;
+            clients.push_back(client);
+        }
+        fds.resize(clients.size());
+        for (int c = 0; c < (int)clients.size(); c++) {
+            fds[c].fd = clients[c].fd;
+            fds[c].events = POLLIN;
+            fds[c].revents = 0;
+        }
+        if (!fds.empty()) {
+            poll(&fds[0], fds.size(), 0);
+        }
+        double now = currentTime();
+        vector<ServiceClient> batch;
+        vector<ServiceClient> open;
+        for (int c = 0; c < (int)clients.size(); c++) {
+            ServiceClient& client = clients[c];
+            if (fds[c].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t got = recv(client.fd, (char*)&client.request + client.filled,
+                    sizeof(client.request) - client.filled, 0);
+                if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    close(client.fd);
+                    continue;
+                }
+                if (got > 0) {
+                    if (client.filled == 0) {
+                        client.started = now;
+                    }
+                    client.filled += got;
+                }
+            }
+            if (client.filled > 0 && client.filled < (int)sizeof(client.request) &&
+                now - client.started > SERVICE_READ_TIMEOUT) {
+                printf("  dropped a client that sent %d of %d request bytes\n", client.filled, (int)sizeof(client.request));
+                fflush(stdout);
+                close(client.fd);
+                continue;
+            }
+            if (client.filled < (int)sizeof(client.request)) {
+                open.push_back(client);
+                continue;
+            }
+            client.filled = 0;
+            client.received = now;
+            client.request.file[sizeof(client.request.file) - 1] = 0;
+            open.push_back(client);
+            if (client.request.mode == SERVICE_SHUTDOWN) {
+                running = false;
+                continue;
+            }
+            batch.push_back(client);
+        }
+        clients.swap(open);
+        if (!batch.empty()) {
+            servebatch(batch, cacheBytes);
+        }
+    }
+
+    for (int c = 0; c < (int)clients.size(); c++) {
+        close(clients[c].fd);
+    }
+    for (map<string, ServiceEntry>::iterator it = service_entries.begin(); it != service_entries.end(); ++it) {
+        shm_unlink(it->second.segment.c_str());
+    }
+    close(listener);
+    unlink(socketPath);
+    return 0;
+}
+
+//****************************************************
+// Client
+//****************************************************
+
+bool requesttessellation(const char* socketPath, const char* file, float step, int mode, ServiceResult& out) {
+    memset(&out, 0, sizeof(out));
+    double start = currentTime();
+    ServiceRequest request;
+    memset(&request, 0, sizeof(request));
+    if (!realpath(file, request.file)) {
+        snprintf(request.file, sizeof(request.file), "%s", file);
+    }
+    request.step = step;
+    request.mode = mode;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    bool sent = send(fd, &request, sizeof(request), MSG_NOSIGNAL) == sizeof(request);
+    if (mode == SERVICE_SHUTDOWN) {
+        close(fd);
+        return sent;
+    }
+    bool received = sent && recv(fd, &out.response, sizeof(out.response), MSG_WAITALL) == sizeof(out.response);
+    close(fd);
+    if (!received || !out.response.ok) {
+        return false;
+    }
+
+    int segment = shm_open(out.response.segment, O_RDONLY, 0);
+    if (segment < 0) {
+        return false;
+    }
+    out.size = out.response.vertexCount * sizeof(Vertex) + out.response.indexCount * sizeof(unsigned int);
+    out.mapping = mmap(NULL, max(out.size, (size_t)1), PROT_READ, MAP_SHARED, segment, 0);
+    close(segment);
+    if (out.mapping == MAP_FAILED) {
+        out.mapping = NULL;
+        return false;
+    }
+    out.vertices = (const Vertex*)out.mapping;
+    out.indices = (const unsigned int*)(out.vertices + out.response.vertexCount);
+    out.vertexCount = out.response.vertexCount;
+    out.indexCount = out.response.indexCount;
+    out.latency = currentTime() - start;
+    return true;
+}
+
+void releasetessellation(ServiceResult& result) {
+    if (result.mapping) {
+        munmap(result.mapping, max(result.size, (size_t)1));
+    }
+    result.mapping = NULL;
+    result.vertices = NULL;
+    result.indices = NULL;
+}
+
+#endif
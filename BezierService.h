@@ -0,0 +1,61 @@
+#ifndef BEZIERSERVICE_H
+#define BEZIERSERVICE_H
+
+#include "BezierLib.h"
+
+// Local tessellation service. A daemon keeps parsed scenes and finished
+// tessellations warm; clients ask for (file, step, mode) over a Unix domain
+// socket and map the resulting vertex and index buffers from a shared-memory
+// segment, so nothing is copied on the way to the client. POSIX only: on
+// Windows both ends report that the service is unavailable.
+
+const int SERVICE_UNIFORM = 0;
+const int SERVICE_ADAPTIVE = 1;
+const int SERVICE_SHUTDOWN = 2;
+
+// Limits on what a client may ask for: the adaptive tolerance is floored, the
+// uniform grid is clamped to MAX_DIVISIONS, and results larger than
+// SERVICE_MAX_BYTES are refused instead of sized into a segment
+const float SERVICE_MIN_TOLERANCE = 1e-4f;
+const long long SERVICE_MAX_BYTES = 1LL << 30;
+
+class ServiceRequest {
+public:
+    char file[512]; // absolute path, resolved by the client
+    float step;     // grid step, or tolerance in adaptive mode
+    int mode;
+};
+
+class ServiceResponse {
+public:
+    int ok;
+    char segment[64];  // shared-memory name holding vertices, then indices
+    unsigned int vertexCount, indexCount;
+    double serverLatency;  // seconds from receipt to reply
+    int source;        // how the server produced it, SERVICE_* below
+};
+
+const int SERVICE_TESSELLATED = 0;
+const int SERVICE_COALESCED = 1;  // another request in the same batch tessellated it
+const int SERVICE_CACHED = 2;
+
+// Mapped result of a request; vertices and indices point into the segment
+class ServiceResult {
+public:
+    const Vertex* vertices;
+    const unsigned int* indices;
+    unsigned int vertexCount, indexCount;
+    double latency;  // round trip seen by the client, seconds
+    ServiceResponse response;
+    void* mapping;
+    size_t size;
+};
+
+// Runs the daemon until a SERVICE_SHUTDOWN request; finished tessellations
+// beyond cacheBytes are dropped least recently used first
+int servetessellation(const char* socketPath, long long cacheBytes);
+
+bool requesttessellation(const char* socketPath, const char* file, float step, int mode, ServiceResult& out);
+void releasetessellation(ServiceResult& result);
+
+#endif
@@ -1,13 +1,33 @@
 
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <cfloat>
+#include <cstring>
 
 #ifdef _WIN32
 #include <windows.h>
+#include <direct.h>
+#include <sys/utime.h>
 #else
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
 #endif
 
 #ifdef OSX
@@ -22,6 +42,8 @@
 #include <math.h>
 
 #include "BezierSurfaces.h"
+#include "BezierService.h"
+#include "BezierRaster.h"
 using namespace std;
 
 //****************************************************
@@ -39,15 +61,12 @@ public:
 //****************************************************
 // Global Variables
 //****************************************************
-const int MAX_CHARS_PER_LINE = 512;
-const int MAX_TOKENS_PER_LINE = 20;
-const char* const DELIMITER = " ";
-
 Viewport	viewport;
 Vector light_pos;
 Vector light_pos2;
 
 string filename;
+vector<ScenePart> scene_parts; // every input file, manifests expanded
 float subdivisionSize;
 boolean isAdaptive;
 bool flatShading;
@@ -61,415 +80,2374 @@ float xRotVal;
 float yRotVal;
 float zoom;
 vector<Surface> surface_list;
-
-int numdiv;
-std::vector<std::vector<Point> > patch_points;
+bool isMonomial;
+bool isFlatAdaptive;
+int triangleBudget;
+vector<Triangle> budget_list;
+vector<int> budget_firsts; // per patch, its first triangle in budget_list, plus the end
+bool isAnalyze;
+float autoStepError;
+vector<int> patch_divisions;
+bool isSpaced;
+vector<int> patch_columns; // -spacing with -autostep: v divisions, patch_divisions holds u
+bool isInstanced;
+bool isOptimized;
+bool useStrips;
+bool isPacked;
+string exportFile;
+string sampleFile;
+long long sampleCount;
+bool isPoisson;
+unsigned long long sampleSeed = 1;
+bool isEditing;
+bool isBreadthFirst;
+string serviceSocket;
+string renderFile;
+int lodFinest;
+RenderView render_view(400, 400);
+vector<vector<Surface> > keyframes;
+string cacheDir;
+long long cacheLimit = 256LL << 20;
+bool isBenchmark;
+vector<MonomialPatch> monomial_list;
+vector<PatchShape> patch_shapes; // empty with no fast-path patch, or when patches change after load (-keyframe)
+
+BezierContext draw_context(1); // per-patch grids and flatness leaves drawn by the viewer
+PatchGrid patch_grid;
 vector<Triangle> triangle_list;
 
 ///////////////////////////////////////////////
 
-Vector::Vector() {
-    x = 0.0f;
-    y = 0.0f;
-    z = 0.0f;
+//****************************************************
+// logic below
+//***************************************************
+
+//****************************************************
+// Error-budgeted tessellation (-b)
+//****************************************************
+void budgettessellation(int maxTriangles, float target) {
+    double start = currentTime();
+    BezierContext context(1, target);
+    budget_list.clear();
+    float remaining = 0;
+    if (!surface_list.empty()) {
+        remaining = tessellatebudget(context, &surface_list[0], surface_list.size(), maxTriangles, budget_list,
+            &budget_firsts);
+    }
+    printf("Budget tessellation: %d triangles (budget %d), max error %f, %.1f ms\n",
+        (int)budget_list.size(), maxTriangles, remaining, (currentTime() - start) * 1e3);
+}
+
+//****************************************************
+// Planar and reduced-degree fast paths: patches are
+// classified once at load
+//****************************************************
+const PatchShape* shapeof(int i) {
+    return patch_shapes.empty() ? NULL : &patch_shapes[i];
+}
+
+bool isreduced(const PatchShape* shape) {
+    return shape && !shape->flat && (shape->degreeU < 3 || shape->degreeV < 3);
+}
+
+// Power basis for -m, and for reduced-degree patches whose Horner scheme is
+// shorter than the bicubic de Casteljau evaluation
+const MonomialPatch* evaluatorof(int i) {
+    if (isMonomial || (isreduced(shapeof(i)) && !monomial_list.empty())) {
+        return &monomial_list[i];
+    }
+    return NULL;
+}
+
+void classifyshapes() {
+    double start = currentTime();
+    patch_shapes.resize(surface_list.size());
+    int flat = 0, planar = 0, bilinear = 0, reducedU = 0, reducedV = 0, reduced = 0;
+    for (int i = 0; i < (int)surface_list.size(); i++) {
+        PatchShape& shape = patch_shapes[i];
+        shape = classifypatch(surface_list[i]);
+        if (shape.flat) {
+            flat++;
+            continue;
+        }
+        planar += shape.planar;
+        bilinear += shape.degreeU <= 1 && shape.degreeV <= 1;
+        reducedU += shape.degreeU < 3;
+        reducedV += shape.degreeV < 3;
+        reduced += isreduced(&shape);
+    }
+    if (reduced > 0 && monomial_list.empty()) {
+        for (int i = 0; i < (int)surface_list.size(); i++) {
+            monomial_list.push_back(MonomialPatch(surface_list[i]));
+        }
+    }
+    if (flat + reduced == 0) {
+        patch_shapes.clear();  // nothing to gain, every patch takes the bicubic path
+    }
+    if (flat + planar + reduced > 0) {
+        printf("Patch shapes: %d flat (two triangles each), %d other planar, %d bilinear, %d reduced in u, %d in v,"
+            " %d bicubic, %.1f ms\n", flat, planar, bilinear, reducedU, reducedV,
+            (int)surface_list.size() - flat - reduced, (currentTime() - start) * 1e3);
+    }
+}
+
+// Grid of one patch into patch_grid: uniform n x n, or n x columns (columns
+// 0: n) whose isoparameters follow the patch curvature with -spacing
+void subdividepatchgrid(Surface& patch, int n, const MonomialPatch* mono, int columns = 0,
+    const PatchShape* shape = NULL) {
+    patchgrid(draw_context, patch, n, columns > 0 ? columns : n, isSpaced, patch_grid, mono, shape);
+}
+
+void subdividepatch(Surface patch, float step, const MonomialPatch* mono = NULL, const PatchShape* shape = NULL) {
+    if (isFlatAdaptive) {
+        draw_context.epsilon = step;
+        tessellateflat(draw_context, &patch, 1, triangle_list);
+    }
+    //adaptive
+    else if (isAdaptive) {
+        adaptivepatch(patch, step, triangle_list, mono, shape);
+    }
+    else {
+        //float epsilon = 0.0001; //TODO fix maybe
+        subdividepatchgrid(patch, (int)(1 / step), mono, 0, shape);
+    }
+}
+
+//****************************************************
+// Tessellation accuracy (-analyze) and per-patch
+// automatic step selection (-autostep)
+//****************************************************
+const int ADAPTIVE_BATCH = 256; // triangles pulled from the adaptive generator at a time
+
+// Workers that live for the whole run, so per-frame loops (-keyframe) do
+// not pay for starting threads. The caller takes part in every job. A job
+// started while another one runs, from inside its body, runs inline.
+class WorkerPool {
+public:
+    WorkerPool() : generation(0), active(0), busy(false), stopping(false), body(NULL), count(0) {}
+
+    ~WorkerPool() {
+        {
+            unique_lock<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (int t = 0; t < (int)workers.size(); t++) {
+            workers[t].join();
+        }
+    }
+
+    void run(int n, const function<void(int)>& job) {
+        {
+            unique_lock<mutex> guard(lock);
+            if (busy) {
+                guard.unlock();
+                for (int i = 0; i < n; i++) {
+                    job(i);
+                }
+                return;
+            }
+            busy = true;
+            // started on first use, not during static initialization
+            if (workers.empty()) {
+                int threads = max(1, (int)thread::hardware_concurrency());
+                for (int t = 1; t < threads; t++) {
+                    workers.push_back(thread([this]() { work(); }));
+                }
+            }
+            body = &job;
+            count = n;
+            next = 0;
+            active = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        drain();
+        unique_lock<mutex> guard(lock);
+        while (active > 0) {
+            done.wait(guard);
+        }
+        body = NULL;
+        busy = false;
+    }
+
+private:
+    void drain() {
+        for (int i = next++; i < count; i = next++) {
+            (*body)(i);
+        }
+    }
+
+    void work() {
+        int seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                while (generation == seen && !stopping) {
+                    wake.wait(guard);
+                }
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            drain();
+            unique_lock<mutex> guard(lock);
+            if (--active == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake, done;
+    int generation, active;
+    bool busy, stopping;
+    const function<void(int)>* body;
+    int count;
+    atomic<int> next;
+};
+
+WorkerPool worker_pool;
+
+// Runs body(i) for every i in [0, n) on all hardware threads
+void parallelfor(int n, const function<void(int)>& body) {
+    worker_pool.run(n, body);
+}
+
+void patchdeviation(int i, const Triangle* tris, int count, Deviation& d) {
+    const PatchShape* shape = shapeof(i);
+    if (shape && shape->flat) {
+        accumulateplanedeviation(*shape, surface_list[i].a.a, tris, count, d);
+    }
+    else {
+        accumulatedeviation(monomial_list[i], tris, count, d);
+    }
+}
+
+// Adaptive deviation measured batch by batch as the generator produces them
+Deviation streamdeviation(int i, int& triangles) {
+    AdaptiveTriangles generator(&surface_list[i], 1, subdivisionSize, &monomial_list[i], shapeof(i));
+    vector<Triangle> batch(ADAPTIVE_BATCH);
+    Deviation d;
+    triangles = 0;
+    for (int n = generator.next(&batch[0], ADAPTIVE_BATCH); n > 0; n = generator.next(&batch[0], ADAPTIVE_BATCH)) {
+        patchdeviation(i, &batch[0], n, d);
+        triangles += n;
+    }
+    return d;
+}
+
+// Tessellates one patch in the current mode, through ctx so patches can run in parallel.
+// The budget spreads its triangles over all patches at once, so -b hands out
+// this patch's share of the last budgettessellation.
+void collecttriangles(BezierContext& ctx, int i, vector<Triangle>& out) {
+    if (triangleBudget > 0) {
+        out.insert(out.end(), budget_list.begin() + budget_firsts[i], budget_list.begin() + budget_firsts[i + 1]);
+    }
+    else if (isFlatAdaptive) {
+        ctx.epsilon = subdivisionSize;
+        tessellateflat(ctx, &surface_list[i], 1, out);
+    }
+    else if (isAdaptive) {
+        adaptivepatch(surface_list[i], subdivisionSize, out, &monomial_list[i], shapeof(i));
+    }
+    else {
+        int rows = patch_divisions.empty() ? (int)(1 / subdivisionSize) : patch_divisions[i];
+        int columns = patch_columns.empty() ? rows : patch_columns[i];
+        PatchGrid grid;
+        patchgrid(ctx, surface_list[i], rows, columns, isSpaced, grid, &monomial_list[i], shapeof(i));
+        gridtriangles(grid, out);
+    }
+}
+
+void analyzetessellation() {
+    double start = currentTime();
+    int n = surface_list.size();
+    vector<Deviation> results(n);
+    vector<int> counts(n);
+    if (isAdaptive && !isFlatAdaptive && triangleBudget == 0) {
+        parallelfor(n, [&](int i) {
+            results[i] = streamdeviation(i, counts[i]);
+        });
+    }
+    else {
+        if (triangleBudget > 0) {
+            budgettessellation(triangleBudget, subdivisionSize);
+        }
+        parallelfor(n, [&](int i) {
+            BezierContext context(1);
+            vector<Triangle> tris;
+            collecttriangles(context, i, tris);
+            counts[i] = tris.size();
+            if (!tris.empty()) {
+                patchdeviation(i, &tris[0], tris.size(), results[i]);
+            }
+        });
+    }
+
+    Deviation total;
+    int triangles = 0;
+    for (int i = 0; i < n; i++) {
+        total.maxError = fmax(total.maxError, results[i].maxError);
+        total.sumError += results[i].sumError;
+        total.samples += results[i].samples;
+        triangles += counts[i];
+    }
+    const char* mode = triangleBudget > 0 ? "error budget" : isFlatAdaptive ? "flatness adaptive"
+        : isAdaptive ? "adaptive" : patch_divisions.empty() ? (isSpaced ? "curvature spaced" : "uniform")
+        : isSpaced ? "curvature spaced auto step" : "auto step";
+    printf("%s (%s, %f): %d patches, %d triangles\n", filename.c_str(), mode, subdivisionSize, n, triangles);
+    printf("  deviation max %g, mean %g over %d samples, %.1f ms\n", total.maxError,
+        total.samples ? total.sumError / total.samples : 0.0, total.samples, (currentTime() - start) * 1e3);
+    // the budget may stop short once every sub-patch is within the target, never above it
+    if (triangleBudget > 0) {
+        bool held = triangles <= triangleBudget && triangles == (int)budget_list.size();
+        printf("  budget %d: %d triangles measured (%.1f%%), %s\n", triangleBudget, triangles,
+            100.0 * triangles / triangleBudget, held ? "within budget" : "CHECK FAILED");
+    }
+}
+
+// Coarsest grid per patch whose deviation stays below maxError
+void selectpatchsteps(float maxError) {
+    double start = currentTime();
+    int n = surface_list.size();
+    patch_divisions.assign(n, MAX_DIVISIONS);
+    patch_columns.clear();
+    if (isSpaced) {
+        patch_columns.assign(n, MAX_DIVISIONS);
+    }
+    parallelfor(n, [&](int i) {
+        if (shapeof(i) && shapeof(i)->flat) {
+            patch_divisions[i] = 1;
+            if (isSpaced) {
+                patch_columns[i] = 1;
+            }
+        }
+        else if (isSpaced) {
+            spaceddivisions(surface_list[i], monomial_list[i], maxError, patch_divisions[i], patch_columns[i]);
+        }
+        else {
+            patch_divisions[i] = uniformdivisions(surface_list[i], monomial_list[i], maxError);
+        }
+    });
+
+    int triangles = 0, finest = 0, coarsest = MAX_DIVISIONS;
+    for (int i = 0; i < n; i++) {
+        int columns = isSpaced ? patch_columns[i] : patch_divisions[i];
+        triangles += 2 * patch_divisions[i] * columns;
+        finest = max(finest, max(patch_divisions[i], columns));
+        coarsest = min(coarsest, min(patch_divisions[i], columns));
+    }
+    printf("Auto step for max error %g: %d triangles, %d..%d divisions per patch%s, %.1f ms\n",
+        maxError, triangles, coarsest, finest, isSpaced ? " (curvature spaced)" : "", (currentTime() - start) * 1e3);
+    if (isSpaced) {
+        vector<int> uniform(n);
+        parallelfor(n, [&](int i) {
+            uniform[i] = uniformdivisions(surface_list[i], monomial_list[i], maxError);
+        });
+        int uniformTriangles = 0;
+        for (int i = 0; i < n; i++) {
+            uniformTriangles += 2 * uniform[i] * uniform[i];
+        }
+        printf("  uniform spacing per patch at the same error needs %d triangles (%.2fx)\n",
+            uniformTriangles, triangles ? (double)uniformTriangles / triangles : 0.0);
+    }
+    else {
+        printf("  one uniform step at the same error needs %d divisions, %d triangles\n",
+            finest, 2 * finest * finest * n);
+    }
+}
+
+//****************************************************
+// Persistent tessellation cache (-cache <dir>)
+//****************************************************
+const unsigned int TESSELLATION_VERSION = 3; // bump when any tessellator output changes
+const unsigned int MESH_MAGIC = 0x434d5a42; // "BZMC"
+
+class MeshHeader {
+public:
+    unsigned int magic, version, vertexCount, indexCount, strip;
+};
+
+// Read-only file mapping, the cached mesh is drawn straight from it
+class MappedFile {
+public:
+    const char* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#else
+    int fd;
+#endif
+    MappedFile() : data(NULL), size(0) {}
+
+    bool open(const string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        size = GetFileSize(file, NULL);
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        data = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (!data) {
+            if (mapping) {
+                CloseHandle(mapping);
+            }
+            CloseHandle(file);
+            return false;
+        }
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        data = (const char*)p;
+#endif
+        return true;
+    }
+
+    void close() {
+        if (!data) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        munmap((void*)data, size);
+        ::close(fd);
+#endif
+        data = NULL;
+    }
+};
+
+Mesh scene_mesh;
+MappedFile cache_file;
+const Vertex* mesh_vertices;
+const unsigned int* mesh_indices;
+int mesh_index_count;
+bool mesh_is_strip;
+string cachePath;
+ServiceResult service_result;
+
+// Appends a patch grid, vertices shared between quads
+void appendgrid(Mesh& mesh, const PatchGrid& grid) {
+    unsigned int base = mesh.vertices.size();
+    for (int iu = 0; iu <= grid.rows; iu++) {
+        for (int iv = 0; iv <= grid.columns; iv++) {
+            int i = grid.index(iu, iv);
+            const Point& p = grid.points[i];
+            Vertex v = { p.x, p.y, p.z, p.normal1.x, p.normal1.y, p.normal1.z, grid.us[i], grid.vs[i] };
+            mesh.vertices.push_back(v);
+        }
+    }
+    int w = grid.columns + 1;
+    for (int iu = 0; iu < grid.rows; iu++) {
+        for (int iv = 0; iv < grid.columns; iv++) {
+            unsigned int ll = base + iu * w + iv;
+            unsigned int ul = ll + w;
+            unsigned int ur = ul + 1;
+            unsigned int lr = ll + 1;
+            unsigned int quad[6] = { ll, ul, ur, ll, ur, lr };
+            mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+        }
+    }
+}
+
+// Columns per strip band; a band's last row of vertices must still be in a
+// 16 entry post-transform cache when the next row is drawn
+const int STRIP_BAND = 6;
+
+// Same grid as one strip, cut into bands of columns; rows and bands are
+// joined by repeating their end vertices
+void appendgridstrip(Mesh& mesh, const PatchGrid& grid) {
+    unsigned int base = mesh.vertices.size();
+    for (int iu = 0; iu <= grid.rows; iu++) {
+        for (int iv = 0; iv <= grid.columns; iv++) {
+            int i = grid.index(iu, iv);
+            const Point& p = grid.points[i];
+            Vertex v = { p.x, p.y, p.z, p.normal1.x, p.normal1.y, p.normal1.z, grid.us[i], grid.vs[i] };
+            mesh.vertices.push_back(v);
+        }
+    }
+    int w = grid.columns + 1;
+    for (int band = 0; band < grid.columns; band += STRIP_BAND) {
+        int last = min(band + STRIP_BAND, grid.columns);
+        for (int iu = 0; iu < grid.rows; iu++) {
+            unsigned int row = base + iu * w;
+            // upper row first so the strip splits quads on the same diagonal as the lists
+            if (!mesh.indices.empty()) {
+                mesh.indices.push_back(mesh.indices.back());
+                mesh.indices.push_back(row + w + band);
+            }
+            for (int iv = band; iv <= last; iv++) {
+                mesh.indices.push_back(row + w + iv);
+                mesh.indices.push_back(row + iv);
+            }
+        }
+    }
+}
+
+// One patch in the selected (per-patch) mode appended to mesh
+void appendpatchmesh(Mesh& mesh, Surface& patch, const MonomialPatch* mono, int divisions, int columns = 0,
+    const PatchShape* shape = NULL) {
+    if (isAdaptive || isFlatAdaptive) {
+        subdividepatch(patch, subdivisionSize, mono, shape);
+        appendtriangles(mesh, triangle_list);
+        triangle_list.clear();
+    }
+    else {
+        if (divisions > 0) {
+            subdividepatchgrid(patch, divisions, mono, columns, shape);
+        }
+        else {
+            subdividepatch(patch, subdivisionSize, mono, shape);
+        }
+        if (mesh.strip) {
+            appendgridstrip(mesh, patch_grid);
+        }
+        else {
+            appendgrid(mesh, patch_grid);
+        }
+    }
+}
+
+// Whole scene in the selected mode as one indexed mesh
+void buildscenemesh(Mesh& mesh) {
+    mesh.vertices.clear();
+    mesh.indices.clear();
+    // strips only come from the regular grids
+    mesh.strip = useStrips && !isAdaptive && !isFlatAdaptive && triangleBudget == 0;
+    if (triangleBudget > 0) {
+        budgettessellation(triangleBudget, subdivisionSize);
+        appendtriangles(mesh, budget_list);
+        return;
+    }
+    mesh.patchStarts.clear();
+    for (int i = 0; i < (int)surface_list.size(); i++) {
+        mesh.patchStarts.push_back(mesh.indices.size());
+        appendpatchmesh(mesh, surface_list[i], evaluatorof(i), patch_divisions.empty() ? 0 : patch_divisions[i],
+            patch_columns.empty() ? 0 : patch_columns[i], shapeof(i));
+    }
+}
+
+void drawmesh(const Vertex* vertices, const unsigned int* indices, int indexCount, bool strip = false) {
+    if (indexCount == 0) {
+        return;
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(Vertex), &vertices->x);
+    glNormalPointer(GL_FLOAT, sizeof(Vertex), &vertices->nx);
+    glDrawElements(strip ? GL_TRIANGLE_STRIP : GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, indices);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+// 64-bit FNV-1a
+unsigned long long hashbytes(const void* data, size_t size, unsigned long long h = 14695981039346656037ULL) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Everything that changes the tessellation goes into the key
+string cachefilename(const string& content) {
+    unsigned long long h = hashbytes(content.data(), content.size());
+    h = hashbytes(&subdivisionSize, sizeof(subdivisionSize), h);
+    bool modes[6] = { isAdaptive != 0, isFlatAdaptive, isMonomial, isOptimized, useStrips, isSpaced };
+    h = hashbytes(modes, sizeof(modes), h);
+    h = hashbytes(&triangleBudget, sizeof(triangleBudget), h);
+    h = hashbytes(&autoStepError, sizeof(autoStepError), h);
+    h = hashbytes(&TESSELLATION_VERSION, sizeof(TESSELLATION_VERSION), h);
+    char name[32];
+    sprintf(name, "%016llx.mesh", h);
+    return cacheDir + "/" + name;
+}
+
+// Drops least recently used entries until the directory fits cacheLimit
+void evictcache() {
+    vector<pair<long long, string> > entries; // (last use, path)
+    vector<long long> sizes;
+    long long total = 0;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE dir = FindFirstFileA((cacheDir + "/*.mesh").c_str(), &found);
+    if (dir != INVALID_HANDLE_VALUE) {
+        do {
+            long long size = ((long long)found.nFileSizeHigh << 32) | found.nFileSizeLow;
+            long long used = ((long long)found.ftLastWriteTime.dwHighDateTime << 32) | found.ftLastWriteTime.dwLowDateTime;
+            entries.push_back(make_pair(used, cacheDir + "/" + found.cFileName));
+            sizes.push_back(size);
+        } while (FindNextFileA(dir, &found));
+        FindClose(dir);
+    }
+#else
+    DIR* dir = opendir(cacheDir.c_str());
+    if (dir) {
+        while (dirent* e = readdir(dir)) {
+            string name(e->d_name);
+            if (name.size() < 5 || name.substr(name.size() - 5) != ".mesh") {
+                continue;
+            }
+            string path = cacheDir + "/" + name;
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0) {
+                entries.push_back(make_pair((long long)st.st_mtime, path));
+                sizes.push_back(st.st_size);
+            }
+        }
+        closedir(dir);
+    }
+#endif
+    vector<int> order(entries.size());
+    for (int i = 0; i < (int)order.size(); i++) {
+        order[i] = i;
+        total += sizes[i];
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) { return entries[a].first < entries[b].first; });
+    for (int i = 0; i < (int)order.size() && total > cacheLimit; i++) {
+        if (entries[order[i]].second == cachePath) {
+            continue;
+        }
+        remove(entries[order[i]].second.c_str());
+        total -= sizes[order[i]];
+        printf("Cache: evicted %s\n", entries[order[i]].second.c_str());
+    }
+}
+
+// Maps a cached mesh for this input and these settings. On a hit processFile
+// and subdividepatch never run.
+bool loadcachedscene(const char* file) {
+    double start = currentTime();
+    ifstream in(file, ios::binary);
+    if (!in.good()) {
+        return false;
+    }
+    string content((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    cachePath = cachefilename(content);
+    if (!cache_file.open(cachePath)) {
+        return false;
+    }
+    const MeshHeader* header = (const MeshHeader*)cache_file.data;
+    if (cache_file.size < sizeof(MeshHeader) || header->magic != MESH_MAGIC || header->version != TESSELLATION_VERSION
+        || cache_file.size != sizeof(MeshHeader) + header->vertexCount * sizeof(Vertex) + header->indexCount * sizeof(unsigned int)) {
+        cache_file.close();
+        return false;
+    }
+    mesh_vertices = (const Vertex*)(cache_file.data + sizeof(MeshHeader));
+    mesh_indices = (const unsigned int*)(mesh_vertices + header->vertexCount);
+    mesh_index_count = header->indexCount;
+    mesh_is_strip = header->strip != 0;
+#ifdef _WIN32
+    _utime(cachePath.c_str(), NULL);
+#else
+    utime(cachePath.c_str(), NULL);
+#endif
+    printf("Cache hit %s: %d triangles, warm startup %.1f ms\n", cachePath.c_str(),
+        mesh_index_count / 3, (currentTime() - start) * 1e3);
+    evictcache();
+    return true;
+}
+
+void usescenemesh() {
+    mesh_vertices = scene_mesh.vertices.empty() ? NULL : &scene_mesh.vertices[0];
+    mesh_indices = scene_mesh.indices.empty() ? NULL : &scene_mesh.indices[0];
+    mesh_index_count = scene_mesh.indices.size();
+    mesh_is_strip = scene_mesh.strip;
+}
+
+void optimizescenemesh(Mesh& mesh);
+
+void storecachedscene(double parseTime) {
+    double start = currentTime();
+    buildscenemesh(scene_mesh);
+    if (isOptimized) {
+        optimizescenemesh(scene_mesh);
+    }
+    double tessellateTime = currentTime() - start;
+    usescenemesh();
+
+#ifdef _WIN32
+    _mkdir(cacheDir.c_str());
+#else
+    mkdir(cacheDir.c_str(), 0755);
+#endif
+    start = currentTime();
+    string temp = cachePath + ".tmp";
+    ofstream out(temp.c_str(), ios::binary);
+    MeshHeader header = { MESH_MAGIC, TESSELLATION_VERSION, (unsigned int)scene_mesh.vertices.size(),
+        (unsigned int)scene_mesh.indices.size(), scene_mesh.strip };
+    out.write((const char*)&header, sizeof(header));
+    if (mesh_vertices) {
+        out.write((const char*)mesh_vertices, scene_mesh.vertices.size() * sizeof(Vertex));
+    }
+    if (mesh_indices) {
+        out.write((const char*)mesh_indices, scene_mesh.indices.size() * sizeof(unsigned int));
+    }
+    out.close();
+    remove(cachePath.c_str());
+    if (!out.good() || rename(temp.c_str(), cachePath.c_str()) != 0) {
+        remove(temp.c_str());
+        printf("Cache: could not write %s\n", cachePath.c_str());
+    }
+    double writeTime = currentTime() - start;
+    printf("Cache miss %s: %d triangles, cold startup %.1f ms (parse %.1f, tessellate %.1f, write %.1f)\n",
+        cachePath.c_str(), mesh_index_count / 3, (parseTime + tessellateTime + writeTime) * 1e3,
+        parseTime * 1e3, tessellateTime * 1e3, writeTime * 1e3);
+    evictcache();
+}
+
+//****************************************************
+// Patch deduplication and instancing (-instance)
+//****************************************************
+const float DEDUP_TOLERANCE = 1e-4f; // max control point difference in the patch frame
+const float DEDUP_HASH_GRID = 1e-2f;
+
+vector<Surface> prototype_list;
+vector<Mesh> prototype_meshes;
+vector<PatchInstance> instance_list;
+
+Vector difference(Point a, Point b) {
+    return Vector(a.x - b.x, a.y - b.y, a.z - b.z);
 }
 
-Vector::Vector(float a, float b, float c) {
-    x = a;
-    y = b;
-    z = c;
+// Frame built only from differences of control points, so rigidly moved
+// copies of a net get the same local coordinates. Always right-handed, so a
+// mirrored copy gets the same coordinates with z negated.
+void patchframe(const SubPatch& net, Vector& x, Vector& y, Vector& z) {
+    const int order[16][2] = { { 0, 3 }, { 3, 3 }, { 3, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 }, { 0, 2 }, { 2, 0 },
+        { 1, 2 }, { 2, 1 }, { 2, 2 }, { 1, 3 }, { 3, 1 }, { 2, 3 }, { 3, 2 }, { 0, 0 } };
+    Point origin = net.p[0][0];
+    x = Vector(1, 0, 0);
+    y = Vector(0, 1, 0);
+    int i = 0;
+    for (; i < 15; i++) {
+        Vector d = difference(net.p[order[i][0]][order[i][1]], origin);
+        if (dot(d, d) > DEDUP_TOLERANCE * DEDUP_TOLERANCE) {
+            x = d;
+            x.normalize();
+            break;
+        }
+    }
+    for (i++; i < 15; i++) {
+        Vector d = difference(net.p[order[i][0]][order[i][1]], origin);
+        Vector c = cross(x, d);
+        if (dot(c, c) > DEDUP_TOLERANCE * DEDUP_TOLERANCE) {
+            z = c;
+            z.normalize();
+            y = cross(z, x);
+            return;
+        }
+    }
+    // all control points collinear or coincident
+    z = cross(x, y);
+    if (dot(z, z) < 0.5f) {
+        y = Vector(0, 0, 1);
+        z = cross(x, y);
+    }
+    z.normalize();
+    y = cross(z, x);
+}
+
+// Key cell of a local net: its centroid on the DEDUP_HASH_GRID. Copies
+// differ by less than DEDUP_TOLERANCE, far below the grid, so a copy is
+// always in the same or a neighbouring cell.
+void centroidcell(const SubPatch& local, long long cell[3]) {
+    float c[3] = { 0, 0, 0 };
+    for (int k = 0; k < 4; k++) {
+        for (int j = 0; j < 4; j++) {
+            c[0] += local.p[k][j].x / 16;
+            c[1] += local.p[k][j].y / 16;
+            c[2] += local.p[k][j].z / 16;
+        }
+    }
+    for (int a = 0; a < 3; a++) {
+        cell[a] = (long long)floor(c[a] / DEDUP_HASH_GRID);
+    }
+}
+
+// Prototype matching `local` in its centroid's cell or one of the 26 around it
+int findprototype(const unordered_map<unsigned long long, vector<int> >& buckets, const vector<SubPatch>& locals,
+    const SubPatch& local) {
+    long long cell[3];
+    centroidcell(local, cell);
+    for (int n = 0; n < 27; n++) {
+        long long probe[3] = { cell[0] + n / 9 - 1, cell[1] + n / 3 % 3 - 1, cell[2] + n % 3 - 1 };
+        unordered_map<unsigned long long, vector<int> >::const_iterator found = buckets.find(hashbytes(probe, sizeof(probe)));
+        if (found == buckets.end()) {
+            continue;
+        }
+        const vector<int>& bucket = found->second;
+        for (int b = 0; b < (int)bucket.size(); b++) {
+            float diff = 0;
+            for (int k = 0; k < 4; k++) {
+                for (int j = 0; j < 4; j++) {
+                    const Point& p = locals[bucket[b]].p[k][j];
+                    const Point& q = local.p[k][j];
+                    diff = fmax(diff, fmax(fabs(p.x - q.x), fmax(fabs(p.y - q.y), fabs(p.z - q.z))));
+                }
+            }
+            if (diff < DEDUP_TOLERANCE) {
+                return bucket[b];
+            }
+        }
+    }
+    return -1;
+}
+
+// Net read in another parametrization: `symmetry` bit 0 reverses u, bit 1
+// reverses v, bit 2 swaps them. Returns whether the normal Pu x Pv flips.
+bool reparametrize(const SubPatch& net, int symmetry, SubPatch& out) {
+    for (int k = 0; k < 4; k++) {
+        for (int j = 0; j < 4; j++) {
+            int r = symmetry & 4 ? j : k, c = symmetry & 4 ? k : j;
+            out.p[k][j] = net.p[symmetry & 2 ? 3 - r : r][symmetry & 1 ? 3 - c : c];
+        }
+    }
+    return ((symmetry & 1) != 0) ^ ((symmetry & 2) != 0) ^ ((symmetry & 4) != 0);
+}
+
+// Finds rigid copies among surface_list, tessellates each distinct patch once
+// in its own frame and records every patch as an instance of one of them.
+// A copy may be mirrored and may run its parameters in another direction,
+// as the halves of the teapot's handle and spout do: each of the 8
+// parametrizations of the net is tried as it is and reflected. A mirror
+// image has the local coordinates of its source with z negated, because
+// patchframe is always right-handed, so it is drawn through a transform
+// with -z as its third axis. When the mirror and the reparametrization
+// together turn the normal around, the instance draws a copy of the
+// prototype mesh with reversed normals.
+void buildinstances() {
+    double start = currentTime();
+    unordered_map<unsigned long long, vector<int> > buckets;
+    vector<SubPatch> locals;
+    prototype_list.clear();
+    instance_list.clear();
+    vector<int> source; // surface index each prototype was taken from
+    vector<bool> reversedNormals(surface_list.size());
+    int mirrors = 0;
+
+    for (int i = 0; i < (int)surface_list.size(); i++) {
+        int prototype = -1;
+        Vector x, y, z;
+        Point origin;
+        SubPatch first;
+        for (int t = 0; t < 16 && prototype < 0; t++) {
+            int symmetry = t % 8;
+            bool mirror = t >= 8;
+            SubPatch net;
+            bool flipped = reparametrize(SubPatch(surface_list[i]), symmetry, net);
+            patchframe(net, x, y, z);
+            origin = net.p[0][0];
+            SubPatch local;
+            for (int k = 0; k < 4; k++) {
+                for (int j = 0; j < 4; j++) {
+                    Vector d = difference(net.p[k][j], origin);
+                    local.p[k][j] = Point(dot(d, x), dot(d, y), mirror ? -dot(d, z) : dot(d, z));
+                }
+            }
+            if (t == 0) {
+                first = local;
+            }
+            prototype = findprototype(buckets, locals, local);
+            if (prototype >= 0) {
+                if (mirror) {
+                    z = z.scalarMult(-1);
+                    mirrors++;
+                }
+                reversedNormals[i] = flipped != mirror;
+            }
+        }
+        if (prototype < 0) {
+            // a new prototype, in the patch's own parametrization
+            SubPatch net(surface_list[i]);
+            patchframe(net, x, y, z);
+            origin = net.p[0][0];
+            prototype = locals.size();
+            long long cell[3];
+            centroidcell(first, cell);
+            buckets[hashbytes(cell, sizeof(cell))].push_back(prototype);
+            locals.push_back(first);
+            source.push_back(i);
+            Curve rows[4];
+            for (int k = 0; k < 4; k++) {
+                rows[k] = Curve(first.p[k][0], first.p[k][1], first.p[k][2], first.p[k][3]);
+            }
+            prototype_list.push_back(Surface(rows[0], rows[1], rows[2], rows[3]));
+        }
+
+        PatchInstance instance;
+        instance.prototype = prototype;
+        float m[16] = { x.x, x.y, x.z, 0, y.x, y.y, y.z, 0, z.x, z.y, z.z, 0, origin.x, origin.y, origin.z, 1 };
+        copy(m, m + 16, instance.transform);
+        instance_list.push_back(instance);
+    }
+    double dedupTime = currentTime() - start;
+
+    start = currentTime();
+    prototype_meshes.assign(prototype_list.size(), Mesh());
+    long long uniqueBytes = 0, fullBytes = 0;
+    for (int i = 0; i < (int)prototype_list.size(); i++) {
+        MonomialPatch mono(prototype_list[i]);
+        const PatchShape* shape = shapeof(source[i]);
+        appendpatchmesh(prototype_meshes[i], prototype_list[i], isMonomial || isreduced(shape) ? &mono : NULL,
+            patch_divisions.empty() ? 0 : patch_divisions[source[i]],
+            patch_columns.empty() ? 0 : patch_columns[source[i]], shape);
+    }
+    vector<int> reversed(prototype_list.size(), -1);
+    for (int i = 0; i < (int)instance_list.size(); i++) {
+        if (!reversedNormals[i]) {
+            continue;
+        }
+        int& r = reversed[instance_list[i].prototype];
+        if (r < 0) {
+            r = prototype_meshes.size();
+            prototype_meshes.push_back(prototype_meshes[instance_list[i].prototype]);
+            vector<Vertex>& vertices = prototype_meshes.back().vertices;
+            for (int v = 0; v < (int)vertices.size(); v++) {
+                vertices[v].nx = -vertices[v].nx;
+                vertices[v].ny = -vertices[v].ny;
+                vertices[v].nz = -vertices[v].nz;
+            }
+        }
+        instance_list[i].prototype = r;
+    }
+    for (int i = 0; i < (int)prototype_meshes.size(); i++) {
+        uniqueBytes += prototype_meshes[i].vertices.size() * sizeof(Vertex) + prototype_meshes[i].indices.size() * sizeof(unsigned int);
+    }
+    for (int i = 0; i < (int)instance_list.size(); i++) {
+        Mesh& m = prototype_meshes[instance_list[i].prototype];
+        fullBytes += m.vertices.size() * sizeof(Vertex) + m.indices.size() * sizeof(unsigned int);
+    }
+    printf("Instancing: %d patches -> %d unique, %d mirrored copies (dedup %.1f ms), tessellated in %.1f ms\n",
+        (int)surface_list.size(), (int)prototype_list.size(), mirrors, dedupTime * 1e3, (currentTime() - start) * 1e3);
+    printf("  mesh memory %.1f KB instead of %.1f KB\n", uniqueBytes / 1024.0, fullBytes / 1024.0);
+}
+
+void drawinstances() {
+    for (int i = 0; i < (int)instance_list.size(); i++) {
+        Mesh& m = prototype_meshes[instance_list[i].prototype];
+        if (m.indices.empty()) {
+            continue;
+        }
+        glPushMatrix();
+        glMultMatrixf(instance_list[i].transform);
+        drawmesh(&m.vertices[0], &m.indices[0], m.indices.size(), m.strip);
+        glPopMatrix();
+    }
+}
+
+//****************************************************
+// Vertex cache optimization (-optimize) and strips (-strips)
+//****************************************************
+const int VERTEX_CACHE_SIZE = 32; // Forsyth's simulated LRU cache
+const int ACMR_FIFO_SIZE = 16;    // post-transform cache size used for the report
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO cache
+float acmr(const vector<unsigned int>& indices, bool strip, int cacheSize) {
+    vector<unsigned int> fifo(cacheSize, 0xffffffffu);
+    int head = 0, misses = 0, triangles = 0;
+    for (int i = 0; i < (int)indices.size(); i++) {
+        unsigned int v = indices[i];
+        if (find(fifo.begin(), fifo.end(), v) == fifo.end()) {
+            fifo[head] = v;
+            head = (head + 1) % cacheSize;
+            misses++;
+        }
+        if (strip && i >= 2 && indices[i] != indices[i - 1] && indices[i] != indices[i - 2] && indices[i - 1] != indices[i - 2]) {
+            triangles++;
+        }
+    }
+    if (!strip) {
+        triangles = indices.size() / 3;
+    }
+    return triangles ? (float)misses / triangles : 0;
+}
+
+// Merges bitwise identical vertices, the adaptive modes emit three per triangle
+void weldmesh(Mesh& mesh) {
+    unordered_map<unsigned long long, vector<unsigned int> > buckets;
+    vector<Vertex> welded;
+    vector<unsigned int> remap(mesh.vertices.size());
+    for (int i = 0; i < (int)mesh.vertices.size(); i++) {
+        const Vertex& v = mesh.vertices[i];
+        vector<unsigned int>& bucket = buckets[hashbytes(&v, sizeof(Vertex))];
+        int found = -1;
+        for (int b = 0; b < (int)bucket.size() && found < 0; b++) {
+            if (memcmp(&welded[bucket[b]], &v, sizeof(Vertex)) == 0) {
+                found = bucket[b];
+            }
+        }
+        if (found < 0) {
+            found = welded.size();
+            bucket.push_back(found);
+            welded.push_back(v);
+        }
+        remap[i] = found;
+    }
+    for (int i = 0; i < (int)mesh.indices.size(); i++) {
+        mesh.indices[i] = remap[mesh.indices[i]];
+    }
+    mesh.vertices.swap(welded);
+}
+
+float forsythscore(int cachePosition, int remaining) {
+    if (remaining == 0) {
+        return -1;
+    }
+    float score = 0;
+    if (cachePosition >= 0) {
+        // the last triangle's vertices get a fixed score so the next one does not reuse them too eagerly
+        score = cachePosition < 3 ? 0.75f : pow(1 - (cachePosition - 3) / (float)(VERTEX_CACHE_SIZE - 3), 1.5f);
+    }
+    return score + 2.0f / sqrt((float)remaining);
+}
+
+// Tom Forsyth's linear-speed vertex cache optimization of a triangle list
+void optimizevertexcache(Mesh& mesh) {
+    int vertexCount = mesh.vertices.size();
+    int triangleCount = mesh.indices.size() / 3;
+    vector<int> remaining(vertexCount, 0), offset(vertexCount + 1, 0), cachePosition(vertexCount, -1);
+    for (int i = 0; i < (int)mesh.indices.size(); i++) {
+        remaining[mesh.indices[i]]++;
+    }
+    for (int v = 0; v < vertexCount; v++) {
+        offset[v + 1] = offset[v] + remaining[v];
+    }
+    vector<int> adjacency(mesh.indices.size()), fill(offset.begin(), offset.end() - 1);
+    for (int t = 0; t < triangleCount; t++) {
+        for (int c = 0; c < 3; c++) {
+            adjacency[fill[mesh.indices[3 * t + c]]++] = t;
+        }
+    }
+    vector<float> vertexScore(vertexCount), triangleScore(triangleCount, 0);
+    for (int v = 0; v < vertexCount; v++) {
+        vertexScore[v] = forsythscore(-1, remaining[v]);
+    }
+    for (int t = 0; t < triangleCount; t++) {
+        for (int c = 0; c < 3; c++) {
+            triangleScore[t] += vertexScore[mesh.indices[3 * t + c]];
+        }
+    }
+
+    vector<bool> added(triangleCount, false);
+    vector<unsigned int> output;
+    output.reserve(mesh.indices.size());
+    vector<int> cache, next;
+    int best = -1, scan = 0;
+    for (int emitted = 0; emitted < triangleCount; emitted++) {
+        if (best < 0) {
+            // nothing useful in the cache, take the best triangle overall
+            float bestScore = -1;
+            for (int t = scan; t < triangleCount; t++) {
+                if (!added[t] && triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+            while (scan < triangleCount && added[scan]) {
+                scan++;
+            }
+        }
+        added[best] = true;
+
+        // move the triangle's vertices to the front of the cache
+        next.clear();
+        for (int c = 0; c < 3; c++) {
+            int v = mesh.indices[3 * best + c];
+            output.push_back(v);
+            next.push_back(v);
+            for (int a = offset[v]; a < offset[v] + remaining[v]; a++) {
+                if (adjacency[a] == best) {
+                    adjacency[a] = adjacency[offset[v] + remaining[v] - 1];
+                    remaining[v]--;
+                    break;
+                }
+            }
+        }
+        for (int i = 0; i < (int)cache.size(); i++) {
+            if (find(next.begin(), next.end(), cache[i]) == next.end()) {
+                next.push_back(cache[i]);
+            }
+        }
+        for (int i = 0; i < (int)next.size(); i++) {
+            cachePosition[next[i]] = i < VERTEX_CACHE_SIZE ? i : -1;
+        }
+
+        // rescore the cached vertices and pick the best triangle touching them
+        best = -1;
+        float bestScore = -1;
+        for (int i = 0; i < (int)next.size(); i++) {
+            int v = next[i];
+            float score = forsythscore(cachePosition[v], remaining[v]);
+            float delta = score - vertexScore[v];
+            vertexScore[v] = score;
+            for (int a = offset[v]; a < offset[v] + remaining[v]; a++) {
+                int t = adjacency[a];
+                triangleScore[t] += delta;
+                if (triangleScore[t] > bestScore) {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+        }
+        if (next.size() > VERTEX_CACHE_SIZE) {
+            next.resize(VERTEX_CACHE_SIZE);
+        }
+        cache.swap(next);
+    }
+    mesh.indices.swap(output);
+}
+
+// Renumbers vertices in order of first use so fetches walk memory forward
+void reordervertices(Mesh& mesh) {
+    vector<unsigned int> remap(mesh.vertices.size(), 0xffffffffu);
+    vector<Vertex> ordered;
+    ordered.reserve(mesh.vertices.size());
+    for (int i = 0; i < (int)mesh.indices.size(); i++) {
+        unsigned int& index = mesh.indices[i];
+        if (remap[index] == 0xffffffffu) {
+            remap[index] = ordered.size();
+            ordered.push_back(mesh.vertices[index]);
+        }
+        index = remap[index];
+    }
+    mesh.vertices.swap(ordered);
+}
+
+void optimizescenemesh(Mesh& mesh) {
+    double start = currentTime();
+    if (mesh.strip) {
+        // already ordered for the cache when the bands were built
+        reordervertices(mesh);
+        printf("Vertex cache: %d vertices, %d indices as banded strips, ACMR (FIFO %d) %.3f\n", (int)mesh.vertices.size(),
+            (int)mesh.indices.size(), ACMR_FIFO_SIZE, acmr(mesh.indices, true, ACMR_FIFO_SIZE));
+        return;
+    }
+    int before = mesh.vertices.size();
+    weldmesh(mesh);
+    float acmrBefore = acmr(mesh.indices, false, ACMR_FIFO_SIZE);
+    optimizevertexcache(mesh);
+    mesh.patchStarts.clear();
+    reordervertices(mesh);
+    float acmrAfter = acmr(mesh.indices, false, ACMR_FIFO_SIZE);
+    printf("Vertex cache: %d vertices (%d before welding), %d indices\n", (int)mesh.vertices.size(), before,
+        (int)mesh.indices.size());
+    printf("  ACMR (FIFO %d) %.3f -> %.3f, %.1f ms\n", ACMR_FIFO_SIZE, acmrBefore, acmrAfter, (currentTime() - start) * 1e3);
+}
+
+//****************************************************
+// Quantized vertex compression (-pack)
+//****************************************************
+PackedMesh packed_mesh;
+const int PACK_GROUP_VERTICES = 1024; // small patches share a group until it has this many vertices
+
+inline short snorm16(float x) {
+    return (short)floor(fmin(fmax(x, -1.0f), 1.0f) * 32767.0f + 0.5f);
+}
+
+// Degenerate (zero or NaN) normals become +z
+void packnormal(float x, float y, float z, PackedVertex& p) {
+    float l = sqrt(x * x + y * y + z * z);
+    if (!(l > 0)) {
+        x = 0;
+        y = 0;
+        z = 1;
+        l = 1;
+    }
+    p.nx = snorm16(x / l);
+    p.ny = snorm16(y / l);
+    p.nz = snorm16(z / l);
+}
+
+// What GL computes from the arrays, for the error report
+void unpackvertex(const PackedGroup& g, const PackedVertex& p, Vertex& v) {
+    v.x = g.center[0] + p.x * g.scale;
+    v.y = g.center[1] + p.y * g.scale;
+    v.z = g.center[2] + p.z * g.scale;
+    float nx = p.nx / 32767.0f, ny = p.ny / 32767.0f, nz = p.nz / 32767.0f;
+    float l = sqrt(nx * nx + ny * ny + nz * nz);
+    v.nx = nx / l;
+    v.ny = ny / l;
+    v.nz = nz / l;
+    v.u = 0;
+    v.v = 0;
+}
+
+// Closes the group holding triangles [first, end) of mesh
+void packgroup(const Mesh& mesh, int first, int end, PackedMesh& out, vector<int>& local, vector<unsigned int>& used) {
+    PackedGroup g;
+    g.firstVertex = out.vertices.size();
+    g.firstIndex = out.indices.size();
+    float lo[3] = { 1e30f, 1e30f, 1e30f }, hi[3] = { -1e30f, -1e30f, -1e30f };
+    for (int i = 0; i < (int)used.size(); i++) {
+        const Vertex& v = mesh.vertices[used[i]];
+        float p[3] = { v.x, v.y, v.z };
+        for (int c = 0; c < 3; c++) {
+            lo[c] = fmin(lo[c], p[c]);
+            hi[c] = fmax(hi[c], p[c]);
+        }
+    }
+    // one scale for all axes, so the modelview scale leaves normals unskewed
+    float half = 0;
+    for (int c = 0; c < 3; c++) {
+        g.center[c] = (lo[c] + hi[c]) * 0.5f;
+        half = fmax(half, (hi[c] - lo[c]) * 0.5f);
+    }
+    g.scale = half > 0 ? half / 32767.0f : 1.0f;
+    for (int i = 0; i < (int)used.size(); i++) {
+        const Vertex& v = mesh.vertices[used[i]];
+        PackedVertex p;
+        p.x = snorm16((v.x - g.center[0]) / (32767.0f * g.scale));
+        p.y = snorm16((v.y - g.center[1]) / (32767.0f * g.scale));
+        p.z = snorm16((v.z - g.center[2]) / (32767.0f * g.scale));
+        packnormal(v.nx, v.ny, v.nz, p);
+        out.vertices.push_back(p);
+    }
+    for (int i = first; i < end; i++) {
+        out.indices.push_back(local[mesh.indices[i]]);
+    }
+    g.vertexCount = used.size();
+    g.indexCount = end - first;
+    out.groups.push_back(g);
+    for (int i = 0; i < (int)used.size(); i++) {
+        local[used[i]] = -1;
+    }
+    used.clear();
+}
+
+// Splits a triangle list into groups at patch starts (when known) once a group
+// has PACK_GROUP_VERTICES, so the group headers stay a small share of the mesh,
+// and before a group would need more than 16-bit indices
+void packmesh(const Mesh& mesh, PackedMesh& out) {
+    out.vertices.clear();
+    out.indices.clear();
+    out.groups.clear();
+    vector<int> local(mesh.vertices.size(), -1);
+    vector<unsigned int> used;
+    int patch = 1, first = 0;
+    for (int t = 0; t < (int)mesh.indices.size(); t += 3) {
+        bool patchEnd = patch < (int)mesh.patchStarts.size() && t >= (int)mesh.patchStarts[patch];
+        while (patch < (int)mesh.patchStarts.size() && t >= (int)mesh.patchStarts[patch]) {
+            patch++;
+        }
+        if ((patchEnd && (int)used.size() >= PACK_GROUP_VERTICES) || used.size() + 3 > 65536) {
+            packgroup(mesh, first, t, out, local, used);
+            first = t;
+        }
+        for (int c = 0; c < 3; c++) {
+            unsigned int index = mesh.indices[t + c];
+            if (local[index] < 0) {
+                local[index] = used.size();
+                used.push_back(index);
+            }
+        }
+    }
+    if (!used.empty()) {
+        packgroup(mesh, first, mesh.indices.size(), out, local, used);
+    }
+}
+
+void reportpacking(const Mesh& mesh, const PackedMesh& packed) {
+    float maxError = 0, maxAngle = 0, diagonal = 0;
+    for (int gi = 0; gi < (int)packed.groups.size(); gi++) {
+        const PackedGroup& g = packed.groups[gi];
+        for (int i = g.firstIndex; i < (int)(g.firstIndex + g.indexCount); i++) {
+            const Vertex& a = mesh.vertices[mesh.indices[i]];
+            Vertex b;
+            unpackvertex(g, packed.vertices[g.firstVertex + packed.indices[i]], b);
+            maxError = fmax(maxError, Point(a.x, a.y, a.z).distance(Point(b.x, b.y, b.z)));
+            float d = a.nx * b.nx + a.ny * b.ny + a.nz * b.nz;
+            // zero and NaN normals have no direction to preserve
+            if (d == d && a.nx * a.nx + a.ny * a.ny + a.nz * a.nz > 0.5f) {
+                maxAngle = fmax(maxAngle, acos(fmin(d, 1.0f)) * 180 / PI);
+            }
+        }
+        diagonal = fmax(diagonal, 2 * 32767 * g.scale * sqrt(3.0f));
+    }
+    long long fullBytes = mesh.vertices.size() * sizeof(Vertex) + mesh.indices.size() * sizeof(unsigned int);
+    long long packedBytes = packed.vertices.size() * sizeof(PackedVertex) + packed.indices.size() * sizeof(unsigned short)
+        + packed.groups.size() * sizeof(PackedGroup);
+    printf("Packed mesh: %d groups, %.1f KB instead of %.1f KB (%.2fx)\n", (int)packed.groups.size(),
+        packedBytes / 1024.0, fullBytes / 1024.0, (double)fullBytes / packedBytes);
+    printf("  max position error %g (largest group diagonal %g), max normal error %.3f degrees\n",
+        maxError, diagonal, maxAngle);
+}
+
+// Drawn straight from the packed arrays: GL maps the normal shorts to
+// [-1, 1] itself, and each group's translate and uniform scale on the
+// modelview place its positions. The scale shrinks the lit normals, so
+// they are renormalized.
+void drawpackedmesh(const PackedMesh& packed) {
+    glPushAttrib(GL_ENABLE_BIT);
+    glEnable(GL_NORMALIZE);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    for (int gi = 0; gi < (int)packed.groups.size(); gi++) {
+        const PackedGroup& g = packed.groups[gi];
+        const PackedVertex* first = &packed.vertices[g.firstVertex];
+        glPushMatrix();
+        glTranslatef(g.center[0], g.center[1], g.center[2]);
+        glScalef(g.scale, g.scale, g.scale);
+        glVertexPointer(3, GL_SHORT, sizeof(PackedVertex), &first->x);
+        glNormalPointer(GL_SHORT, sizeof(PackedVertex), &first->nx);
+        glDrawElements(GL_TRIANGLES, g.indexCount, GL_UNSIGNED_SHORT, &packed.indices[g.firstIndex]);
+        glPopMatrix();
+    }
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPopAttrib();
+}
+
+//****************************************************
+// Binary PLY / glTF export (-export <file.ply|file.glb>)
+//****************************************************
+const int EXPORT_CHUNK_PATCHES = 16; // patches tessellated per chunk handed to the writer
+const int EXPORT_CHUNK_TRIANGLES = 4096; // adaptive triangles per chunk, pulled from the generator
+const int EXPORT_QUEUE_DEPTH = 4;    // chunks in flight before tessellation waits
+const int GLB_JSON_RESERVE = 2048;   // JSON is written last into this space
+
+// Writes tessellated chunks on its own thread while the next chunk is built.
+// Vertices stream straight to the file; both formats want all vertices before
+// any index, so indices (rebased) are kept until finish().
+class MeshWriter {
+public:
+    FILE* file;
+    bool glb;
+    unsigned int vertexCount;
+    vector<unsigned int> indices;
+    float lo[3], hi[3];
+    long long bytes;
+    double busy;
+
+    deque<Mesh*> queue;
+    mutex lock;
+    condition_variable changed;
+    bool done;
+    thread worker;
+
+    MeshWriter() : file(NULL), glb(false), vertexCount(0), bytes(0), busy(0), done(false) {}
+
+    bool open(const string& path) {
+        glb = path.size() > 4 && path.substr(path.size() - 4) == ".glb";
+        file = fopen(path.c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+        setvbuf(file, NULL, _IOFBF, 1 << 22);
+        for (int c = 0; c < 3; c++) {
+            lo[c] = 1e30f;
+            hi[c] = -1e30f;
+        }
+        // placeholders, rewritten with the real counts by finish()
+        vector<char> header(glb ? 12 + 8 + GLB_JSON_RESERVE + 8 : plyheader(0, 0).size(), ' ');
+        fwrite(&header[0], 1, header.size(), file);
+        worker = thread(&MeshWriter::run, this);
+        return true;
+    }
+
+    string plyheader(unsigned int vertices, unsigned int faces) {
+        char buf[512];
+        sprintf(buf, "ply\nformat binary_little_endian 1.0\ncomment BezierSurfaces\n"
+            "element vertex %010u\nproperty float x\nproperty float y\nproperty float z\n"
+            "property float nx\nproperty float ny\nproperty float nz\nproperty float s\nproperty float t\n"
+            "element face %010u\nproperty list uchar uint vertex_indices\nend_header\n", vertices, faces);
+        return buf;
+    }
+
+    // Blocks while EXPORT_QUEUE_DEPTH chunks are waiting; takes ownership
+    void push(Mesh* chunk) {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&]() { return queue.size() < EXPORT_QUEUE_DEPTH; });
+        queue.push_back(chunk);
+        changed.notify_all();
+    }
+
+    void run() {
+        while (true) {
+            Mesh* chunk;
+            {
+                unique_lock<mutex> guard(lock);
+                changed.wait(guard, [&]() { return done || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                chunk = queue.front();
+                queue.pop_front();
+                changed.notify_all();
+            }
+            double start = currentTime();
+            write(*chunk);
+            busy += currentTime() - start;
+            delete chunk;
+        }
+    }
+
+    void write(Mesh& chunk) {
+        for (int i = 0; i < (int)chunk.vertices.size(); i++) {
+            Vertex& v = chunk.vertices[i];
+            // collapsed corners have no normal, readers want unit vectors
+            if (!(v.nx * v.nx + v.ny * v.ny + v.nz * v.nz > 0.5f)) {
+                v.nx = 0;
+                v.ny = 0;
+                v.nz = 1;
+            }
+            float p[3] = { v.x, v.y, v.z };
+            for (int c = 0; c < 3; c++) {
+                lo[c] = fmin(lo[c], p[c]);
+                hi[c] = fmax(hi[c], p[c]);
+            }
+        }
+        if (!chunk.vertices.empty()) {
+            fwrite(&chunk.vertices[0], sizeof(Vertex), chunk.vertices.size(), file);
+        }
+        for (int i = 0; i < (int)chunk.indices.size(); i++) {
+            indices.push_back(vertexCount + chunk.indices[i]);
+        }
+        vertexCount += chunk.vertices.size();
+        bytes += chunk.vertices.size() * sizeof(Vertex);
+    }
+
+    void finish() {
+        {
+            lock_guard<mutex> guard(lock);
+            done = true;
+            changed.notify_all();
+        }
+        worker.join();
+        double start = currentTime();
+        unsigned int triangles = indices.size() / 3;
+        if (glb) {
+            if (!indices.empty()) {
+                fwrite(&indices[0], sizeof(unsigned int), indices.size(), file);
+            }
+            bytes += indices.size() * sizeof(unsigned int);
+            unsigned int vertexBytes = vertexCount * sizeof(Vertex);
+            unsigned int indexBytes = indices.size() * sizeof(unsigned int);
+            char json[GLB_JSON_RESERVE + 1];
+            int n = sprintf(json, "{\"asset\":{\"version\":\"2.0\",\"generator\":\"BezierSurfaces\"},"
+                "\"scene\":0,\"scenes\":[{\"nodes\":[0]}],\"nodes\":[{\"mesh\":0}],"
+                "\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2},\"indices\":3}]}],"
+                "\"buffers\":[{\"byteLength\":%u}],"
+                "\"bufferViews\":[{\"buffer\":0,\"byteOffset\":0,\"byteLength\":%u,\"byteStride\":%d,\"target\":34962},"
+                "{\"buffer\":0,\"byteOffset\":%u,\"byteLength\":%u,\"target\":34963}],"
+                "\"accessors\":[{\"bufferView\":0,\"byteOffset\":0,\"componentType\":5126,\"count\":%u,\"type\":\"VEC3\","
+                "\"min\":[%g,%g,%g],\"max\":[%g,%g,%g]},"
+                "{\"bufferView\":0,\"byteOffset\":12,\"componentType\":5126,\"count\":%u,\"type\":\"VEC3\"},"
+                "{\"bufferView\":0,\"byteOffset\":24,\"componentType\":5126,\"count\":%u,\"type\":\"VEC2\"},"
+                "{\"bufferView\":1,\"byteOffset\":0,\"componentType\":5125,\"count\":%u,\"type\":\"SCALAR\"}]}",
+                vertexBytes + indexBytes, vertexBytes, (int)sizeof(Vertex), vertexBytes, indexBytes,
+                vertexCount, lo[0], lo[1], lo[2], hi[0], hi[1], hi[2], vertexCount, vertexCount, (unsigned int)indices.size());
+            memset(json + n, ' ', GLB_JSON_RESERVE - n);
+            unsigned int header[5] = { 0x46546c67, 2, (unsigned int)(12 + 8 + GLB_JSON_RESERVE + 8 + vertexBytes + indexBytes),
+                GLB_JSON_RESERVE, 0x4e4f534a };
+            unsigned int binHeader[2] = { vertexBytes + indexBytes, 0x004e4942 };
+            fseek(file, 0, SEEK_SET);
+            fwrite(header, sizeof(header), 1, file);
+            fwrite(json, 1, GLB_JSON_RESERVE, file);
+            fwrite(binHeader, sizeof(binHeader), 1, file);
+        }
+        else {
+            // faces as (uchar 3, uint a, uint b, uint c) records, built in large blocks
+            vector<unsigned char> block;
+            block.reserve(13 * 65536);
+            for (int t = 0; t < (int)triangles; t++) {
+                block.push_back(3);
+                block.insert(block.end(), (unsigned char*)&indices[3 * t], (unsigned char*)&indices[3 * t + 3]);
+                if (block.size() >= 13 * 65536 || t + 1 == (int)triangles) {
+                    fwrite(&block[0], 1, block.size(), file);
+                    bytes += block.size();
+                    block.clear();
+                }
+            }
+            string header = plyheader(vertexCount, triangles);
+            fseek(file, 0, SEEK_SET);
+            fwrite(header.data(), 1, header.size(), file);
+        }
+        fclose(file);
+        busy += currentTime() - start;
+    }
+};
+
+void exportmesh(const string& path) {
+    MeshWriter writer;
+    if (!writer.open(path)) {
+        printf("Could not open %s\n", path.c_str());
+        return;
+    }
+    double start = currentTime();
+    if (triangleBudget > 0) {
+        Mesh* chunk = new Mesh();
+        buildscenemesh(*chunk);
+        chunk->strip = false;
+        writer.push(chunk);
+    }
+    else if (isAdaptive && !isFlatAdaptive && !surface_list.empty()) {
+        AdaptiveTriangles generator(&surface_list[0], surface_list.size(), subdivisionSize,
+            isMonomial ? &monomial_list[0] : NULL, patch_shapes.empty() ? NULL : &patch_shapes[0]);
+        vector<Triangle> batch(EXPORT_CHUNK_TRIANGLES);
+        for (int n = generator.next(&batch[0], EXPORT_CHUNK_TRIANGLES); n > 0;
+            n = generator.next(&batch[0], EXPORT_CHUNK_TRIANGLES)) {
+            Mesh* chunk = new Mesh();
+            batch.resize(n);
+            appendtriangles(*chunk, batch);
+            batch.resize(EXPORT_CHUNK_TRIANGLES);
+            writer.push(chunk);
+        }
+    }
+    else {
+        for (int first = 0; first < (int)surface_list.size(); first += EXPORT_CHUNK_PATCHES) {
+            Mesh* chunk = new Mesh();
+            int last = min(first + EXPORT_CHUNK_PATCHES, (int)surface_list.size());
+            for (int i = first; i < last; i++) {
+                appendpatchmesh(*chunk, surface_list[i], evaluatorof(i), patch_divisions.empty() ? 0 : patch_divisions[i],
+                    patch_columns.empty() ? 0 : patch_columns[i], shapeof(i));
+            }
+            writer.push(chunk);
+        }
+    }
+    writer.finish();
+    double total = currentTime() - start;
+    printf("Exported %s: %u vertices, %d triangles, %.1f MB\n", path.c_str(), writer.vertexCount,
+        (int)writer.indices.size() / 3, writer.bytes / 1048576.0);
+    printf("  %.1f ms total, writer busy %.1f ms: %.1f MB/s written, %.1f MB/s end to end\n", total * 1e3,
+        writer.busy * 1e3, writer.bytes / 1048576.0 / fmax(writer.busy, 1e-9), writer.bytes / 1048576.0 / fmax(total, 1e-9));
+}
+
+//****************************************************
+// Surface sampling (-sample): area-weighted points with
+// normals, written as a point PLY (no faces)
+//****************************************************
+const int SAMPLE_CHUNK_POINTS = 65536;
+const float POISSON_PACKING = 0.55f; // first disk radius r = sqrt(packing * area / count)
+const int POISSON_CANDIDATES = 8;    // uniform candidates per requested point
+const int POISSON_ROUNDS = 6;        // radius reductions tried before reporting a shortfall
+const float POISSON_SHRINK = 0.97f;  // margin on the radius each round aims for
+
+void samplesurfaces(const string& path) {
+    if (surface_list.empty()) {
+        printf("No patches to sample\n");
+        return;
+    }
+    int threads = max(1, (int)thread::hardware_concurrency());
+    double start = currentTime();
+    SurfaceSampler sampler(&surface_list[0], surface_list.size(), threads);
+    double built = currentTime() - start;
+    printf("Sampler: %d patches, area %g, %d cells per patch, %.0f%% acceptance, %.1f ms\n", (int)surface_list.size(),
+        sampler.area, SAMPLER_GRID * SAMPLER_GRID, sampler.envelope > 0 ? 100 * sampler.area / sampler.envelope : 0.0,
+        built * 1e3);
+
+    vector<SurfaceSample> samples;
+    long long forced;
+    start = currentTime();
+    if (isPoisson) {
+        // a thinned set rarely reaches the packing estimate, so the radius shrinks by the
+        // square root of the shortfall until enough points are kept; the kept points are
+        // in candidate order, a random order, so any prefix is still a disk set
+        float radius = (float)sqrt(POISSON_PACKING * sampler.area / max(1LL, sampleCount));
+        long long candidates = sampleCount * POISSON_CANDIDATES;
+        int round = 0;
+        forced = sampler.poissonsamples(sampleSeed, radius, candidates, threads, samples);
+        while ((long long)samples.size() < sampleCount && round < POISSON_ROUNDS) {
+            printf("  radius %g kept %d, shrinking\n", radius, (int)samples.size());
+            radius *= POISSON_SHRINK * (float)sqrt(max(1.0, (double)samples.size()) / sampleCount);
+            forced = sampler.poissonsamples(sampleSeed, radius, candidates, threads, samples);
+            round++;
+        }
+        int kept = samples.size();
+        if ((long long)samples.size() > sampleCount) {
+            samples.resize(sampleCount);
+        }
+        double elapsed = currentTime() - start;
+        printf("Poisson-disk: radius %g, %d of %d requested points from %lld candidates (%d kept, %d rounds),"
+            " %.1f ms, %.0f candidates/s\n", radius, (int)samples.size(), (int)sampleCount, candidates, kept,
+            round + 1, elapsed * 1e3, candidates * (round + 1) / fmax(elapsed, 1e-9));
+        if ((long long)samples.size() < sampleCount) {
+            printf("  short by %d points after %d rounds\n", (int)(sampleCount - samples.size()), round + 1);
+        }
+    }
+    else {
+        forced = sampler.uniformsamples(sampleSeed, sampleCount, threads, samples);
+        double elapsed = currentTime() - start;
+        printf("Uniform: %d samples, %.1f ms, %.0f samples/s\n", (int)samples.size(), elapsed * 1e3,
+            samples.size() / fmax(elapsed, 1e-9));
+    }
+    printf("  seed %llu, %d threads, %lld forced accepts\n", sampleSeed, threads, forced);
+
+    MeshWriter writer;
+    if (!writer.open(path)) {
+        printf("Could not open %s\n", path.c_str());
+        return;
+    }
+    start = currentTime();
+    for (int first = 0; first < (int)samples.size(); first += SAMPLE_CHUNK_POINTS) {
+        Mesh* chunk = new Mesh();
+        int last = min(first + SAMPLE_CHUNK_POINTS, (int)samples.size());
+        for (int i = first; i < last; i++) {
+            chunk->vertices.push_back(samples[i].vertex);
+        }
+        writer.push(chunk);
+    }
+    writer.finish();
+    printf("Wrote %s: %u points, %.1f MB in %.1f ms\n", path.c_str(), writer.vertexCount, writer.bytes / 1048576.0,
+        (currentTime() - start) * 1e3);
+}
+
+//****************************************************
+// Out-of-core scenes (.bezc): a background thread loads and
+// tessellates the chunks in view, nearest first, within
+// -budget; chunks out of view are evicted farthest first
+//****************************************************
+const int CHUNK_UNLOADED = 0;
+const int CHUNK_QUEUED = 1;   // waiting for the loader or being loaded
+const int CHUNK_RESIDENT = 2;
+const int CHUNK_PATCHES = 4096; // default patches per chunk for -chunk
+const int STREAM_GUESS_DIVISIONS = 8; // adaptive mesh size guess until chunks are measured
+
+ChunkedScene chunked_scene;
+vector<StreamedChunk> stream_chunks;
+bool isStreaming;
+long long streamBudget = 256LL << 20;
+long long streamResident;
+long long streamLoadedPatches;  // adaptive meshes: measured bytes per patch
+long long streamLoadedBytes;
+deque<int> stream_queue;       // nearest first, shared with the loader
+deque<pair<int, Mesh*> > stream_loaded;
+int streamInFlight = -1;
+mutex stream_lock;
+condition_variable stream_wake, stream_done;
+thread stream_loader;
+bool streamStopping;
+double streamReported;
+
+long long meshbytes(const Mesh& mesh) {
+    return mesh.vertices.capacity() * sizeof(Vertex) + mesh.indices.capacity() * sizeof(unsigned int);
+}
+
+long long chunkestimate(int chunk) {
+    if (stream_chunks[chunk].state == CHUNK_RESIDENT) {
+        return stream_chunks[chunk].bytes;
+    }
+    if (isAdaptive && streamLoadedPatches > 0) {
+        return streamLoadedBytes * chunked_scene.chunks[chunk].count / streamLoadedPatches;
+    }
+    BezierContext grid(isAdaptive ? STREAM_GUESS_DIVISIONS : max(1, (int)(1 / subdivisionSize)));
+    return chunked_scene.chunks[chunk].count *
+        (gridvertexcount(grid, 1) * (long long)sizeof(Vertex) + gridindexcount(grid, 1) * (long long)sizeof(unsigned int));
+}
+
+void streamloader() {
+    BezierContext context(max(1, (int)(1 / subdivisionSize)), isAdaptive ? subdivisionSize : 0);
+    vector<Surface> patches;
+    while (true) {
+        int chunk;
+        {
+            unique_lock<mutex> guard(stream_lock);
+            while (stream_queue.empty() && !streamStopping) {
+                stream_wake.wait(guard);
+            }
+            if (streamStopping) {
+                return;
+            }
+            chunk = stream_queue.front();
+            stream_queue.pop_front();
+            streamInFlight = chunk;
+        }
+        patches.clear();
+        Mesh* mesh = new Mesh();
+        if (chunked_scene.readchunk(chunk, patches) && !patches.empty()) {
+            int n = patches.size();
+            if (isAdaptive) {
+                tessellateadaptive(context, &patches[0], n, *mesh);
+            }
+            else {
+                mesh->vertices.resize((size_t)gridvertexcount(context, n));
+                mesh->indices.resize((size_t)gridindexcount(context, n));
+                tessellategrids(context, &patches[0], n, &mesh->vertices[0], &mesh->indices[0]);
+            }
+        }
+        unique_lock<mutex> guard(stream_lock);
+        stream_loaded.push_back(make_pair(chunk, mesh));
+        streamInFlight = -1;
+        stream_done.notify_all();
+    }
+}
+
+// Registered with atexit, so it runs before the globals the loader waits on are destroyed
+void stopstreaming() {
+    {
+        unique_lock<mutex> guard(stream_lock);
+        streamStopping = true;
+    }
+    stream_wake.notify_all();
+    stream_loader.join();
+}
+
+void startstreaming() {
+    isStreaming = true;
+    stream_chunks.resize(chunked_scene.chunks.size());
+    numberOfPatches = (int)chunked_scene.patchCount;
+    printf("Streaming %s: %lld patches in %d chunks, %.0f MB budget\n", filename.c_str(), chunked_scene.patchCount,
+        (int)chunked_scene.chunks.size(), streamBudget / 1048576.0);
+    stream_loader = thread(streamloader);
+    atexit(stopstreaming);
+}
+
+// Adopts loaded chunks, then picks the chunks to keep and to load for this view
+void streamingupdate(const RenderView& view) {
+    {
+        unique_lock<mutex> guard(stream_lock);
+        while (!stream_loaded.empty()) {
+            int chunk = stream_loaded.front().first;
+            StreamedChunk& c = stream_chunks[chunk];
+            c.mesh.vertices.swap(stream_loaded.front().second->vertices);
+            c.mesh.indices.swap(stream_loaded.front().second->indices);
+            delete stream_loaded.front().second;
+            stream_loaded.pop_front();
+            c.state = CHUNK_RESIDENT;
+            c.bytes = meshbytes(c.mesh);
+            streamResident += c.bytes;
+            streamLoadedPatches += chunked_scene.chunks[chunk].count;
+            streamLoadedBytes += c.bytes;
+        }
+    }
+
+    // eye-space bounds of each chunk against the glOrtho view volume
+    float m[3][4];
+    viewmatrix(view, m);
+    int n = stream_chunks.size();
+    vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+        const SceneChunk& chunk = chunked_scene.chunks[i];
+        float low[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, high[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (int corner = 0; corner < 8; corner++) {
+            float p[3] = { corner & 1 ? chunk.high.x : chunk.low.x, corner & 2 ? chunk.high.y : chunk.low.y,
+                corner & 4 ? chunk.high.z : chunk.low.z };
+            for (int k = 0; k < 3; k++) {
+                float e = m[k][0] * p[0] + m[k][1] * p[1] + m[k][2] * p[2] + m[k][3];
+                low[k] = min(low[k], e);
+                high[k] = max(high[k], e);
+            }
+        }
+        StreamedChunk& c = stream_chunks[i];
+        c.visible = low[0] <= 3 && high[0] >= -3 && low[1] <= 3 && high[1] >= -3 && low[2] <= 3 && high[2] >= -3;
+        c.distance = sqrt(sqr((low[0] + high[0]) * 0.5f) + sqr((low[1] + high[1]) * 0.5f));
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [](int a, int b) {
+        const StreamedChunk& x = stream_chunks[a];
+        const StreamedChunk& y = stream_chunks[b];
+        return x.visible != y.visible ? x.visible : x.distance < y.distance;
+    });
+
+    // visible chunks nearest first, as many as the budget holds
+    vector<bool> wanted(n, false);
+    long long wantedBytes = 0, pendingBytes = 0;
+    for (int k = 0; k < n && stream_chunks[order[k]].visible; k++) {
+        long long bytes = chunkestimate(order[k]);
+        if (wantedBytes + bytes > streamBudget) {
+            break;
+        }
+        wanted[order[k]] = true;
+        wantedBytes += bytes;
+        if (stream_chunks[order[k]].state != CHUNK_RESIDENT) {
+            pendingBytes += bytes;
+        }
+    }
+    for (int k = n - 1; k >= 0 && streamResident + pendingBytes > streamBudget; k--) {
+        StreamedChunk& c = stream_chunks[order[k]];
+        if (c.state == CHUNK_RESIDENT && !wanted[order[k]]) {
+            streamResident -= c.bytes;
+            c.mesh = Mesh();
+            c.bytes = 0;
+            c.state = CHUNK_UNLOADED;
+        }
+    }
+
+    unique_lock<mutex> guard(stream_lock);
+    for (int i = 0; i < (int)stream_queue.size(); i++) {
+        stream_chunks[stream_queue[i]].state = CHUNK_UNLOADED;
+    }
+    stream_queue.clear();
+    for (int k = 0; k < n; k++) {
+        if (wanted[order[k]] && stream_chunks[order[k]].state == CHUNK_UNLOADED) {
+            stream_chunks[order[k]].state = CHUNK_QUEUED;
+            stream_queue.push_back(order[k]);
+        }
+    }
+    if (!stream_queue.empty()) {
+        stream_wake.notify_one();
+    }
+}
+
+void reportstreaming() {
+    int resident = 0, visible = 0, drawn = 0, queued;
+    {
+        unique_lock<mutex> guard(stream_lock);
+        queued = stream_queue.size();
+    }
+    for (int i = 0; i < (int)stream_chunks.size(); i++) {
+        resident += stream_chunks[i].state == CHUNK_RESIDENT;
+        visible += stream_chunks[i].visible;
+        drawn += stream_chunks[i].visible && stream_chunks[i].state == CHUNK_RESIDENT;
+    }
+    printf("Streaming: %d of %d chunks resident, %d of %d in view drawn, %d queued, %.1f of %.0f MB\n", resident,
+        (int)stream_chunks.size(), drawn, visible, queued, streamResident / 1048576.0,
+        streamBudget / 1048576.0);
+}
+
+RenderView viewerview() {
+    RenderView view(viewport.w, viewport.h);
+    view.xTranslate = xVal;
+    view.yTranslate = yVal;
+    view.xRotate = xRotVal;
+    view.yRotate = yRotVal;
+    view.zoom = zoom;
+    return view;
+}
+
+void drawstreaming() {
+    streamingupdate(viewerview());
+    for (int i = 0; i < (int)stream_chunks.size(); i++) {
+        const StreamedChunk& c = stream_chunks[i];
+        if (c.visible && c.state == CHUNK_RESIDENT && !c.mesh.indices.empty()) {
+            drawmesh(&c.mesh.vertices[0], &c.mesh.indices[0], c.mesh.indices.size());
+        }
+    }
+    double now = currentTime();
+    if (now - streamReported > 1.0) {
+        reportstreaming();
+        streamReported = now;
+    }
+}
+
+// Headless: loads everything the view wants, then joins the visible chunks
+void gatherstreamedmesh(const RenderView& view, Mesh& mesh) {
+    while (true) {
+        streamingupdate(view);
+        unique_lock<mutex> guard(stream_lock);
+        if (stream_queue.empty() && streamInFlight < 0 && stream_loaded.empty()) {
+            break;
+        }
+        while (!stream_queue.empty() || streamInFlight >= 0) {
+            stream_done.wait(guard);
+        }
+    }
+    reportstreaming();
+    for (int i = 0; i < (int)stream_chunks.size(); i++) {
+        const StreamedChunk& c = stream_chunks[i];
+        if (c.visible && c.state == CHUNK_RESIDENT) {
+            unsigned int base = mesh.vertices.size();
+            mesh.vertices.insert(mesh.vertices.end(), c.mesh.vertices.begin(), c.mesh.vertices.end());
+            for (int k = 0; k < (int)c.mesh.indices.size(); k++) {
+                mesh.indices.push_back(base + c.mesh.indices[k]);
+            }
+        }
+    }
+}
+
+//****************************************************
+// LOD chains (-lod): every patch tessellated once at load at
+// 2, 4, ... finest divisions; each frame picks a level per
+// patch by projected size and geomorphs newly added vertices.
+// A shared edge is drawn at the coarser of its two patches'
+// levels, so neighbours at different levels meet without cracks
+//****************************************************
+const float LOD_SEGMENT_PIXELS = 8;   // target projected length of one grid segment
+const float LOD_MORPH_RANGE = 0.25f;  // leading part of each level's range spent morphing in
+const int LOD_BENCH_FRAMES = 120;
+
+class LodDraw {
+public:
+    int level;  // -1: outside the view volume
+    float t;    // morph factor, 1 when settled
+    int edgeLevels[4];   // level and morph factor each edge is drawn at
+    float edgeTs[4];
+    bool stitched;       // some edge follows a coarser neighbour
+};
+
+LodChain lod_chain;
+vector<float> lod_bounds; // control point bounds, 6 per patch
+vector<LodDraw> lod_draws;
+vector<Vertex> lod_scratch;
+int lodSwitches, lodMorphs, lodFrames, lodTriangles;
+double lodMorphTime, lodReported;
+
+void buildlodchains() {
+    int n = surface_list.size();
+    double start = currentTime();
+    lod_chain.build(&surface_list[0], n, lodFinest);
+    double elapsed = currentTime() - start;
+    lod_bounds.resize(6 * n);
+    for (int i = 0; i < n; i++) {
+        float* b = &lod_bounds[6 * i];
+        b[0] = b[1] = b[2] = FLT_MAX;
+        b[3] = b[4] = b[5] = -FLT_MAX;
+        const Curve* rows[4] = { &surface_list[i].a, &surface_list[i].b, &surface_list[i].c, &surface_list[i].d };
+        for (int k = 0; k < 4; k++) {
+            const Point* net[4] = { &rows[k]->a, &rows[k]->b, &rows[k]->c, &rows[k]->d };
+            for (int j = 0; j < 4; j++) {
+                const Point& p = *net[j];
+                b[0] = min(b[0], p.x), b[1] = min(b[1], p.y), b[2] = min(b[2], p.z);
+                b[3] = max(b[3], p.x), b[4] = max(b[4], p.y), b[5] = max(b[5], p.z);
+            }
+        }
+    }
+    LodDraw none;
+    none.level = -1;
+    none.t = 1;
+    none.stitched = false;
+    lod_draws.assign(n, none);
+    lod_scratch.resize(lod_chain.patchvertices());
+    int separate = 0;
+    for (int l = 0; l < lod_chain.levels; l++) {
+        separate += (lod_chain.divisions(l) + 1) * (lod_chain.divisions(l) + 1);
+    }
+    int paired = 0;
+    for (int k = 0; k < (int)lod_chain.neighbours.size(); k++) {
+        paired += lod_chain.neighbours[k] >= 0;
+    }
+    printf("LOD chains: %d patches, %d levels (2..%d divisions), %d shared edges, built in %.1f ms\n", n,
+        lod_chain.levels, lod_chain.finest, paired / 2, elapsed * 1e3);
+    size_t shared = 0;
+    for (int l = 0; l < lod_chain.levels; l++) {
+        shared += (lod_chain.strided[l].size() + lod_chain.compact[l].size() + lod_chain.members[l].size() +
+            lod_chain.sources[l].size()) * sizeof(unsigned int);
+    }
+    printf("  %.1f KB per patch (the finest grid; separate grids per level would take %.1f KB), %.1f KB of shared indices\n",
+        lod_chain.patchvertices() * sizeof(Vertex) / 1024.0, separate * sizeof(Vertex) / 1024.0, shared / 1024.0);
+}
+
+// Picks each patch's level and morph factor for the view, then each shared
+// edge's: the coarser of the two patches, or the lower morph factor when the
+// levels match. Returns the number of level switches.
+int selectlods(const RenderView& view) {
+    float m[3][4];
+    viewmatrix(view, m);
+    int switches = 0;
+    for (int i = 0; i < (int)lod_draws.size(); i++) {
+        const float* b = &lod_bounds[6 * i];
+        float low[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, high[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (int corner = 0; corner < 8; corner++) {
+            float p[3] = { b[corner & 1 ? 3 : 0], b[corner & 2 ? 4 : 1], b[corner & 4 ? 5 : 2] };
+            for (int k = 0; k < 3; k++) {
+                float e = m[k][0] * p[0] + m[k][1] * p[1] + m[k][2] * p[2] + m[k][3];
+                low[k] = min(low[k], e);
+                high[k] = max(high[k], e);
+            }
+        }
+        LodDraw& d = lod_draws[i];
+        if (low[0] > 3 || high[0] < -3 || low[1] > 3 || high[1] < -3 || low[2] > 3 || high[2] < -3) {
+            d.level = -1;
+            continue;
+        }
+        // glOrtho spans 6 units across the viewport
+        float pixels = max((high[0] - low[0]) * view.width, (high[1] - low[1]) * view.height) / 6;
+        float x = min((float)lod_chain.levels, log2(max(pixels / LOD_SEGMENT_PIXELS, 2.0f)));
+        int level = (int)ceil(x) - 1;
+        if (d.level >= 0 && d.level != level) {
+            switches++;
+        }
+        d.level = level;
+        d.t = min(1.0f, (x - level) / LOD_MORPH_RANGE);
+    }
+    for (int i = 0; i < (int)lod_draws.size(); i++) {
+        LodDraw& d = lod_draws[i];
+        d.stitched = false;
+        if (d.level < 0) {
+            continue;
+        }
+        for (int e = 0; e < 4; e++) {
+            d.edgeLevels[e] = d.level;
+            d.edgeTs[e] = d.t;
+            int across = lod_chain.neighbours[4 * i + e];
+            if (across < 0) {
+                continue;
+            }
+            const LodDraw& o = lod_draws[across / 4];
+            if (o.level >= 0 && (o.level < d.level || (o.level == d.level && o.t < d.t))) {
+                d.edgeLevels[e] = o.level;
+                d.edgeTs[e] = o.t;
+                d.stitched = true;
+            }
+        }
+    }
+    return switches;
 }
 
-Vector::Vector(Point a, Point b) {
-    float scale = sqrt(pow((b.x - a.x), 2) + pow((b.y - a.y), 2) + pow((b.z - a.z), 2));
-    x = (b.x - a.x) / scale;
-    y = (b.y - a.y) / scale;
-    z = (b.z - a.z) / scale;
+void reportlod(double now) {
+    double elapsed = now - lodReported;
+    printf("LOD: %.0f switches/s, %.1f patches morphing or stitched per frame, morph %.3f ms per frame, %d triangles\n",
+        lodSwitches / elapsed, (double)lodMorphs / max(1, lodFrames), lodMorphTime * 1e3 / max(1, lodFrames),
+        lodTriangles);
+    lodSwitches = 0;
+    lodMorphs = 0;
+    lodFrames = 0;
+    lodMorphTime = 0;
+    lodReported = now;
 }
 
-void Vector::normalize() {
-    float scale = sqrt(pow((x), 2) + pow((y), 2) + pow((z), 2));
-    x /= scale;
-    y /= scale;
-    z /= scale;
+// Settled patches draw straight from the shared buffer, morphing and stitched ones from scratch
+void drawlod() {
+    lodSwitches += selectlods(viewerview());
+    lodTriangles = 0;
+    int pv = lod_chain.patchvertices();
+    for (int i = 0; i < (int)lod_draws.size(); i++) {
+        const LodDraw& d = lod_draws[i];
+        if (d.level < 0) {
+            continue;
+        }
+        if (d.t < 1 || d.stitched) {
+            double start = currentTime();
+            lod_chain.morph(i, d.level, d.t, &lod_scratch[0], d.edgeLevels, d.edgeTs);
+            lodMorphTime += currentTime() - start;
+            lodMorphs++;
+            drawmesh(&lod_scratch[0], &lod_chain.compact[d.level][0], lod_chain.compact[d.level].size());
+        }
+        else {
+            drawmesh(&lod_chain.vertices[(size_t)i * pv], &lod_chain.strided[d.level][0],
+                lod_chain.strided[d.level].size());
+        }
+        lodTriangles += lod_chain.compact[d.level].size() / 3;
+    }
+    lodFrames++;
+    double now = currentTime();
+    if (now - lodReported > 1.0) {
+        reportlod(now);
+    }
 }
 
-Vector Vector::scalarMult(float s) {
-    return Vector(x*s, y*s, z*s);
+// Headless: the patches in view at their selected, morphed levels as one mesh
+void gatherlodmesh(const RenderView& view, Mesh& mesh) {
+    selectlods(view);
+    for (int i = 0; i < (int)lod_draws.size(); i++) {
+        const LodDraw& d = lod_draws[i];
+        if (d.level < 0) {
+            continue;
+        }
+        unsigned int base = mesh.vertices.size();
+        mesh.vertices.resize(base + lod_chain.members[d.level].size());
+        lod_chain.morph(i, d.level, d.t, &mesh.vertices[base], d.edgeLevels, d.edgeTs);
+        const vector<unsigned int>& indices = lod_chain.compact[d.level];
+        for (int k = 0; k < (int)indices.size(); k++) {
+            mesh.indices.push_back(base + indices[k]);
+        }
+    }
 }
 
-Point::Point() {
-    x = 0.0f;
-    y = 0.0f;
-    z = 0.0f;
+// Zoom sweep: per-frame selection and morphing against re-tessellating at
+// the selected levels, which is what the chains replace
+void benchmarklod() {
+    RenderView view(viewport.w > 0 ? viewport.w : 400, viewport.h > 0 ? viewport.h : 400);
+    double select = 0, retessellate = 0;
+    int switches = 0, morphs = 0;
+    vector<BezierContext> contexts;
+    for (int l = 0; l < lod_chain.levels; l++) {
+        contexts.push_back(BezierContext(lod_chain.divisions(l)));
+    }
+    vector<Vertex> grid(lod_chain.patchvertices());
+    for (int f = 0; f < LOD_BENCH_FRAMES; f++) {
+        view.zoom = 0.25f * pow(32.0f, (float)f / (LOD_BENCH_FRAMES - 1));
+        double start = currentTime();
+        switches += selectlods(view);
+        for (int i = 0; i < (int)lod_draws.size(); i++) {
+            const LodDraw& d = lod_draws[i];
+            if (d.level >= 0 && (d.t < 1 || d.stitched)) {
+                lod_chain.morph(i, d.level, d.t, &lod_scratch[0], d.edgeLevels, d.edgeTs);
+                morphs++;
+            }
+        }
+        select += currentTime() - start;
+        start = currentTime();
+        for (int i = 0; i < (int)lod_draws.size(); i++) {
+            if (lod_draws[i].level >= 0) {
+                tessellategrids(contexts[lod_draws[i].level], &surface_list[i], 1, &grid[0], NULL);
+            }
+        }
+        retessellate += currentTime() - start;
+    }
+    printf("LOD zoom sweep, %d frames:  select + morph %.3f ms/frame vs re-tessellating %.3f ms/frame (%.0fx), "
+        "%d switches, %d patch morphs\n", LOD_BENCH_FRAMES, select * 1e3 / LOD_BENCH_FRAMES,
+        retessellate * 1e3 / LOD_BENCH_FRAMES, retessellate / fmax(select, 1e-9), switches, morphs);
 }
 
-Point::Point(float a, float b, float c) {
-    x = a;
-    y = b;
-    z = c;
+//****************************************************
+// Headless rendering (-render): software rasterizer
+// writes the image, then reports frames/s
+//****************************************************
+const double RENDER_BENCH_SECONDS = 1.0;
+
+double renderrate(Rasterizer& rasterizer, const Mesh& mesh, Framebuffer& image, int& frames) {
+    double start = currentTime(), elapsed = 0;
+    for (frames = 0; frames < 3 || elapsed < RENDER_BENCH_SECONDS; frames++) {
+        rasterizer.render(&mesh.vertices[0], mesh.vertices.size(), &mesh.indices[0], mesh.indices.size(),
+            render_view, image);
+        elapsed = currentTime() - start;
+    }
+    return frames / elapsed;
 }
 
-Point Point::scalarMult(float s) {
-    return Point(x*s, y*s, z*s);
+void renderscene(const string& path) {
+    Mesh mesh;
+    useStrips = false; // the rasterizer takes triangle lists
+    if (isStreaming) {
+        gatherstreamedmesh(render_view, mesh);
+    }
+    else if (lodFinest > 0) {
+        gatherlodmesh(render_view, mesh);
+    }
+    else {
+        buildscenemesh(mesh);
+    }
+    if (isOptimized) {
+        optimizescenemesh(mesh);
+    }
+    if (mesh.indices.empty()) {
+        printf("Nothing to render\n");
+        return;
+    }
+    Rasterizer rasterizer;
+    Framebuffer image;
+    double start = currentTime();
+    rasterizer.render(&mesh.vertices[0], mesh.vertices.size(), &mesh.indices[0], mesh.indices.size(),
+        render_view, image);
+    double first = currentTime() - start;
+    if (!writeimage(path.c_str(), image)) {
+        printf("Could not write %s\n", path.c_str());
+        return;
+    }
+    printf("Rendered %s: %dx%d, %d triangles, %s %s, first frame %.2f ms\n", path.c_str(), image.width, image.height,
+        (int)mesh.indices.size() / 3, render_view.flat ? "flat" : "smooth", render_view.filled ? "filled" : "wireframe",
+        first * 1e3);
+    int frames;
+    double rate = renderrate(rasterizer, mesh, image, frames);
+    printf("  %d threads, %d tiles of %d px, %.2f tiles per triangle: %.1f frames/s (%.2f ms)\n",
+        rasterizer.threadCount, rasterizer.tileCount, RASTER_TILE,
+        (double)rasterizer.binnedTriangles / (mesh.indices.size() / 3), rate, 1e3 / rate);
+    if (rasterizer.threadCount > 1) {
+        Rasterizer single(1);
+        double singleRate = renderrate(single, mesh, image, frames);
+        printf("  1 thread: %.1f frames/s (%.2f ms), %.1fx\n", singleRate, 1e3 / singleRate, rate / singleRate);
+    }
 }
 
-Point Point::add(Point p) {
-    return Point(x + p.x, y + p.y, z + p.z);
+//****************************************************
+// Control point editing (-edit): per-patch meshes,
+// only dirty patches are re-tessellated
+//****************************************************
+vector<Mesh> patch_meshes;
+vector<bool> patch_dirty;
+unordered_map<unsigned long long, vector<int> > control_points; // position -> patch * 16 + k * 4 + j
+int selectedPatch;
+int selectedPoint;
+double editTime; // when the pending edit was made, 0 once it is on screen
+
+Point& controlpoint(Surface& s, int k, int j) {
+    Curve& row = k == 0 ? s.a : k == 1 ? s.b : k == 2 ? s.c : s.d;
+    return j == 0 ? row.a : j == 1 ? row.b : j == 2 ? row.c : row.d;
 }
 
-float Point::distance(Point p) {
-    return sqrt(pow((x - p.x), 2) + pow((y - p.y), 2) + pow((z - p.z), 2));
+// -0 and 0 are the same position, so both hash as 0
+unsigned long long pointkey(const Point& p) {
+    float xyz[3] = { p.x == 0 ? 0.0f : p.x, p.y == 0 ? 0.0f : p.y, p.z == 0 ? 0.0f : p.z };
+    return hashbytes(xyz, sizeof(xyz));
 }
 
-Point Point::midpoint(Point p) {
-    return Point((x + p.x) / 2, (y + p.y) / 2, (z + p.z) / 2);
+void buildpatchmeshes() {
+    patch_meshes.assign(surface_list.size(), Mesh());
+    patch_dirty.assign(surface_list.size(), true);
+    control_points.clear();
+    for (int i = 0; i < (int)surface_list.size(); i++) {
+        for (int c = 0; c < 16; c++) {
+            control_points[pointkey(controlpoint(surface_list[i], c / 4, c % 4))].push_back(i * 16 + c);
+        }
+    }
 }
 
-Curve::Curve() {
-
-}
+// Moves control point `index` (k * 4 + j) of `patch`. Every other control point
+// at exactly the same position (seams welded in the file) moves with it, and
+// all patches touched are marked dirty. Cost depends only on the seam valence.
+void movecontrolpoint(int patch, int index, Vector delta) {
+    Point old = controlpoint(surface_list[patch], index / 4, index % 4);
+    unsigned long long key = pointkey(old);
+    vector<int>& bucket = control_points[key];
+    vector<int> moved, kept;
+    for (int b = 0; b < (int)bucket.size(); b++) {
+        Point& p = controlpoint(surface_list[bucket[b] / 16], bucket[b] % 16 / 4, bucket[b] % 4);
+        if (p.x == old.x && p.y == old.y && p.z == old.z) {
+            moved.push_back(bucket[b]);
+        }
+        else {
+            kept.push_back(bucket[b]);
+        }
+    }
+    bucket.swap(kept);
+    if (bucket.empty()) {
+        control_points.erase(key);
+    }
 
-Curve::Curve(Point a1, Point b1, Point c1, Point d1) {
-    a = a1;
-    b = b1;
-    c = c1;
-    d = d1;
+    Point target(old.x + delta.x, old.y + delta.y, old.z + delta.z);
+    vector<int>& destination = control_points[pointkey(target)];
+    for (int m = 0; m < (int)moved.size(); m++) {
+        int owner = moved[m] / 16;
+        controlpoint(surface_list[owner], moved[m] % 16 / 4, moved[m] % 4) = target;
+        destination.push_back(moved[m]);
+        patch_dirty[owner] = true;
+    }
+    editTime = currentTime();
 }
 
-Surface::Surface() {
+void drawpatchmeshes() {
+    double start = currentTime();
+    int rebuilt = 0;
+    for (int i = 0; i < (int)patch_meshes.size(); i++) {
+        if (!patch_dirty[i]) {
+            continue;
+        }
+        if (!monomial_list.empty()) {
+            monomial_list[i] = MonomialPatch(surface_list[i]);
+        }
+        if (!patch_shapes.empty()) {
+            patch_shapes[i] = classifypatch(surface_list[i]);
+        }
+        patch_meshes[i] = Mesh();
+        appendpatchmesh(patch_meshes[i], surface_list[i], evaluatorof(i), patch_divisions.empty() ? 0 : patch_divisions[i],
+            patch_columns.empty() ? 0 : patch_columns[i], shapeof(i));
+        patch_dirty[i] = false;
+        rebuilt++;
+    }
+    double tessellated = currentTime();
+    for (int i = 0; i < (int)patch_meshes.size(); i++) {
+        Mesh& m = patch_meshes[i];
+        if (!m.indices.empty()) {
+            drawmesh(&m.vertices[0], &m.indices[0], m.indices.size());
+        }
+    }
 
-}
+    // selected control point
+    Point p = controlpoint(surface_list[selectedPatch], selectedPoint / 4, selectedPoint % 4);
+    glDisable(GL_LIGHTING);
+    glPointSize(6);
+    glColor3f(1, 0.3f, 0.3f);
+    glBegin(GL_POINTS);
+    glVertex3f(p.x, p.y, p.z);
+    glEnd();
+    glEnable(GL_LIGHTING);
 
-Surface::Surface(Curve a1, Curve b1, Curve c1, Curve d1) {
-    a = a1;
-    b = b1;
-    c = c1;
-    d = d1;
+    if (editTime > 0) {
+        printf("Edit: re-tessellated %d of %d patches in %.2f ms, edit to display %.2f ms\n", rebuilt,
+            (int)patch_meshes.size(), (tessellated - start) * 1e3, (currentTime() - editTime) * 1e3);
+        editTime = 0;
+    }
 }
 
-Triangle::Triangle() {
-
+//****************************************************
+// Keyframed control net animation (-keyframe <file>)
+//****************************************************
+const float KEYFRAME_SECONDS = 1.0f;
+
+Mesh anim_mesh; // grid topology never changes, vertices are rewritten every frame
+vector<Surface> anim_patches;
+BezierContext anim_context(1);
+double animStart;
+double animTessellate, animDraw, animReported;
+int animFrames;
+
+void loadkeyframe(const char* file) {
+    keyframes.push_back(vector<Surface>());
+    loadpatches(file, keyframes.back());
 }
 
-Triangle::Triangle(Point a1, Point b1, Point c1){
-    a = a1;
-    b = b1;
-    c = c1;
+// Keyframes must all have the patch count of the first file; animation always
+// uses the uniform grid so the index buffer is built once
+bool setupanimation() {
+    keyframes.insert(keyframes.begin(), surface_list);
+    for (int f = 1; f < (int)keyframes.size(); f++) {
+        if (keyframes[f].size() != surface_list.size()) {
+            printf("Keyframe %d has %d patches, expected %d; animation disabled\n", f,
+                (int)keyframes[f].size(), (int)surface_list.size());
+            keyframes.clear();
+            return false;
+        }
+    }
+    anim_context = BezierContext((int)(1 / subdivisionSize));
+    anim_patches = surface_list;
+    int n = anim_patches.size();
+    anim_mesh = Mesh();
+    anim_mesh.vertices.resize((size_t)gridvertexcount(anim_context, n));
+    anim_mesh.indices.resize((size_t)gridindexcount(anim_context, n));
+    tessellategrids(anim_context, &anim_patches[0], n, &anim_mesh.vertices[0], &anim_mesh.indices[0]);
+    animStart = currentTime();
+    animReported = animStart;
+    return true;
 }
 
-//****************************************************
-// logic below
-//***************************************************
-
-float dot(Vector a, Vector b) {
-    return a.x*b.x + a.y * b.y + a.z * b.z;
+Point lerppoint(const Point& a, const Point& b, float t) {
+    return Point(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
 }
 
-Vector cross(Vector a, Vector b) {
-    return Vector(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+Curve lerpcurve(const Curve& a, const Curve& b, float t) {
+    return Curve(lerppoint(a.a, b.a, t), lerppoint(a.b, b.b, t), lerppoint(a.c, b.c, t), lerppoint(a.d, b.d, t));
 }
 
-Point bezcurveinterp(Curve curve, float u) {
-    Point a1 = curve.a.scalarMult(1.0 - u).add(curve.b.scalarMult(u));
-    Point b1 = curve.b.scalarMult(1.0 - u).add(curve.c.scalarMult(u));
-    Point c1 = curve.c.scalarMult(1.0 - u).add(curve.d.scalarMult(u));
-
-    Point d1 = a1.scalarMult(1.0 - u).add(b1.scalarMult(u));
-    Point e1 = b1.scalarMult(1.0 - u).add(c1.scalarMult(u));
-
-    Point p = d1.scalarMult(1.0 - u).add(e1.scalarMult(u));
-    Vector der(d1, e1); //TODO is this normalized??
-    //Vector der(e1.x - d1.x, e1.y - d1.y, e1.z - d1.z);
-    p.derivative = der.scalarMult(3);
-
-    return p;
+// Interpolates the nets for time `seconds` (looping) and re-tessellates every patch
+void animateframe(double seconds) {
+    double start = currentTime();
+    double position = fmod(seconds / KEYFRAME_SECONDS, (double)keyframes.size());
+    int from = (int)position;
+    int to = (from + 1) % keyframes.size();
+    float t = (float)(position - from);
+    vector<Surface>& a = keyframes[from];
+    vector<Surface>& b = keyframes[to];
+    int n = anim_patches.size();
+    int perPatch = (int)gridvertexcount(anim_context, 1);
+    parallelfor(n, [&](int i) {
+        anim_patches[i] = Surface(lerpcurve(a[i].a, b[i].a, t), lerpcurve(a[i].b, b[i].b, t),
+            lerpcurve(a[i].c, b[i].c, t), lerpcurve(a[i].d, b[i].d, t));
+        // the context is only read here; indices were written once in setupanimation
+        tessellategrids(anim_context, &anim_patches[i], 1, &anim_mesh.vertices[i * perPatch], NULL);
+    });
+    animTessellate += currentTime() - start;
+    animFrames++;
 }
 
-Point bezpatchinterp(Surface patch, float u, float v) {
-    Point va = bezcurveinterp(patch.a, u);
-    Point vb = bezcurveinterp(patch.b, u);
-    Point vc = bezcurveinterp(patch.c, u);
-    Point vd = bezcurveinterp(patch.d, u);
-    Curve vcurve(va, vb, vc, vd);
-
-    Curve c1(patch.a.a, patch.b.a, patch.c.a, patch.d.a);
-    Curve c2(patch.a.b, patch.b.b, patch.c.b, patch.d.b);
-    Curve c3(patch.a.c, patch.b.c, patch.c.c, patch.d.c);
-    Curve c4(patch.a.d, patch.b.d, patch.c.d, patch.d.d);
-    Point ua = bezcurveinterp(c1, v);
-    Point ub = bezcurveinterp(c2, v);
-    Point uc = bezcurveinterp(c3, v);
-    Point ud = bezcurveinterp(c4, v);
-    Curve ucurve(ua, ub, uc, ud);
-
-    Point pv = bezcurveinterp(vcurve, v);
-    Point pu = bezcurveinterp(ucurve, u);
-
-    Point* p = new Point();
-    *p = pu;
-    p->normal1 = cross(pu.derivative, pv.derivative);
-    p->normal1.normalize();
-    p->normal2 = cross(pv.derivative, pu.derivative);
-    p->normal2.normalize();
-    /*if (dot(p->normal1, light_pos) < 0 && dot(p->normal1, light_pos2) < 0) {
-        p->normal1 = p->normal2;
-        printf("hi");
-    }*/
-    /*if (p->normal1.x == 0 && p->normal1.y == 0 && p->normal1.z == 0){
-        printf("hi");
-    }*/
-    return *p;
-}
-
-void subdividepatchadaptive(Surface patch, float epsilon, Triangle t, float depth) {
-    Point e1m = t.a.midpoint(t.b);
-    Point e2m = t.b.midpoint(t.c);
-    Point e3m = t.c.midpoint(t.a);
-
-    float abu = (t.au + t.bu) / 2;
-    float abv = (t.av + t.bv) / 2;
-    float bcu = (t.bu + t.cu) / 2;
-    float bcv = (t.bv + t.cv) / 2;
-    float cau = (t.cu + t.au) / 2;
-    float cav = (t.cv + t.av) / 2;
-
-    Point e1i = bezpatchinterp(patch, abu, abv);
-    Point e2i = bezpatchinterp(patch, bcu, bcv);
-    Point e3i = bezpatchinterp(patch, cau, cav);
-
-    float e1d = e1m.distance(e1i);
-    float e2d = e2m.distance(e2i);
-    float e3d = e3m.distance(e3i);
-
-    bool e1 = e1d < epsilon;
-    bool e2 = e2d < epsilon;
-    bool e3 = e3d < epsilon;
-
-    if (depth > 5) {
-        triangle_list.push_back(t);
-    }
-    else if (!e1 && !e2 && !e3) {
-        Triangle t1(t.a, e1i, e3i);
-        t1.au = t.au;
-        t1.av = t.av;
-        t1.bu = abu;
-        t1.bv = abv;
-        t1.cu = cau;
-        t1.cv = cav;
-        subdividepatchadaptive(patch, epsilon, t1, depth + 1);
-
-        Triangle t2(e1i, t.b, e2i);
-        t2.au = abu;
-        t2.av = abv;
-        t2.bu = t.bu;
-        t2.bv = t.bv;
-        t2.cu = bcu;
-        t2.cv = bcv;
-        subdividepatchadaptive(patch, epsilon, t2, depth + 1);
-
-        Triangle t3(e3i, e2i, t.c);
-        t3.au = cau;
-        t3.av = cav;
-        t3.bu = bcu;
-        t3.bv = bcv;
-        t3.cu = t.cu;
-        t3.cv = t.cv;
-        subdividepatchadaptive(patch, epsilon, t3, depth + 1);
-
-        Triangle t4(e1i, e2i, e3i);
-        t4.au = abu;
-        t4.av = abv;
-        t4.bu = bcu;
-        t4.bv = bcv;
-        t4.cu = cau;
-        t4.cv = cav;
-        subdividepatchadaptive(patch, epsilon, t4, depth + 1);
-    }
-    else if (!e1 && e2 && e3){
-        Triangle t1(t.a, e1i, t.c);
-        t1.au = t.au;
-        t1.av = t.av;
-        t1.bu = abu;
-        t1.bv = abv;
-        t1.cu = t.cu;
-        t1.cv = t.cv;
-        subdividepatchadaptive(patch, epsilon, t1, depth + 1);
-
-        Triangle t2(e1i, t.b, t.c);
-        t2.au = abu;
-        t2.av = abv;
-        t2.bu = t.bu;
-        t2.bv = t.bv;
-        t2.cu = t.cu;
-        t2.cv = t.cv;
-        subdividepatchadaptive(patch, epsilon, t2, depth + 1);
-    }
-    else if (e1 && !e2 && e3) {
-        Triangle t1(t.a, t.b, e2i);
-        t1.au = t.au;
-        t1.av = t.av;
-        t1.bu = t.bu;
-        t1.bv = t.bv;
-        t1.cu = bcu;
-        t1.cv = bcv;
-        subdividepatchadaptive(patch, epsilon, t1, depth + 1);
-
-        Triangle t2(t.a, e2i, t.c);
-        t2.au = t.au;
-        t2.av = t.av;
-        t2.bu = bcu;
-        t2.bv = bcv;
-        t2.cu = t.cu;
-        t2.cv = t.cv;
-        subdividepatchadaptive(patch, epsilon, t2, depth + 1);
-    }
-    else if (e1 && e2 && !e3) {
-        Triangle t1(t.a, t.b, e3i);
-        t1.au = t.au;
-        t1.av = t.av;
-        t1.bu = t.bu;
-        t1.bv = t.bv;
-        t1.cu = cau;
-        t1.cv = cav;
-        subdividepatchadaptive(patch, epsilon, t1, depth + 1);
-
-        Triangle t2(e3i, t.b, t.c);
-        t2.au = cau;
-        t2.av = cav;
-        t2.bu = t.bu;
-        t2.bv = t.bv;
-        t2.cu = t.cu;
-        t2.cv = t.cv;
-        subdividepatchadaptive(patch, epsilon, t2, depth + 1);
-    }
-    else if (!e1 && !e2 && e3) {
-        Triangle t1(t.a, e1i, e2i);
-        t1.au = t.au;
-        t1.av = t.av;
-        t1.bu = abu;
-        t1.bv = abv;
-        t1.cu = bcu;
-        t1.cv = bcv;
-        subdividepatchadaptive(patch, epsilon, t1, depth + 1);
-
-        Triangle t2(e1i, t.b, e2i);
-        t2.au = abu;
-        t2.av = abv;
-        t2.bu = t.bu;
-        t2.bv = t.bv;
-        t2.cu = bcu;
-        t2.cv = bcv;
-        subdividepatchadaptive(patch, epsilon, t2, depth + 1);
-
-        Triangle t3(t.a, e2i, t.c);
-        t3.au = t.au;
-        t3.av = t.av;
-        t3.bu = bcu;
-        t3.bv = bcv;
-        t3.cu = t.cu;
-        t3.cv = t.cv;
-        subdividepatchadaptive(patch, epsilon, t3, depth + 1);
-    }
-    else if (e1 && !e2 && !e3) {
-        Triangle t1(t.a, t.b, e3i);
-        t1.au = t.au;
-        t1.av = t.av;
-        t1.bu = t.bu;
-        t1.bv = t.bv;
-        t1.cu = cau;
-        t1.cv = cav;
-        subdividepatchadaptive(patch, epsilon, t1, depth + 1);
-
-        Triangle t2(e3i, t.b, e2i);
-        t2.au = cau;
-        t2.av = cav;
-        t2.bu = t.bu;
-        t2.bv = t.bv;
-        t2.cu = bcu;
-        t2.cv = bcv;
-        subdividepatchadaptive(patch, epsilon, t2, depth + 1);
-
-        Triangle t3(e3i, e2i, t.c);
-        t3.au = cau;
-        t3.av = cav;
-        t3.bu = bcu;
-        t3.bv = bcv;
-        t3.cu = t.cu;
-        t3.cv = t.cv;
-        subdividepatchadaptive(patch, epsilon, t3, depth + 1);
-    }
-    else if (!e1 && e2 && !e3) {
-        Triangle t1(t.a, e1i, e3i);
-        t1.au = t.au;
-        t1.av = t.av;
-        t1.bu = abu;
-        t1.bv = abv;
-        t1.cu = cau;
-        t1.cv = cav;
-        subdividepatchadaptive(patch, epsilon, t1, depth + 1);
-
-        Triangle t2(e1i, t.c, e3i);
-        t2.au = abu;
-        t2.av = abv;
-        t2.bu = t.cu;
-        t2.bv = t.cv;
-        t2.cu = cau;
-        t2.cv = cav;
-        subdividepatchadaptive(patch, epsilon, t2, depth + 1);
-
-        Triangle t3(e1i, t.b, t.c);
-        t3.au = abu;
-        t3.av = abv;
-        t3.bu = t.bu;
-        t3.bv = t.bv;
-        t3.cu = t.cu;
-        t3.cv = t.cv;
-        subdividepatchadaptive(patch, epsilon, t3, depth + 1);
-    }
-    else {
-        triangle_list.push_back(t);
-    }
+void reportanimation(double now) {
+    double elapsed = now - animReported;
+    printf("Animation: %.1f fps, per frame %.2f ms interpolate + tessellate, %.2f ms draw (%d patches, %d triangles)\n",
+        animFrames / elapsed, animTessellate * 1e3 / animFrames, animDraw * 1e3 / animFrames,
+        (int)anim_patches.size(), (int)anim_mesh.indices.size() / 3);
+    animFrames = 0;
+    animTessellate = 0;
+    animDraw = 0;
+    animReported = now;
 }
 
-void subdividepatch(Surface patch, float step) {
-    //adaptive
-    if (isAdaptive) {
-        Triangle t1(patch.a.a, patch.d.a, patch.d.d);
-        t1.au = 0;
-        t1.av = 0;
-        t1.bu = 0;
-        t1.bv = 1;
-        t1.cu = 1;
-        t1.cv = 1;
-        subdividepatchadaptive(patch, step, t1, 1);
-
-        Triangle t2(patch.a.a, patch.d.d, patch.a.d);
-        t2.au = 0;
-        t2.av = 0;
-        t2.bu = 1;
-        t2.bv = 1;
-        t2.cu = 1;
-        t2.cv = 0;
-        subdividepatchadaptive(patch, step, t2, 1);
-    }
-    else {
-        //float epsilon = 0.0001; //TODO fix maybe
-        numdiv = (1 / step);
-        float newstep = 1.0 / numdiv;
-
-        for (int iu = 0; iu <= numdiv; iu++) {
-            float u = iu*newstep;
-            patch_points.push_back(vector<Point>());
-            for (int iv = 0; iv <= numdiv; iv++) {
-                float v = iv*newstep;
-
-                Point p = bezpatchinterp(patch, u, v);
-                patch_points[iu].push_back(p);
-                //patch_points[iu][iv] = p;
-            }
-
-        }
+void drawanimation() {
+    animateframe(currentTime() - animStart);
+    double start = currentTime();
+    drawmesh(&anim_mesh.vertices[0], &anim_mesh.indices[0], anim_mesh.indices.size());
+    double now = currentTime();
+    animDraw += now - start;
+    if (now - animReported > 1.0) {
+        reportanimation(now);
     }
 }
 
@@ -493,11 +2471,9 @@ void initScene(){
     light_pos2.y = 1;
     light_pos2.z = -0.5;
     GLfloat light_position[] = { 1.0f, -1.0f, -.5f, 0.0f };
-    GLfloat light_position2[] = { -1.0f, 1.0f, .5f, 0.0f };
     GLfloat light_color[] = { 1.0f, 1.0f, 1.0f, 1.0f }; // White light
     GLfloat ambient_color[] = { 0.2f, 0.2f, 0.2f, 1.0f }; // Weak white light
     glLightfv(GL_LIGHT0, GL_POSITION, light_position);
-    //glLightfv(GL_LIGHT0, GL_POSITION, light_position2);
     glLightfv(GL_LIGHT0, GL_AMBIENT, ambient_color);
     glLightfv(GL_LIGHT0, GL_DIFFUSE, light_color);
     //glLightfv(GL_LIGHT0, GL_SPECULAR, light_color);
@@ -617,23 +2593,89 @@ void drawTriangle(Point bl, Point tl, Point tr) {
 }
 
 void drawSurface(){
+    if (isStreaming) {
+        drawstreaming();
+        return;
+    }
+    if (!lod_draws.empty()) {
+        drawlod();
+        return;
+    }
+    if (!keyframes.empty()) {
+        drawanimation();
+        return;
+    }
+    if (!patch_meshes.empty()) {
+        drawpatchmeshes();
+        return;
+    }
+    if (mesh_index_count > 0) {
+        drawmesh(mesh_vertices, mesh_indices, mesh_index_count, mesh_is_strip);
+        return;
+    }
+    if (!instance_list.empty()) {
+        drawinstances();
+        return;
+    }
+    if (!packed_mesh.groups.empty()) {
+        drawpackedmesh(packed_mesh);
+        return;
+    }
+    if (triangleBudget > 0) {
+        if (budget_list.empty()) {
+            budgettessellation(triangleBudget, subdivisionSize);
+        }
+        for (int i = 0; i < (int)budget_list.size(); i++) {
+            drawTriangle(budget_list[i].a, budget_list[i].b, budget_list[i].c);
+        }
+        return;
+    }
+
+    if (isAdaptive && !isFlatAdaptive && isBreadthFirst && !surface_list.empty()) {
+        static BezierContext context(1, subdivisionSize);
+        triangle_list.clear();
+        tessellatebreadthfirst(context, &surface_list[0], surface_list.size(), triangle_list,
+            isMonomial ? &monomial_list[0] : NULL, patch_shapes.empty() ? NULL : &patch_shapes[0]);
+        for (int i = 0; i < (int)triangle_list.size(); i++) {
+            drawTriangle(triangle_list[i].a, triangle_list[i].b, triangle_list[i].c);
+        }
+        triangle_list.clear();
+        return;
+    }
+    if (isAdaptive && !isFlatAdaptive && !surface_list.empty()) {
+        AdaptiveTriangles generator(&surface_list[0], surface_list.size(), subdivisionSize,
+            isMonomial ? &monomial_list[0] : NULL, patch_shapes.empty() ? NULL : &patch_shapes[0]);
+        vector<Triangle> batch(ADAPTIVE_BATCH);
+        for (int n = generator.next(&batch[0], ADAPTIVE_BATCH); n > 0; n = generator.next(&batch[0], ADAPTIVE_BATCH)) {
+            for (int k = 0; k < n; k++) {
+                drawTriangle(batch[k].a, batch[k].b, batch[k].c);
+            }
+        }
+        return;
+    }
 
-    for (Surface s : surface_list) {
-        subdividepatch(s, subdivisionSize);
+    for (int i = 0; i < (int)surface_list.size(); i++) {
+        Surface s = surface_list[i];
+        if (!patch_divisions.empty() && !isAdaptive && !isFlatAdaptive) {
+            subdividepatchgrid(s, patch_divisions[i], evaluatorof(i), patch_columns.empty() ? 0 : patch_columns[i],
+                shapeof(i));
+        }
+        else {
+            subdividepatch(s, subdivisionSize, evaluatorof(i), shapeof(i));
+        }
 
-        if (!isAdaptive) {
-            for (int iu = 0; iu + 1 <= numdiv; iu++) {
-                for (int iv = 0; iv + 1 <= numdiv; iv++) {
+        if (!isAdaptive && !isFlatAdaptive) {
+            for (int iu = 0; iu + 1 <= patch_grid.rows; iu++) {
+                for (int iv = 0; iv + 1 <= patch_grid.columns; iv++) {
                     Point ll, lr, ul, ur;
-                    ll = patch_points[iu][iv];
-                    lr = patch_points[iu][iv + 1];
-                    ur = patch_points[iu + 1][iv + 1];
-                    ul = patch_points[iu + 1][iv];
+                    ll = patch_grid.at(iu, iv);
+                    lr = patch_grid.at(iu, iv + 1);
+                    ur = patch_grid.at(iu + 1, iv + 1);
+                    ul = patch_grid.at(iu + 1, iv);
                     drawRectangle(ll, ul, ur, lr);
                 }
 
             }
-            patch_points.clear();
         }
         else {
             for (Triangle t : triangle_list) {
@@ -678,12 +2720,8 @@ void myDisplay() {
 
 
     GLfloat cyan[] = { 0.f, .8f, .8f, 1.f };
-    GLfloat mat_specularColor[] = { 1.f, 1.f, 1.f, 1.0f };
-    GLfloat mat_shininess[] = { 120.0 };
     glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, cyan);
     glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, cyan);
-    //glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, mat_specularColor);
-    //glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, mat_shininess);
     drawSurface();
 
 
@@ -693,104 +2731,515 @@ void myDisplay() {
 
 
 void processFile(char* filename) {
-    // create a file-reading object
-    vector<Curve> curve_list;
-    //vector<vector<Point>> surface_in_list;
-    ifstream fin;
-    fin.open(filename); // open a file
-    if (!fin.good()) {
-        return; // exit if file not found
+    loadpatches(filename, surface_list);
+    numberOfPatches = surface_list.size();
+}
+
+//****************************************************
+// Multi-file scenes: more files after the step, or a
+// manifest (.scene) of part files with transforms
+//****************************************************
+void addsceneinput(const char* path) {
+    string name(path);
+    if (name.size() > 6 && name.compare(name.size() - 6, 6, ".scene") == 0) {
+        int line;
+        if (!loadmanifest(path, scene_parts, line)) {
+            printf("Could not read manifest %s (line %d), using the %d parts before it\n", path, line,
+                (int)scene_parts.size());
+        }
     }
+    else {
+        scene_parts.push_back(ScenePart(name));
+    }
+}
 
-    // read each line of the file
-    while (!fin.eof())
-    {
-        // read an entire line into memory
-        char buf[MAX_CHARS_PER_LINE];
-        fin.getline(buf, MAX_CHARS_PER_LINE);
+// Loads every part on all hardware threads into surface_list
+void assemblescene() {
+    int threads = max(1, (int)thread::hardware_concurrency());
+    vector<int> counts;
+    vector<double> seconds;
+    double start = currentTime();
+    loadparts(scene_parts, surface_list, counts, seconds, threads);
+    double elapsed = currentTime() - start;
+    double loading = 0;
+    for (int i = 0; i < (int)scene_parts.size(); i++) {
+        if (counts[i] < 0) {
+            printf("  %s: could not open\n", scene_parts[i].path.c_str());
+        }
+        else {
+            printf("  %s: %d patches, %.1f ms%s\n", scene_parts[i].path.c_str(), counts[i], seconds[i] * 1e3,
+                scene_parts[i].transformed ? ", transformed" : "");
+        }
+        loading += seconds[i];
+    }
+    printf("Assembled %d files into %d patches in %.1f ms on %d threads (%.1f ms of loading, %.2fx)\n",
+        (int)scene_parts.size(), (int)surface_list.size(), elapsed * 1e3, threads, loading * 1e3,
+        elapsed > 0 ? loading / elapsed : 0.0);
+    numberOfPatches = surface_list.size();
+}
+
+// Draws the service's shared-memory buffers in place, like a mapped cache hit
+bool requestscene(const char* file) {
+    int mode = isAdaptive ? SERVICE_ADAPTIVE : SERVICE_UNIFORM;
+    if (!requesttessellation(serviceSocket.c_str(), file, subdivisionSize, mode, service_result)) {
+        printf("No tessellation from %s, tessellating locally\n", serviceSocket.c_str());
+        return false;
+    }
+    mesh_vertices = service_result.vertices;
+    mesh_indices = service_result.indices;
+    mesh_index_count = service_result.indexCount;
+    mesh_is_strip = false;
+    const char* how[] = { "tessellated", "coalesced", "cached" };
+    printf("Service: %u vertices, %d triangles in %.2f ms (%.2f ms in the server, %s)\n", service_result.vertexCount,
+        service_result.indexCount / 3, service_result.latency * 1e3, service_result.response.serverLatency * 1e3,
+        how[service_result.response.source]);
+    return true;
+}
 
-        // parse the line into blank-delimited tokens
-        int n = 0; // a for-loop index
+void processArgs(int argc, char *argv[]) {
+    filename = string(argv[1]);
+    char* temp = argv[1];
+    subdivisionSize = strtof(argv[2], &temp);
+    addsceneinput(argv[1]);
+    for (int i = 3; i < argc; i++) {
+        string ad(argv[i]);
+        if (ad == "-a"){
+            isAdaptive = true;
+        }
+        else if (ad == "-f") {
+            isFlatAdaptive = true;
+        }
+        else if (ad == "-b" && i + 1 < argc) {
+            triangleBudget = atoi(argv[++i]);
+        }
+        else if (ad == "-m") {
+            isMonomial = true;
+        }
+        else if (ad == "-bench") {
+            isBenchmark = true;
+        }
+        else if (ad == "-analyze") {
+            isAnalyze = true;
+        }
+        else if (ad == "-autostep" && i + 1 < argc) {
+            autoStepError = strtof(argv[++i], &temp);
+        }
+        else if (ad == "-instance") {
+            isInstanced = true;
+        }
+        else if (ad == "-optimize") {
+            isOptimized = true;
+        }
+        else if (ad == "-spacing") {
+            isSpaced = true;
+        }
+        else if (ad == "-strips") {
+            useStrips = true;
+            isOptimized = true;
+        }
+        else if (ad == "-pack") {
+            isPacked = true;
+        }
+        else if (ad == "-export" && i + 1 < argc) {
+            exportFile = argv[++i];
+        }
+        else if (ad == "-sample" && i + 2 < argc) {
+            sampleCount = max(0LL, atoll(argv[++i]));
+            sampleFile = argv[++i];
+        }
+        else if (ad == "-poisson") {
+            isPoisson = true;
+        }
+        else if (ad == "-seed" && i + 1 < argc) {
+            sampleSeed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (ad == "-keyframe" && i + 1 < argc) {
+            loadkeyframe(argv[++i]);
+        }
+        else if (ad == "-breadth") {
+            isBreadthFirst = true;
+        }
+        else if (ad == "-render" && i + 1 < argc) {
+            renderFile = argv[++i];
+        }
+        else if (ad == "-size" && i + 2 < argc) {
+            render_view.width = max(1, atoi(argv[++i]));
+            render_view.height = max(1, atoi(argv[++i]));
+        }
+        else if (ad == "-view" && i + 3 < argc) {
+            render_view.xRotate = strtof(argv[++i], &temp);
+            render_view.yRotate = strtof(argv[++i], &temp);
+            render_view.zoom = strtof(argv[++i], &temp);
+        }
+        else if (ad == "-smooth") {
+            render_view.flat = false;
+        }
+        else if (ad == "-wireframe") {
+            render_view.filled = false;
+        }
+        else if (ad == "-request" && i + 1 < argc) {
+            serviceSocket = argv[++i];
+        }
+        else if (ad == "-edit") {
+            isEditing = true;
+        }
+        else if (ad == "-cache" && i + 1 < argc) {
+            cacheDir = argv[++i];
+        }
+        else if (ad == "-cachesize" && i + 1 < argc) {
+            cacheLimit = atoll(argv[++i]) << 20;
+        }
+        else if (ad == "-lod" && i + 1 < argc) {
+            lodFinest = max(2, atoi(argv[++i]));
+        }
+        else if (ad == "-budget" && i + 1 < argc) {
+            streamBudget = atoll(argv[++i]) << 20;
+        }
+        else if (ad[0] != '-') {
+            addsceneinput(argv[i]);
+        }
+    }
+    // one plain file keeps the single-file paths: streaming, service and cache
+    bool single = scene_parts.size() == 1 && !scene_parts[0].transformed && scene_parts[0].path == argv[1];
+
+    // chunked scenes are streamed by the viewer and -render; the other
+    // headless modes read them whole through loadpatches
+    if (single && !isBenchmark && !isAnalyze && exportFile.empty() && sampleFile.empty() && chunked_scene.open(argv[1])) {
+        startstreaming();
+        return;
+    }
 
-        // array to store memory addresses of the tokens in buf
-        const char* token[MAX_TOKENS_PER_LINE] = {}; // initialize to 0
+    // the cache only serves the viewer, the headless reports need the patches
+    if (single && !serviceSocket.empty() && requestscene(argv[1])) {
+        return;
+    }
+    // the cache holds one plain mesh, which -instance, -pack and -lod do not draw from
+    if (!cacheDir.empty() && (isInstanced || isPacked || lodFinest > 0)) {
+        printf("-cache ignored: it stores plain scene meshes, not %s output\n",
+            isInstanced ? "-instance" : isPacked ? "-pack" : "-lod");
+        cacheDir.clear();
+    }
+    bool useCache = single && !cacheDir.empty() && !isBenchmark && !isAnalyze && exportFile.empty() && sampleFile.empty()
+        && !isEditing && keyframes.empty();
+    if (useCache && loadcachedscene(argv[1])) {
+        return;
+    }
 
-        // parse the line
-        token[0] = strtok(buf, DELIMITER); // first token
+    double start = currentTime();
+    if (single) {
+        processFile(argv[1]);
+    }
+    else {
+        assemblescene();
+    }
 
+    // power-basis conversion happens once here, the benchmark and the
+    // accuracy analyzer always need it
+    if (isMonomial || isBenchmark || isAnalyze || autoStepError > 0) {
+        for (Surface s : surface_list) {
+            monomial_list.push_back(MonomialPatch(s));
+        }
+    }
+    if (keyframes.empty()) {
+        classifyshapes();
+    }
+    if (autoStepError > 0) {
+        selectpatchsteps(autoStepError);
+    }
+    if (!keyframes.empty()) {
+        setupanimation();
+    }
+    if (lodFinest > 0 && !surface_list.empty()) {
+        buildlodchains();
+    }
+    if (useCache) {
+        storecachedscene(currentTime() - start);
+    }
+    else if (!keyframes.empty() || !exportFile.empty() || !sampleFile.empty() || !renderFile.empty() || isBenchmark
+        || isAnalyze) {
+        // headless, nothing to prepare for drawing
+    }
+    else if (isEditing && triangleBudget == 0 && !surface_list.empty()) {
+        buildpatchmeshes();
+    }
+    else if (isInstanced && triangleBudget == 0 && !isBenchmark && !isAnalyze) {
+        buildinstances();
+    }
+    else if (isPacked && !isBenchmark && !isAnalyze) {
+        useStrips = false; // groups are triangle lists
+        buildscenemesh(scene_mesh);
+        if (isOptimized) {
+            optimizescenemesh(scene_mesh);
+        }
+        packmesh(scene_mesh, packed_mesh);
+        reportpacking(scene_mesh, packed_mesh);
+        scene_mesh = Mesh();
+    }
+    else if (isOptimized && !isBenchmark && !isAnalyze) {
+        buildscenemesh(scene_mesh);
+        optimizescenemesh(scene_mesh);
+        usescenemesh();
+    }
+}
 
-        if (!token[0]){
-            continue;
+//****************************************************
+// Headless benchmark (-bench): evaluator speed and error
+//****************************************************
+void tessellateAll(bool useMonomial, bool useShapes = false) {
+    for (int i = 0; i < (int)surface_list.size(); i++) {
+        if (useShapes) {
+            subdividepatch(surface_list[i], subdivisionSize, evaluatorof(i), shapeof(i));
+        }
+        else {
+            subdividepatch(surface_list[i], subdivisionSize, useMonomial ? &monomial_list[i] : NULL);
         }
+        triangle_list.clear();
+    }
+}
 
-        if (token[0]) // zero if line is blank
-        {
-            for (n = 1; n < MAX_TOKENS_PER_LINE; n++)
-            {
-                token[n] = strtok(0, DELIMITER); // subsequent tokens
-                if (!token[n]) break; // no more tokens
+const int QUERY_SAMPLES = 200000;
+const int QUERY_CHECKS = 100;  // queries compared against dense sampling
+const int QUERY_CHECK_GRID = 64;
+
+// Closest-point queries at random points around the scene
+void benchmarkqueries() {
+    int n = surface_list.size();
+    double start = currentTime();
+    SurfaceQuery query(&surface_list[0], n);
+    double build = currentTime() - start;
+
+    float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (int i = 0; i < n; i++) {
+        SubPatch net(surface_list[i]);
+        for (int k = 0; k < 16; k++) {
+            Point& p = net.p[k / 4][k % 4];
+            float c[3] = { p.x, p.y, p.z };
+            for (int a = 0; a < 3; a++) {
+                lo[a] = fmin(lo[a], c[a]);
+                hi[a] = fmax(hi[a], c[a]);
+            }
+        }
+    }
+    vector<Point> points(QUERY_SAMPLES);
+    for (int i = 0; i < QUERY_SAMPLES; i++) {
+        float c[3];
+        for (int a = 0; a < 3; a++) {
+            float margin = (hi[a] - lo[a]) * 0.25f;
+            c[a] = lo[a] - margin + (hi[a] - lo[a] + 2 * margin) * rand() / RAND_MAX;
+        }
+        points[i] = Point(c[0], c[1], c[2]);
+    }
+    vector<ClosestPoint> results(QUERY_SAMPLES);
+    int threads = max(1, (int)thread::hardware_concurrency());
+    start = currentTime();
+    closestpoints(query, &points[0], QUERY_SAMPLES, &results[0], threads);
+    double elapsed = currentTime() - start;
+
+    // the engine should never be farther than the best of a dense grid
+    float worst = 0;
+    for (int i = 0; i < QUERY_CHECKS; i++) {
+        float dense = FLT_MAX;
+        for (int p = 0; p < n; p++) {
+            for (int iu = 0; iu <= QUERY_CHECK_GRID; iu++) {
+                for (int iv = 0; iv <= QUERY_CHECK_GRID; iv++) {
+                    Point s = monopatchinterp(monomial_list[p], (float)iu / QUERY_CHECK_GRID, (float)iv / QUERY_CHECK_GRID);
+                    dense = fmin(dense, s.distance(points[i]));
+                }
             }
         }
+        worst = fmax(worst, results[i].distance - dense);
+    }
+    printf("closest point: BVH build %.2f ms, %.0f queries/s on %d threads, worst excess over %dx%d sampling %g\n",
+        build * 1e3, QUERY_SAMPLES / elapsed, threads, QUERY_CHECK_GRID, QUERY_CHECK_GRID, worst);
+}
 
-        char* temp = "";
-        std::string str(token[0]);
+void runBenchmark() {
+    const int samples = 200000;
+    vector<float> us(samples), vs(samples);
+    srand(184);
+    for (int i = 0; i < samples; i++) {
+        us[i] = (float)rand() / RAND_MAX;
+        vs[i] = (float)rand() / RAND_MAX;
+    }
+    int n = surface_list.size();
+    printf("%s: %d patches, step %f, %s\n", filename.c_str(), n, subdivisionSize, isAdaptive ? "adaptive" : "uniform");
+    if (n == 0) {
+        return;
+    }
 
+    float checksum = 0;
+    double start = currentTime();
+    for (int i = 0; i < samples; i++) {
+        checksum += bezpatchinterp(surface_list[i % n], us[i], vs[i]).x;
+    }
+    double decasteljau = currentTime() - start;
 
-        // process the tokens
-        if (!token[1]) { //pls
-            numberOfPatches = atoi(token[0]);
+    start = currentTime();
+    for (int i = 0; i < samples; i++) {
+        checksum += monopatchinterp(monomial_list[i % n], us[i], vs[i]).x;
+    }
+    double horner = currentTime() - start;
+
+    // the same points in one monopatchbatch per patch, as tessellatebreadthfirst evaluates them
+    vector<Point> batch(samples);
+    start = currentTime();
+    for (int i = 0; i < n; i++) {
+        int first = (int)((long long)samples * i / n), last = (int)((long long)samples * (i + 1) / n);
+        monopatchbatch(monomial_list[i], &us[first], &vs[first], last - first, &batch[first]);
+    }
+    double batched = currentTime() - start;
+    int mismatches = 0;
+    for (int i = 0; i < n; i++) {
+        int first = (int)((long long)samples * i / n), last = (int)((long long)samples * (i + 1) / n);
+        for (int k = first; k < last; k++) {
+            Point p = monopatchinterp(monomial_list[i], us[k], vs[k]);
+            mismatches += p.x != batch[k].x || p.y != batch[k].y || p.z != batch[k].z;
         }
-        else {
-            //vector<Point> curve_in_list;
-            Point a;
-            a.x = strtof(token[0], &temp);
-            a.y = strtof(token[1], &temp);
-            a.z = strtof(token[2], &temp);
-            Point b;
-            b.x = strtof(token[3], &temp);
-            b.y = strtof(token[4], &temp);
-            b.z = strtof(token[5], &temp);
-            Point c;
-            c.x = strtof(token[6], &temp);
-            c.y = strtof(token[7], &temp);
-            c.z = strtof(token[8], &temp);
-            Point d;
-            d.x = strtof(token[9], &temp);
-            d.y = strtof(token[10], &temp);
-            d.z = strtof(token[11], &temp);
-
-            /*curve_in_list.push_back(a);
-            curve_in_list.push_back(b);
-            curve_in_list.push_back(c);
-            curve_in_list.push_back(d);*/
+        checksum += batch[first].x;
+    }
 
-            Curve curve(a, b, c, d);
-            curve_list.push_back(curve);
-            //surface_in_list.push_back(curve_in_list);
+    float maxError = 0;
+    float maxNormalError = 0;
+    for (int i = 0; i < samples; i++) {
+        Point a = bezpatchinterp(surface_list[i % n], us[i], vs[i]);
+        Point b = monopatchinterp(monomial_list[i % n], us[i], vs[i]);
+        maxError = fmax(maxError, a.distance(b));
+        float nd = 1 - dot(a.normal1, b.normal1);
+        if (nd == nd) { // skip degenerate normals (NaN) at collapsed corners
+            maxNormalError = fmax(maxNormalError, nd);
+        }
+    }
 
-            if (curve_list.size() == 4) {
-                Surface s(curve_list[0], curve_list[1], curve_list[2], curve_list[3]);
-                //s.points = surface_in_list;
+    printf("eval de Casteljau: %8.1f ns/point\n", decasteljau * 1e9 / samples);
+    printf("eval Horner:       %8.1f ns/point (%.2fx)\n", horner * 1e9 / samples, decasteljau / horner);
+    printf("eval Horner batch: %8.1f ns/point (%.2fx), %.1f M evaluations/s, %d points differ from Horner\n",
+        batched * 1e9 / samples, decasteljau / batched, samples / batched * 1e-6, mismatches);
+    printf("max position error %g, max normal error (1 - cos) %g\n", maxError, maxNormalError);
+
+    // compare evaluators on the generic loops, the specialized grids are timed below
+    const int reps = 5;
+    draw_context.fixedKernels = false;
+    start = currentTime();
+    for (int r = 0; r < reps; r++) {
+        tessellateAll(false);
+    }
+    double tessBezier = (currentTime() - start) / reps;
+    start = currentTime();
+    for (int r = 0; r < reps; r++) {
+        tessellateAll(true);
+    }
+    double tessMonomial = (currentTime() - start) / reps;
+    double tessShapes = 0;
+    if (!patch_shapes.empty()) {
+        start = currentTime();
+        for (int r = 0; r < reps; r++) {
+            tessellateAll(isMonomial, true);
+        }
+        tessShapes = (currentTime() - start) / reps;
+    }
+    draw_context.fixedKernels = true;
+    printf("tessellate de Casteljau: %8.3f ms\n", tessBezier * 1e3);
+    printf("tessellate Horner:       %8.3f ms (%.2fx)\n", tessMonomial * 1e3, tessBezier / tessMonomial);
+    if (tessShapes > 0) {
+        printf("tessellate shape paths:  %8.3f ms (%.2fx), flat and reduced-degree patches as classified at load\n",
+            tessShapes * 1e3, tessBezier / tessShapes);
+    }
 
-                curve_list.clear(); //TODO hopefully this works
-                //surface_in_list.clear();
+    // each fixed grid kernel against the runtime-sized instance of the same kernel at the same size
+    const int fixedSizes[4] = { 4, 8, 16, 32 };
+    for (int f = 0; f < 4; f++) {
+        int size = fixedSizes[f];
+        vector<float> b, db;
+        bernsteintables(size, b, db);
+        vector<Vertex> grid((size + 1) * (size + 1));
+        double generic = 0, fixed = 0;
+        for (int r = 0; r < reps; r++) {
+            start = currentTime();
+            for (int i = 0; i < n; i++) {
+                gridkernelgeneric(surface_list[i], size, &b[0], &db[0], &grid[0]);
+            }
+            generic += currentTime() - start;
+            start = currentTime();
+            for (int i = 0; i < n; i++) {
+                gridkernel(surface_list[i], size, NULL, NULL, &grid[0]);
+            }
+            fixed += currentTime() - start;
+        }
+        printf("grid kernel %2d x %-2d:     %8.2f us/patch fixed, %8.2f us/patch runtime-sized (%.2fx)\n", size,
+            size, fixed * 1e6 / reps / n, generic * 1e6 / reps / n, generic / fixed);
+    }
 
-                surface_list.push_back(s);
+    // library calls from several threads at once, one context and one span of patches each
+    int threads = max(1, min(n, (int)thread::hardware_concurrency()));
+    vector<Mesh> outputs(threads);
+    start = currentTime();
+    vector<thread> pool;
+    for (int t = 0; t < threads; t++) {
+        pool.push_back(thread([&, t]() {
+            BezierContext context((int)(1 / subdivisionSize), isAdaptive ? subdivisionSize : 0);
+            int first = n * t / threads;
+            int count = n * (t + 1) / threads - first;
+            Mesh& out = outputs[t];
+            if (context.epsilon > 0) {
+                tessellateadaptive(context, &surface_list[first], count, out);
             }
+            else {
+                out.vertices.resize((size_t)gridvertexcount(context, count));
+                out.indices.resize((size_t)gridindexcount(context, count));
+                tessellategrids(context, &surface_list[first], count, &out.vertices[0], &out.indices[0]);
+            }
+        }));
+    }
+    for (int t = 0; t < threads; t++) {
+        pool[t].join();
+    }
+    int libraryTriangles = 0;
+    for (int t = 0; t < threads; t++) {
+        libraryTriangles += outputs[t].indices.size() / 3;
+    }
+    printf("library, %d threads:     %8.3f ms (%d triangles)\n", threads, (currentTime() - start) * 1e3, libraryTriangles);
+    if (isAdaptive) {
+        start = currentTime();
+        AdaptiveTriangles generator(&surface_list[0], n, subdivisionSize);
+        vector<Triangle> batch(ADAPTIVE_BATCH);
+        int streamed = 0;
+        for (int got = generator.next(&batch[0], ADAPTIVE_BATCH); got > 0; got = generator.next(&batch[0], ADAPTIVE_BATCH)) {
+            streamed += got;
+        }
+        printf("adaptive generator:      %8.3f ms (%d triangles, at most %d pending + %d per batch held)\n",
+            (currentTime() - start) * 1e3, streamed, generator.peakPending, ADAPTIVE_BATCH);
+
+        BezierContext context(1, subdivisionSize);
+        vector<Triangle> depthFirst, breadthFirst;
+        start = currentTime();
+        for (int i = 0; i < n; i++) {
+            adaptivepatch(surface_list[i], subdivisionSize, depthFirst);
         }
+        double recursive = currentTime() - start;
+        start = currentTime();
+        tessellatebreadthfirst(context, &surface_list[0], n, breadthFirst);
+        double levels = currentTime() - start;
+        // depth-first evaluates every midpoint it needs, breadth-first each shared one once
+        printf("adaptive depth-first:    %8.3f ms, %.1f M evaluations/s\n", recursive * 1e3,
+            context.requests / recursive * 1e-6);
+        printf("adaptive breadth-first:  %8.3f ms (%.2fx), %.1f M evaluations/s, %lld of %lld midpoints evaluated"
+            " after merging shared edges\n", levels * 1e3, recursive / levels, context.evaluations / levels * 1e-6,
+            context.evaluations, context.requests);
+        printf("  %d triangles depth-first, %d breadth-first\n", (int)depthFirst.size(), (int)breadthFirst.size());
     }
-}
+    benchmarkqueries();
+    if (!lod_draws.empty()) {
+        benchmarklod();
+    }
+    printf("(checksum %f)\n", checksum);
 
-void processArgs(int argc, char *argv[]) {
-    filename = string(argv[1]);
-    char* temp = argv[1];
-    subdivisionSize = strtof(argv[2], &temp);
-    processFile(argv[1]);
-    if (argv[3]) {
-        string ad(argv[3]);
-        if (ad == "-a"){
-            isAdaptive = true;
+    if (!keyframes.empty()) {
+        const int frames = 200;
+        for (int f = 0; f < frames; f++) {
+            animateframe(f / 60.0);
         }
+        printf("animation, %d frames without drawing: %.2f ms per frame (%.0f fps), %d triangles\n", frames,
+            animTessellate * 1e3 / frames, frames / animTessellate, (int)anim_mesh.indices.size() / 3);
     }
 }
 
@@ -805,7 +3254,23 @@ void toggleFill() {
     filledPolys = !filledPolys;
     printf("Switching fill mode.\n");
 }
-void key(unsigned char key, int x, int y) {
+
+// Editing needs the per-patch meshes, which -b, a -cache hit, -request,
+// chunked scenes and empty scenes do not build
+bool canedit() {
+    return isEditing && !patch_meshes.empty();
+}
+
+void selectNextPatch() {
+    selectedPatch = (selectedPatch + 1) % surface_list.size();
+    printf("Selected patch %d, control point %d\n", selectedPatch, selectedPoint);
+}
+
+void selectNextPoint() {
+    selectedPoint = (selectedPoint + 1) % 16;
+    printf("Selected patch %d, control point %d\n", selectedPatch, selectedPoint);
+}
+void key(unsigned char key, int, int) {
     //prevKeyBuffer[key] = false;
     //keyBuffer[key] = true;
     switch (key) {
@@ -824,15 +3289,35 @@ void key(unsigned char key, int x, int y) {
     case '-':
         zoom -= 0.2;
         break;
+    case 'n':
+        if (canedit()) {
+            selectNextPatch();
+        }
+        break;
+    case 'c':
+        if (canedit()) {
+            selectNextPoint();
+        }
+        break;
+    case 'i':
+        if (canedit()) {
+            movecontrolpoint(selectedPatch, selectedPoint, Vector(0, 0, 0.1f));
+        }
+        break;
+    case 'k':
+        if (canedit()) {
+            movecontrolpoint(selectedPatch, selectedPoint, Vector(0, 0, -0.1f));
+        }
+        break;
     }
 }
 
-void keyUp(unsigned char key, int x, int y) {
+void keyUp(unsigned char, int, int) {
     //prevKeyBuffer[key] = true;
     //keyBuffer[key] = false;
 }
 
-void specKey(int key, int x, int y) {
+void specKey(int key, int, int) {
     int mod = glutGetModifiers();
     switch (key) {
 
@@ -892,7 +3377,7 @@ void specKey(int key, int x, int y) {
     //keyBuffer[key] = true;
 }
 
-void specKeyUp(int key, int x, int y) {
+void specKeyUp(int, int, int) {
     //prevKeyBuffer[key] = true;
     //keyBuffer[key] = false;
 }
@@ -910,7 +3395,50 @@ void idle() {
 // the usual stuff, nothing exciting here
 //****************************************************
 int main(int argc, char *argv[]) {
+    if (argc >= 3 && string(argv[1]) == "-serve") {
+        return servetessellation(argv[2], argc >= 4 ? atoll(argv[3]) << 20 : cacheLimit);
+    }
+    if (argc >= 3 && string(argv[1]) == "-stopservice") {
+        ServiceResult ignored;
+        return requesttessellation(argv[2], "", 0, SERVICE_SHUTDOWN, ignored) ? 0 : 1;
+    }
+    if (argc >= 4 && string(argv[1]) == "-chunk") {
+        double start = currentTime();
+        if (!chunkpatches(argv[2], argv[3], argc >= 5 ? atoi(argv[4]) : CHUNK_PATCHES)) {
+            printf("Could not chunk %s into %s\n", argv[2], argv[3]);
+            return 1;
+        }
+        ChunkedScene chunked;
+        chunked.open(argv[3]);
+        printf("Chunked %s: %lld patches in %d chunks, %.1f ms\n", argv[3], chunked.patchCount,
+            (int)chunked.chunks.size(), (currentTime() - start) * 1e3);
+        return 0;
+    }
     processArgs(argc, argv);
+    if (isBenchmark) {
+        runBenchmark();
+        return 0;
+    }
+    if (isAnalyze) {
+        analyzetessellation();
+        return 0;
+    }
+    if (!exportFile.empty()) {
+        exportmesh(exportFile);
+        return 0;
+    }
+    if (!sampleFile.empty()) {
+        samplesurfaces(sampleFile);
+        return 0;
+    }
+    if (!renderFile.empty()) {
+        renderscene(renderFile);
+        return 0;
+    }
+    if (isEditing && !canedit()) {
+        printf("-edit needs a plain scene with patches and no -b, -request or cache hit, editing is off\n");
+        isEditing = false;
+    }
 
 
     flatShading = true;
@@ -1,12 +1,7 @@
-#include <vector>
-#include <iostream>
-#include <fstream>
-#include <cmath>
+#include "BezierLib.h"
 
 #ifdef _WIN32
 #include <windows.h>
-#else
-#include <sys/time.h>
 #endif
 
 #ifdef OSX
@@ -28,58 +23,44 @@ inline float sqr(float x) { return x*x; }
 
 using namespace std;
 
-class Point;
-
-class Vector {
+// 12 byte vertex in types fixed-function GL reads directly: position as
+// shorts in its group's cube, normal as normalized shorts. The packed mesh
+// is only drawn, and drawing never reads uv, so it is left out.
+class PackedVertex {
 public:
-    float x, y, z;
-    Vector();
-    Vector(float a, float b, float c);
-    Vector(Point a, Point b);
-    void normalize();
-    Vector scalarMult(float s);
-
-
-    /*Vector add(Vector);
-    Vector sub(Vector);
-    Vector mul(float);
-    Vector div(float);
-    Vector normalize();*/
+    short x, y, z;
+    short nx, ny, nz;
 };
 
-class Point {
+// Triangles of one patch (or a piece of it) with 16-bit local indices;
+// position = center + scale * (x, y, z)
+class PackedGroup {
 public:
-    float x, y, z;
-    Vector derivative, normal1, normal2;
-    Point();
-    Point(float a, float b, float c);
-    Point scalarMult(float s);
-    Point add(Point p);
-    Point midpoint(Point p);
-    float distance(Point p);
-    //Point sub(Vector);
+    float center[3], scale;
+    unsigned int firstVertex, vertexCount, firstIndex, indexCount;
 };
 
-class Curve {
+class PackedMesh {
 public:
-    Point a, b, c, d;
-    Curve();
-    Curve(Point a1, Point b1, Point c1, Point d1);
+    vector<PackedVertex> vertices;
+    vector<unsigned short> indices;
+    vector<PackedGroup> groups;
 };
 
-class Surface {
+// One chunk of an out-of-core scene and, while resident, its tessellation
+class StreamedChunk {
 public:
-    Curve a, b, c, d;
-    //vector<vector<Point>> points;
-    Surface();
-    Surface(Curve a1, Curve b1, Curve c1, Curve d1);
+    int state;       // CHUNK_* in BezierSurfaces.cpp
+    Mesh mesh;
+    long long bytes; // mesh memory while resident
+    bool visible;    // bounds overlap the view volume this frame
+    float distance;  // of the bounds' center from the view axis, eye space
+    StreamedChunk() : state(0), bytes(0), visible(false), distance(0) {}
 };
 
-class Triangle {
+// One drawn copy of a deduplicated patch: world = transform * prototype
+class PatchInstance {
 public:
-    Point a, b, c;
-    float au, av, bu, bv, cu, cv;
-    Triangle();
-    Triangle(Point a1, Point b1, Point c1);
-    
-};
\ No newline at end of file
+    int prototype;
+    float transform[16]; // column-major, for glMultMatrixf
+};